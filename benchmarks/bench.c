@@ -0,0 +1,259 @@
+/*
+Benchmark runner, run it through `make bench` (see the Makefile for the
+BASELINE, BENCH_RUNS and BENCH_WARMUP knobs).
+
+  bench [--runs n] [--warmup n] [--baseline <clox>] <clox> <script>...
+  bench --generate <dir>
+
+Every script is run `warmup` times without being timed and then `runs` more
+times, as a separate process with its output thrown away and --no-cache, so
+the bytecode cache never hides the compiler. For each script it reports the
+median wall time, the median absolute deviation around it (as a percentage,
+a robust measure of the noise) and the fastest and slowest run.
+
+With --baseline the runs of both binaries are interleaved, which keeps a
+machine that speeds up or slows down during the run from favouring either
+side, and the ratio of the medians is printed next to them. A change smaller
+than the combined spread is marked as noise.
+
+--generate writes the synthetic part of the corpus, scripts that are too big
+to check in: constants.lox (thousands of literals, globals and functions, all
+compile time) and scan.lox (a few megabytes of declarations that are never
+called, mostly scanner time).
+*/
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MAX_RUNS 1000
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+// Wall time of one run in seconds, negative if it didn't exit cleanly
+static double timeRun(const char* clox, const char* script) {
+  double start = now();
+  pid_t pid = fork();
+  if (pid < 0) return -1;
+
+  if (pid == 0) {
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+      dup2(null, STDOUT_FILENO);
+      dup2(null, STDERR_FILENO);
+    }
+    execl(clox, clox, "--no-cache", script, (char*)NULL);
+    _exit(127);
+  }
+
+  int status;
+  if (waitpid(pid, &status, 0) < 0) return -1;
+  double elapsed = now() - start;
+  if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) return -1;
+  return elapsed;
+}
+
+static int compareTimes(const void* a, const void* b) {
+  double left = *(const double*)a;
+  double right = *(const double*)b;
+  return left < right ? -1 : left > right ? 1 : 0;
+}
+
+typedef struct {
+  double median;
+  double spread; // median absolute deviation, relative to the median
+  double min;
+  double max;
+} Summary;
+
+// Sorts times in place
+static Summary summarize(double* times, int count) {
+  qsort(times, count, sizeof(double), compareTimes);
+  Summary summary;
+  summary.min = times[0];
+  summary.max = times[count - 1];
+  summary.median = count % 2 == 1
+                       ? times[count / 2]
+                       : (times[count / 2 - 1] + times[count / 2]) / 2;
+
+  double deviations[MAX_RUNS];
+  for (int i = 0; i < count; i++) {
+    double deviation = times[i] - summary.median;
+    deviations[i] = deviation < 0 ? -deviation : deviation;
+  }
+  qsort(deviations, count, sizeof(double), compareTimes);
+  double deviation = count % 2 == 1
+                         ? deviations[count / 2]
+                         : (deviations[count / 2 - 1] + deviations[count / 2]) /
+                               2;
+  summary.spread = summary.median > 0 ? deviation / summary.median : 0;
+  return summary;
+}
+
+// "benchmarks/fib.lox" -> "fib"
+static void scriptName(const char* script, char* name, size_t size) {
+  const char* base = strrchr(script, '/');
+  base = base == NULL ? script : base + 1;
+  snprintf(name, size, "%s", base);
+  char* extension = strrchr(name, '.');
+  if (extension != NULL) *extension = '\0';
+}
+
+// ============================================================================
+// GENERATED CORPUS
+// ============================================================================
+
+static FILE* openOutput(const char* dir, const char* name) {
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/%s", dir, name);
+  FILE* file = fopen(path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not write \"%s\".\n", path);
+    exit(74);
+  }
+  return file;
+}
+
+// Literals the folder can't touch: every one is added to a local
+static void generateConstants(const char* dir) {
+  FILE* file = openOutput(dir, "constants.lox");
+  fprintf(file, "// Generated by `bench --generate`, compile time only\n");
+
+  for (int i = 0; i < 20000; i++) {
+    fprintf(file, "var global%d = \"value %d\";\n", i, i);
+  }
+  for (int f = 0; f < 100; f++) {
+    fprintf(file, "fun function%d(x) {\n", f);
+    for (int i = 0; i < 1000; i++) {
+      fprintf(file, "  x = x + %d.5;\n", f * 1000 + i);
+    }
+    fprintf(file, "  return x;\n}\n");
+  }
+  fprintf(file, "print function0(0);\n");
+  fclose(file);
+}
+
+static void generateScan(const char* dir) {
+  FILE* file = openOutput(dir, "scan.lox");
+  fprintf(file, "// Generated by `bench --generate`, scanner time mostly\n");
+
+  long written = 0;
+  for (int i = 0; written < 4 * 1024 * 1024; i++) {
+    int length = fprintf(
+        file,
+        "// Generated settings block %d, do not edit by hand\n"
+        "fun configure_section_%d(environment, overrides) {\n"
+        "    var retry_limit = %d;\n"
+        "    var label = \"section-%d\";\n"
+        "    if (overrides != nil) {\n"
+        "        return environment + label; // keep the override\n"
+        "    }\n"
+        "    while (retry_limit > 0) { retry_limit = retry_limit - 1; }\n"
+        "    print 1.25 * (retry_limit + 4) / 2;\n"
+        "    return false;\n"
+        "}\n\n",
+        i, i, i % 10, i);
+    if (length < 0) break;
+    written += length;
+  }
+  fprintf(file, "print configure_section_0(\"a\", nil);\n");
+  fclose(file);
+}
+
+// ============================================================================
+// RUNNER
+// ============================================================================
+
+static void usage() {
+  fprintf(stderr, "Usage: bench [--runs n] [--warmup n] [--baseline <clox>] "
+                  "<clox> <script>...\n"
+                  "       bench --generate <dir>\n");
+  exit(64);
+}
+
+int main(int argc, char* argv[]) {
+  int runs = 10;
+  int warmup = 2;
+  const char* baseline = NULL;
+
+  int arg = 1;
+  for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+    if (arg + 1 >= argc) usage();
+    if (strcmp(argv[arg], "--generate") == 0) {
+      generateConstants(argv[arg + 1]);
+      generateScan(argv[arg + 1]);
+      return 0;
+    } else if (strcmp(argv[arg], "--runs") == 0) {
+      runs = atoi(argv[++arg]);
+    } else if (strcmp(argv[arg], "--warmup") == 0) {
+      warmup = atoi(argv[++arg]);
+    } else if (strcmp(argv[arg], "--baseline") == 0) {
+      baseline = argv[++arg];
+    } else {
+      usage();
+    }
+  }
+  if (argc - arg < 2 || runs < 1 || runs > MAX_RUNS || warmup < 0) usage();
+
+  const char* clox = argv[arg++];
+  printf("%d runs after %d warmups, times in ms, spread is the median "
+         "absolute deviation\n",
+         runs, warmup);
+  if (baseline != NULL) {
+    printf("%-12s %9s %7s %9s %9s  %9s %7s  %s\n", "benchmark", "median",
+           "spread", "min", "max", "baseline", "spread", "change");
+  } else {
+    printf("%-12s %9s %7s %9s %9s\n", "benchmark", "median", "spread", "min",
+           "max");
+  }
+
+  int status = 0;
+  for (; arg < argc; arg++) {
+    const char* script = argv[arg];
+    char name[256];
+    scriptName(script, name, sizeof(name));
+
+    double times[MAX_RUNS];
+    double baselineTimes[MAX_RUNS];
+    bool failed = false;
+    for (int i = -warmup; i < runs && !failed; i++) {
+      double time = timeRun(clox, script);
+      double baselineTime = baseline != NULL ? timeRun(baseline, script) : 0;
+      failed = time < 0 || baselineTime < 0;
+      if (i >= 0) {
+        times[i] = time;
+        baselineTimes[i] = baselineTime;
+      }
+    }
+    if (failed) {
+      printf("%-12s failed, run it by hand to see why\n", name);
+      status = 1;
+      continue;
+    }
+
+    Summary summary = summarize(times, runs);
+    printf("%-12s %9.2f %6.1f%% %9.2f %9.2f", name, summary.median * 1e3,
+           summary.spread * 100, summary.min * 1e3, summary.max * 1e3);
+
+    if (baseline != NULL) {
+      Summary before = summarize(baselineTimes, runs);
+      double ratio = before.median / summary.median;
+      double change = ratio - 1;
+      bool noise = (change < 0 ? -change : change) <
+                   summary.spread + before.spread;
+      printf("  %9.2f %6.1f%%  %.2fx %s%s", before.median * 1e3,
+             before.spread * 100, ratio >= 1 ? ratio : 1 / ratio,
+             ratio >= 1 ? "faster" : "slower", noise ? " (noise)" : "");
+    }
+    printf("\n");
+  }
+  return status;
+}
@@ -0,0 +1,86 @@
+/*
+Interning benchmark, run it through `make bench-intern` which builds it once
+with each string hash.
+
+For a few string lengths it interns up to two million distinct strings with
+copyString() (hash, miss in vm.strings, allocate and insert) and then
+interns all of them again (hash and hit), reporting ns per string and how
+many MB/s of characters get through.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "object.h"
+#include "vm.h"
+
+#define MAX_STRINGS 2000000
+// Caps the characters generated per length so the long ones stay in memory
+#define MAX_BYTES (64 * 1024 * 1024)
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+// count strings of length bytes each, back to back, the index in front keeps
+// them distinct
+static char* makeStrings(int count, int length) {
+  char* chars = malloc((size_t)count * length + 16);
+  for (int i = 0; i < count; i++) {
+    char* string = chars + (size_t)i * length;
+    for (int j = 0; j < length; j++) string[j] = 'a' + (i * 7 + j) % 26;
+    char digits[16];
+    int written = snprintf(digits, sizeof(digits), "%d", i);
+    memcpy(string, digits, written < length ? written : length);
+  }
+  return chars;
+}
+
+static double intern(VM* vm, const char* chars, int count, int length) {
+  double start = now();
+  for (int i = 0; i < count; i++) {
+    copyString(vm, chars + (size_t)i * length, length);
+  }
+  return now() - start;
+}
+
+int main(int argc, char* argv[]) {
+  const char* name = argc > 1 ? argv[1] : "intern";
+  static const int lengths[] = {8, 16, 32, 128, 1024};
+
+  for (int l = 0; l < (int)(sizeof(lengths) / sizeof(lengths[0])); l++) {
+    int length = lengths[l];
+    int count = MAX_BYTES / length < MAX_STRINGS ? MAX_BYTES / length
+                                                 : MAX_STRINGS;
+    char* chars = makeStrings(count, length);
+
+    VM vm;
+    initVM(&vm);
+    // Only vm.strings knows about the strings and it doesn't keep them alive,
+    // never collect
+    vm.nextGC = SIZE_MAX;
+
+    double insert = intern(&vm, chars, count, length);
+    int interned = vm.strings.count;
+    double hit = intern(&vm, chars, count, length);
+
+    double megabytes = (double)count * length / (1024 * 1024);
+    printf("%-6s length %5d  %8d strings  insert %7.1f ns  hit %7.1f ns  "
+           "(%7.1f MB/s)\n",
+           name, length, count, insert * 1e9 / count, hit * 1e9 / count,
+           megabytes / hit);
+
+    bool collided = vm.strings.count != interned;
+    freeVM(&vm);
+    free(chars);
+    if (collided) {
+      fprintf(stderr, "interning the same strings again added entries\n");
+      return 1;
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,81 @@
+/*
+Scanner throughput benchmark, run it through `make bench-scanner`.
+
+Builds a few megabytes of generated Lox in memory (indented functions,
+comments, strings, long and short identifiers, the shape of our generated
+config scripts) and reports how fast scanToken(&scanner) gets through it, in MB/s
+and millions of tokens per second. Only src/scanner.c is linked in, so the
+numbers don't include any compiler work.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "scanner.h"
+
+#define SOURCE_SIZE (4 * 1024 * 1024)
+#define ROUNDS 10
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static char* generateSource(size_t* length) {
+  static const char* snippet =
+      "// Generated settings block %d, do not edit by hand\n"
+      "fun configure_section_%d(environment, overrides) {\n"
+      "    var retry_limit_%d = %d;\n"
+      "    var label = \"section-%d\";\n"
+      "    if (overrides != nil and retry_limit_%d >= 3) {\n"
+      "        return environment + label; // keep the override\n"
+      "    }\n"
+      "    while (retry_limit_%d > 0) { retry_limit_%d = retry_limit_%d - 1; }\n"
+      "    print 1.25 * (retry_limit_%d + 4) / 2;\n"
+      "    return false;\n"
+      "}\n\n";
+
+  char* source = malloc(SOURCE_SIZE + 1024);
+  size_t used = 0;
+  for (int i = 0; used < SOURCE_SIZE; i++) {
+    used += (size_t)sprintf(source + used, snippet, i, i, i, i % 10, i, i, i,
+                            i, i, i);
+  }
+  *length = used;
+  return source;
+}
+
+int main() {
+  size_t length;
+  char* source = generateSource(&length);
+
+  long tokens = 0;
+  double best = 0;
+  Scanner scanner;
+  for (int round = 0; round < ROUNDS; round++) {
+    long count = 0;
+    double start = now();
+    initScanner(&scanner, source);
+    for (;;) {
+      Token token = scanToken(&scanner);
+      count++;
+      if (token.type == TOKEN_EOF) break;
+      if (token.type == TOKEN_ERROR) {
+        fprintf(stderr, "line %d: %.*s\n", token.line, token.length,
+                token.start);
+        return 1;
+      }
+    }
+    double elapsed = now() - start;
+    if (round == 0 || elapsed < best) best = elapsed;
+    tokens = count;
+  }
+
+  printf("scanner  %.1f MB  %ld tokens  best of %d: %7.1f MB/s  %6.1f Mtok/s\n",
+         (double)length / (1024 * 1024), tokens, ROUNDS,
+         (double)length / (1024 * 1024) / best, (double)tokens / 1e6 / best);
+  free(source);
+  return 0;
+}
@@ -0,0 +1,142 @@
+/*
+Microbenchmark for src/table.c, run it through `make bench-table` which builds
+it once per load factor against both the linear and the Swiss table.
+
+Fills a table to TABLE_MAX_LOAD of a fixed capacity and reports ns per
+operation for inserts, hits, misses, tableFindString() hits, delete/insert
+churn at a constant load (which piles up tombstones) and hits once the churn
+is done.
+*/
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+#include "vm.h"
+
+#ifndef TABLE_MAX_LOAD
+#define TABLE_MAX_LOAD 0.75
+#endif
+
+#define CAPACITY (1 << 16)
+#define ROUNDS 20
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+static ObjString** makeKeys(VM* vm, const char* prefix, int count) {
+  ObjString** keys = malloc(sizeof(ObjString*) * count);
+  char buffer[32];
+  for (int i = 0; i < count; i++) {
+    int length = snprintf(buffer, sizeof(buffer), "%s%d", prefix, i);
+    keys[i] = copyString(vm, buffer, length);
+  }
+  return keys;
+}
+
+// Fisher-Yates with a fixed LCG so every run probes in the same order
+static void shuffle(ObjString** keys, int count) {
+  uint32_t seed = 12345;
+  for (int i = count - 1; i > 0; i--) {
+    seed = seed * 1103515245u + 12345u;
+    int j = (int)(seed % (uint32_t)(i + 1));
+    ObjString* swap = keys[i];
+    keys[i] = keys[j];
+    keys[j] = swap;
+  }
+}
+
+static double lookups(Table* table, ObjString** keys, int count) {
+  Value value;
+  int found = 0;
+  double start = now();
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < count; i++) {
+      found += tableGet(table, keys[i], &value);
+    }
+  }
+  double elapsed = now() - start;
+  // Keeps the loop from being optimised away
+  if (found < 0) printf("%d\n", found);
+  return elapsed * 1e9 / ((double)ROUNDS * count);
+}
+
+int main(int argc, char* argv[]) {
+  const char* name = argc > 1 ? argv[1] : "table";
+
+  VM vm;
+  initVM(&vm);
+  // The keys live in C arrays the GC can't see, never collect
+  vm.nextGC = SIZE_MAX;
+
+  // Just under the threshold, so the table settles at CAPACITY slots
+  int count = (int)(CAPACITY * TABLE_MAX_LOAD) - 1;
+  ObjString** keys = makeKeys(&vm, "key", count * 2);
+  ObjString** misses = makeKeys(&vm, "miss", count);
+
+  Table table;
+  initTable(&table);
+
+  double start = now();
+  for (int i = 0; i < count; i++) {
+    tableSet(&vm, &table, keys[i], NUMBER_VAL(i));
+  }
+  double insert = (now() - start) * 1e9 / count;
+
+  ObjString** order = malloc(sizeof(ObjString*) * count);
+  for (int i = 0; i < count; i++) order[i] = keys[i];
+  shuffle(order, count);
+
+  double hit = lookups(&table, order, count);
+  double miss = lookups(&table, misses, count);
+
+  int found = 0;
+  start = now();
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < count; i++) {
+      ObjString* key = order[i];
+      found += tableFindString(&table, key->chars, key->length, key->hash) ==
+               key;
+    }
+  }
+  double findString = (now() - start) * 1e9 / ((double)ROUNDS * count);
+
+  // Slide the live window over the key pool, one delete and one insert per
+  // step keeps the load constant while tombstones build up
+  start = now();
+  for (int round = 0; round < ROUNDS; round++) {
+    for (int i = 0; i < count; i++) {
+      int oldest = (round * count + i) % (count * 2);
+      int newest = (oldest + count) % (count * 2);
+      tableDelete(&table, keys[oldest]);
+      tableSet(&vm, &table, keys[newest], NUMBER_VAL(i));
+    }
+  }
+  double churn = (now() - start) * 1e9 / ((double)ROUNDS * count);
+
+  // After an even number of rounds the live window is back at the start
+  double hitAfterChurn = lookups(&table, order, count);
+
+  printf("%-6s load %.2f  insert %6.1f  hit %6.1f  miss %6.1f  "
+         "findString %6.1f  churn %6.1f  hitAfterChurn %6.1f  (ns/op)\n",
+         name, TABLE_MAX_LOAD, insert, hit, miss, findString, churn,
+         hitAfterChurn);
+  if (found != ROUNDS * count) {
+    fprintf(stderr, "tableFindString missed %d keys\n",
+            ROUNDS * count - found);
+    return 1;
+  }
+
+  freeTable(&vm, &table);
+  free(order);
+  free(misses);
+  free(keys);
+  freeVM(&vm);
+  return 0;
+}
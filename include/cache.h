@@ -0,0 +1,44 @@
+#ifndef clox_cache_h
+#define clox_cache_h
+
+#include "common.h"
+#include "object.h"
+
+/*
+Bytecode cache (.loxc files)
+
+A .loxc file is the compiled top level ObjFunction of a script, nested
+functions, constant pools and line tables included. It is stamped with the
+hash, size and mtime of the source it came from, so a stale cache is never
+run. runFile() in src/main.c reuses it transparently, loading it skips the
+scanner and the compiler completely.
+
+Bump CACHE_VERSION whenever the OpCode enum, the instruction formats or the
+layout below change.
+*/
+#define CACHE_VERSION 4
+
+// Identifies the source a cache was compiled from
+typedef struct {
+  uint64_t hash; // FNV-1a over the source text
+  uint64_t size;
+  int64_t mtime;
+} SourceKey;
+
+SourceKey sourceKey(const char* path, const char* source);
+// "script.lox" -> "script.loxc", any other name gets ".loxc" appended.
+// Returns a malloc'd string
+char* cachePath(const char* sourcePath);
+
+// false if the file couldn't be written, the script still runs without it.
+// The global names are written in vm's slot order
+bool writeCache(VM* vm, const char* path, ObjFunction* function,
+                SourceKey* key);
+// NULL if the file is missing, stale, from another build or damaged. Pass a
+// NULL key to load a .loxc without its source. Loads into vm's heap
+ObjFunction* readCache(VM* vm, const char* path, SourceKey* key);
+// Unmaps every cache loaded into vm, the functions read from them must be
+// gone (call it after freeVM())
+void closeCaches(VM* vm);
+
+#endif
@@ -7,7 +7,7 @@
 #include "value.h"
 
 /*
-  Each operation has an // *instruction format* \\
+  Each operation has an // *instruction format* \                              \
   This specifies the memory layout of the incoming instruction
   and how many bytes it uses so that the assembler can know how many
   bytes to write and the disassembler - how many to read.
@@ -54,6 +54,62 @@ typedef enum {
   OP_CLOSURE,
   OP_CLOSE_UPVALUE,
   OP_RETURN,
+
+  /*
+  Wide forms of the instructions that index the constant pool or the globals,
+  [op][index16] with the index big endian like jump offsets. The compiler only
+  falls back to them once an index no longer fits in a byte.
+  */
+  OP_CONSTANT_LONG,
+  OP_GET_GLOBAL_LONG,
+  OP_DEFINE_GLOBAL_LONG,
+  OP_SET_GLOBAL_LONG,
+  // [op][index16] followed by the same upvalue pairs as OP_CLOSURE
+  OP_CLOSURE_LONG,
+
+  // OP_CALL with the argument count in the opcode, the compiler uses them for
+  // every call with up to 3 arguments. OP_CALL_0 + n is OP_CALL_n
+  OP_CALL_0,
+  OP_CALL_1,
+  OP_CALL_2,
+  OP_CALL_3,
+  // [op][argCount], a call whose result is returned right away (`return
+  // f(x);`). It replaces the caller's frame instead of pushing one and is
+  // always followed by an OP_RETURN, which only runs for natives
+  OP_TAIL_CALL,
+
+  /*
+  Superinstructions, only emitted by the peephole pass in src/optimizer.c.
+  Each one stands for a fixed sequence of the instructions above.
+  */
+  // [op][slot][constant] = GET_LOCAL slot, CONSTANT constant, ADD
+  OP_ADD_LOCAL_CONST,
+  // [op][slot] = SET_LOCAL slot, POP
+  OP_SET_LOCAL_POP,
+  // [op][offset16] = JUMP_IF_FALSE offset, POP on both paths
+  OP_POP_JUMP_IF_FALSE,
+  // [op][slotA][slotB][offset16] = GET_LOCAL a, GET_LOCAL b, LESS,
+  // POP_JUMP_IF_FALSE offset
+  OP_JUMP_IF_NOT_LESS_LOCALS,
+  // [op][slot][constant][offset16] = GET_LOCAL slot, CONSTANT constant, LESS,
+  // POP_JUMP_IF_FALSE offset
+  OP_JUMP_IF_NOT_LESS_LOCAL_CONST,
+
+  /*
+  Quickened instructions, never emitted by the compiler. The first time an
+  arithmetic or comparison instruction runs it rewrites its own opcode in the
+  chunk to the variant for the operand types it saw (see run() in src/vm.c).
+  The variants skip the checks for the other types and work on the stack top
+  in place. When the operands stop matching they rewrite themselves back to
+  the generic instruction and run it instead.
+  */
+  OP_ADD_NUM,
+  OP_ADD_STR, // either side may be a rope
+  OP_SUBTRACT_NUM,
+  OP_MULTIPLY_NUM,
+  OP_DIVIDE_NUM,
+  OP_GREATER_NUM,
+  OP_LESS_NUM,
 } OpCode;
 
 // Defining it like this allows for adding custom type formatting into decimal
@@ -73,20 +129,44 @@ See OpCode enum for instruction formats.
 It will also hold an embedded struct which holds the literals as constants
 */
 
+/*
+Line information is run-length encoded: one entry for every run of bytes that
+came from the same source line, holding the offset the run starts at. Lines
+are only looked up when reporting an error or disassembling, so a binary
+search there is cheaper than an int next to every byte of code.
+*/
+typedef struct {
+  int offset; // first byte of the run
+  int line;
+} LineStart;
+
 typedef struct {
   int count;            // 32 bits (4 bytes)
   int capacity;         // 32 bits (4 bytes)
   OpcodeByte* code;     // 64 bits (8 bytes)
-  int* lines;           // 64 bits (8 bytes)
+  LineStart* lines;     // 64 bits (8 bytes)
+  int lineCount;        // 32 bits (4 bytes)
+  int lineCapacity;     // 32 bits (4 bytes)
   ValueArray constants; // Embedded struct, typically 128 bits (16 bytes: 2 ints
                         // + pointer)
-} Chunk;                // Total: 320 bits (40 bytes) on a 64-bit system
+  // Open addressing index over the numbers and strings in the pool so each
+  // literal is only stored once. Holds pool index + 1, 0 is an empty slot
+  int* constantIndex;        // 64 bits (8 bytes)
+  int constantIndexCount;    // 32 bits (4 bytes)
+  int constantIndexCapacity; // 32 bits (4 bytes)
+} Chunk; // Total: 512 bits (64 bytes) on a 64-bit system
 
 void initChunk(Chunk* chunk);
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
-void freeChunk(Chunk* chunk);
-
-uint16_t addConstant(Chunk* chunk, Value value);
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
+void freeChunk(VM* vm, Chunk* chunk);
+// Source line of the byte at offset
+int getLine(Chunk* chunk, int offset);
+// Drops every byte from offset `count` on, along with their line runs
+void truncateChunk(Chunk* chunk, int count);
+// Size in bytes of the instruction starting at offset, operands included
+int instructionLength(Chunk* chunk, int offset);
+
+int addConstant(VM* vm, Chunk* chunk, Value value);
 
 #endif
 
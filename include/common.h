@@ -8,11 +8,37 @@
 
 // Prints each instruction as it is executed, along with the current stack state. 
 // It’s a dynamic trace—shows the VM’s state and control flow during runtime.
-#define DEBUG_TRACE_EXECUTION
+// Far too slow to leave on, build with PROFILE=1 to see where time goes.
+// #define DEBUG_TRACE_EXECUTION
 
 // Before execution begins. Static disassembly—shows the code as data, not as it runs.
 // #define DEBUG_PRINT_CODE
 
+// Collect on every allocation that grows the heap, shakes out missing roots.
+// #define DEBUG_STRESS_GC
+
+// Logs every allocation, mark, blacken and free along with collection totals.
+// #define DEBUG_LOG_GC
+
+// Release builds (`make release`/`make pgo` pass -DNDEBUG) never trace, dump or
+// stress, whatever is switched on above
+#ifdef NDEBUG
+#undef DEBUG_TRACE_EXECUTION
+#undef DEBUG_PRINT_CODE
+#undef DEBUG_STRESS_GC
+#undef DEBUG_LOG_GC
+#endif
+
+// Threaded dispatch needs the GCC/Clang "labels as values" extension, every
+// other compiler falls back to the portable switch in run()
+#if defined(COMPUTED_GOTO) && !defined(__GNUC__)
+#undef COMPUTED_GOTO
+#endif
+
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// Everything that allocates or runs code takes the VM it works on, there is no
+// global one (see include/vm.h)
+typedef struct VM VM;
+
 #endif
\ No newline at end of file
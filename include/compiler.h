@@ -4,6 +4,13 @@
 #include "object.h"
 #include "vm.h"
 
-ObjFunction* compile(const char* source);
+// Compiles into the heap of vm. The parser, scanner and compiler state all
+// live on the C stack of the call, so several VMs can compile at once
+ObjFunction* compile(VM* vm, const char* source);
+// True if the last compile() on vm printed any error. Compilation carries on
+// past errors, but code that reported one is never worth caching
+bool compileReportedErrors(VM* vm);
+// Marks the functions still being compiled, collections can happen mid-compile
+void markCompilerRoots(VM* vm);
 
 #endif
\ No newline at end of file
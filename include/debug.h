@@ -4,8 +4,10 @@
 #include "chunk.h"
 #include "value.h"
 
-void disassembleChunk(Chunk* chunk, const char* name);
-int disassembleInstruction(Chunk* chunk, int offset, Value* stack, Value* stackTop);
-void disassembleInstructionWithStack(Chunk* chunk, int offset, Value* stack, Value* stackTop);
+void disassembleChunk(VM* vm, Chunk* chunk, const char* name);
+int disassembleInstruction(VM* vm, Chunk* chunk, int offset, Value* stack, Value* stackTop);
+void disassembleInstructionWithStack(VM* vm, Chunk* chunk, int offset, Value* stack, Value* stackTop);
+// "OP_ADD" and so on, NULL for a byte that isn't an opcode
+const char* opcodeName(uint8_t instruction);
 
 #endif
\ No newline at end of file
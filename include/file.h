@@ -0,0 +1,28 @@
+#ifndef clox_file_h
+#define clox_file_h
+
+#include <stddef.h>
+
+#include "common.h"
+
+/*
+Read only view of a whole file. Where it can, the file is mapped with mmap so
+every process running the same script shares the page cache instead of each
+keeping a private copy, otherwise it is read into a heap buffer.
+
+The mapping is read only, anything that ends up pointing into it (bytecode
+loaded from a .loxc) must never be patched in place. A private writable
+mapping would allow it, but every page written to would stop being shared.
+*/
+typedef struct {
+  const char* data;
+  size_t size;
+  bool isMapped; // false when data is a malloc'd copy
+} FileView;
+
+// false if the file can't be opened or read. With needsTerminator the bytes
+// are followed by a '\0' so they can be scanned as a C string
+bool openFileView(const char* path, FileView* view, bool needsTerminator);
+void closeFileView(FileView* view);
+
+#endif
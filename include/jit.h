@@ -0,0 +1,66 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+
+#include "common.h"
+#include "object.h"
+
+/*
+Baseline template JIT, compiled in with -DJIT (`make build NAN_BOXING=1
+JIT=1`). It only knows x86-64 and NaN boxed values, any other build is an
+error.
+
+Every function counts how often it gets hot: each call, each return into it
+and each backward jump. At JIT_THRESHOLD the whole chunk is translated, one
+fixed machine code template per instruction, into executable memory. From
+then on run() hands the frame to the machine code whenever it starts or
+resumes running it (calls, returns and loop back edges) and takes it back
+when the machine code gets to an instruction it leaves to the interpreter.
+
+Both tiers work on the same CallFrame and the same value stack, so nothing
+has to be converted in either direction:
+  - the machine code handles locals, globals, upvalues, constants, jumps
+    and the arithmetic, comparisons and superinstructions, for numbers only
+  - anything else, a call, a return, a print, a string operand or an error
+    to report, is an exit: vm->stackTop is written back and the ip of that
+    instruction is returned, run() executes it and carries on interpreting
+    until the next call, return or back edge enters the machine code again
+
+Since every exit happens at an instruction boundary before the instruction
+changes anything, the interpreter is also the deoptimisation path: a type
+check that fails just resumes the generic instruction. The machine code
+never allocates, calls back into C or nests on the C stack, so the GC and
+the frame limits don't need to know it exists.
+
+Opcode counts and timings from PROFILE only cover what the interpreter runs.
+*/
+
+#ifdef JIT
+
+#if !defined(__x86_64__) || !defined(NAN_BOXING)
+#error "JIT=1 emits x86-64 code for NaN boxed values, build it with NAN_BOXING=1 on x86-64"
+#endif
+
+// Calls, returns and back edges before a function is compiled
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000
+#endif
+
+typedef struct JitCode {
+  uint8_t* code;  // executable mapping, the entry trampoline comes first
+  uint8_t* start; // the first instruction
+  size_t size;
+  // Native offset of the instruction starting at every bytecode offset
+  uint32_t* entries;
+} JitCode;
+
+// Translates the function, leaves function->jit NULL if it couldn't
+void compileJit(ObjFunction* function);
+// Runs the top frame from ip, which has to be the start of an instruction.
+// Compiled calls and returns may change the frames, whichever frame is on
+// top afterwards has its ip at the instruction the interpreter goes on with
+void runJit(VM* vm, ObjClosure* closure, Value* slots, uint8_t* ip);
+void freeJit(ObjFunction* function);
+
+#endif
+
+#endif
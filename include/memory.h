@@ -6,8 +6,64 @@
 // Forward declaration to avoid circular dependency
 typedef struct Obj Obj;
 
-#define ALLOCATE(type, count) (type*)reallocate(NULL, 0, sizeof(type) * count)
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#include "value.h"
+
+// The first collection runs once this many bytes have been allocated
+#ifndef GC_INITIAL_HEAP
+#define GC_INITIAL_HEAP (1024 * 1024)
+#endif
+
+/*
+After a collection the next one is scheduled at the surviving heap size times
+this factor. A bigger factor means fewer collections and a bigger heap.
+Override with -DGC_HEAP_GROW_FACTOR=<factor> (`make build GC_GROW_FACTOR=<n>`)
+or change vm->gcGrowFactor after initVM().
+*/
+#ifndef GC_HEAP_GROW_FACTOR
+#define GC_HEAP_GROW_FACTOR 2
+#endif
+
+/*
+GC_GENERATIONAL splits the heap into a nursery (vm->objects) and an old
+generation (vm->oldObjects). Once GC_NURSERY_SIZE bytes have been allocated
+since the last collection a minor collection traces only the nursery, frees
+what died young and promotes the survivors. The full mark-sweep above still
+runs whenever the whole heap crosses vm->nextGC.
+*/
+#ifndef GC_NURSERY_SIZE
+#define GC_NURSERY_SIZE (256 * 1024)
+#endif
+
+/*
+Objects are small, numerous and short-lived, so with POOL_ALLOCATOR they come
+out of per size-class free lists instead of one malloc() each. Sizes are
+rounded up to POOL_GRANULE and everything up to POOL_MAX_SIZE is pooled,
+bigger objects go to reallocate(). A class that runs dry gets a fresh
+POOL_SLAB_SIZE slab carved into blocks. Freed blocks go back on their list and
+slabs are only returned to the system in freeVM().
+*/
+#define POOL_GRANULE 16
+#define POOL_MAX_SIZE 256
+#define POOL_CLASS_COUNT (POOL_MAX_SIZE / POOL_GRANULE)
+#define POOL_SLAB_SIZE (16 * 1024)
+
+typedef struct PoolBlock {
+  struct PoolBlock* next;
+} PoolBlock;
+
+typedef struct PoolSlab {
+  struct PoolSlab* next;
+} PoolSlab;
+
+typedef struct {
+  PoolBlock* freeLists[POOL_CLASS_COUNT];
+  PoolSlab* slabs;
+} ObjectPools;
+
+#define ALLOCATE(vm, type, count)                                              \
+  (type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
+// Objects only, the size has to match the one they were allocated with
+#define FREE(vm, type, pointer) poolFree(vm, pointer, sizeof(type))
 
 /**
  * This is a macro.
@@ -45,16 +101,16 @@ typedef struct Obj Obj;
  *
  * *element is the type of data stored in the array - can be primitive or struct
  */
-#define GROW_ARRAY(type, pointer, oldCount, newCount)                          \
-  (type*)reallocate(pointer, sizeof(type) * (oldCount),                        \
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount)                      \
+  (type*)reallocate(vm, pointer, sizeof(type) * (oldCount),                    \
                     sizeof(type) * (newCount))
 
-#define SHRINK_ARRAY(type, pointer, oldCount, newCount)                        \
-  (type*)reallocate(pointer, sizeof(type) * (oldCount),                        \
+#define SHRINK_ARRAY(vm, type, pointer, oldCount, newCount)                    \
+  (type*)reallocate(vm, pointer, sizeof(type) * (oldCount),                    \
                     sizeof(type) * (newCount))
 
-#define FREE_ARRAY(type, pointer, oldCount)                                    \
-  reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(vm, type, pointer, oldCount)                                \
+  reallocate(vm, pointer, sizeof(type) * (oldCount), 0)
 
 /**
  * The pointer is unknown, hence - void*
@@ -69,9 +125,33 @@ typedef struct Obj Obj;
  * | Non-zero  | Smaller than oldSize   | Shrink existing allocation |
  * | Non-zero  | Larger than oldSize    | Grow existing allocation   |
  */
-void* reallocate(void* pointer, size_t oldSize, size_t newSize);
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize);
+
+// Object allocation, counted and collected exactly like reallocate()
+void* poolAllocate(VM* vm, size_t size);
+void poolFree(VM* vm, void* pointer, size_t size);
+
+// Mark a single object (or object value) as reachable and queue it for tracing
+void markObject(VM* vm, Obj* object);
+void markValue(VM* vm, Value value);
+
+// Mark-sweep over everything reachable from the VM and compiler roots
+void collectGarbage(VM* vm);
+
+#ifdef GC_GENERATIONAL
+// Collect the nursery only, survivors are promoted to the old generation
+void collectYoung(VM* vm);
+// Write barrier slow path, queues an old object as a root for minor GCs
+void rememberObject(VM* vm, Obj* object);
+#endif
+
+// Collection counts and pause times (max and p99), printed to stderr
+void printGCStats(VM* vm);
+// Heap size, live objects by type and the load of the global and string
+// tables, printed to stdout (the REPL's :stats)
+void printHeapStats(VM* vm);
 
 // Chase down the obj linked list and free all the memory
-void freeObjects();
+void freeObjects(VM* vm);
 
 #endif
\ No newline at end of file
@@ -10,13 +10,15 @@
 #define IS_STRING(value) isObjType(value, OBJ_STRING)
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 #define IS_NATIVE(value) isObjType(value, OBJ_NATIVE)
-#define IS_CLOSURE(value) isObjType(value, OBJ_CLOSE)
+#define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+#define IS_ROPE(value) isObjType(value, OBJ_ROPE)
 
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
 #define AS_CSTRING(value) (((ObjString*)AS_OBJ(value))->chars)
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_NATIVE(value) (((ObjNative*)AS_OBJ(value))->function)
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
+#define AS_ROPE(value) ((ObjRope*)AS_OBJ(value))
 
 typedef enum {
   OBJ_STRING,
@@ -24,21 +26,77 @@ typedef enum {
   OBJ_NATIVE,
   OBJ_CLOSURE,
   OBJ_UPVALUE,
+  OBJ_ROPE,
 } ObjType;
 
 struct Obj {
   ObjType type;
+  // Set by the GC while tracing, anything still unmarked after that is garbage
+  bool isMarked;
+#ifdef GC_GENERATIONAL
+  // Survived a collection and lives on vm->oldObjects
+  bool isOld;
+  // Already in vm->rememberedSet, see WRITE_BARRIER()
+  bool isRemembered;
+#endif
   // Linked list of Objs used for memory deallocation
   struct Obj* next;
 };
 
+/*
+Every store of a reference into a heap object goes through this. With the
+generational collector a minor collection only traces young objects, so an
+old object that gets a pointer to a young one has to be remembered and used
+as an extra root. Stores into the stack, the globals and the VM tables don't
+need it, those are scanned by every collection.
+*/
+#ifdef GC_GENERATIONAL
+#define WRITE_BARRIER(vm, owner, value)                                        \
+  do {                                                                         \
+    if (((Obj*)(owner))->isOld && IS_OBJ(value) && !AS_OBJ(value)->isOld) {    \
+      rememberObject(vm, (Obj*)(owner));                                       \
+    }                                                                          \
+  } while (false)
+#else
+#define WRITE_BARRIER(vm, owner, value) ((void)0)
+#endif
+
 // Function Objects have their own chunk for the body
 typedef struct {
   Obj obj;
   int arity; // "arity" is the number of parameters a func takes
   int upvalueCount;
+  // Deepest the stack gets during a call, counted from frame->slots (the
+  // function itself and its arguments included). Computed by the compiler
+  // and checked once in call() so push/pop never have to.
+  int maxStack;
+  // Some closure captures one of its locals, only then does OP_RETURN have
+  // upvalues to close
+  bool hasCaptures;
+  // Part of a Program (see include/program.h), several VMs may be running it
+  // at once so nothing about it changes any more: no quickening, no hotness
+  // counting, its closure and machine code exist up front
+  bool isShared;
+  // Loaded from a .loxc, its code points into the read only mapping of the
+  // cache (see src/cache.c). Never quickened, so those pages stay shared with
+  // every other process running the script
+  bool isCached;
   Chunk chunk;
   ObjString* name;
+  // A function without upvalues only ever needs one closure, OP_CLOSURE
+  // creates it the first time and pushes it from then on
+  struct ObjClosure* shared;
+#ifdef PROFILE
+  // Call counts and timings, created on the first profiled call (see
+  // include/profiler.h)
+  struct FunctionProfile* profile;
+#endif
+#ifdef JIT
+  // Calls, returns into it and back edges, at JIT_THRESHOLD the function is
+  // compiled to machine code (see include/jit.h)
+  uint32_t hotness;
+  struct JitCode* jit;
+#endif
 } ObjFunction;
 
 typedef Value (*NativeFn)(int argCount, Value* args);
@@ -52,39 +110,95 @@ struct ObjString {
   struct Obj obj;
   int length;
   uint32_t hash;
-  // Value
-  char* chars;
+  // Value, allocated inline right after the header (length + 1 bytes with the
+  // '\0') so a string is a single allocation
+  char chars[];
 };
 
+/*
+Ropes
+
+`a + b` on strings used to copy both sides into a new string and intern it,
+so appending to a string in a loop copied and hashed O(n^2) bytes. Once the
+result is at least ROPE_MIN_LENGTH characters long the VM builds an ObjRope
+instead, a node that only points at its two halves. The characters are put
+together once, by flattenRope(), when something needs the interned string
+(equality, see OP_EQUAL). Printing walks the pieces and never flattens.
+
+Shorter results are still concatenated and interned right away, a small copy
+is cheaper than a node plus a flatten later. So a rope is always at least
+ROPE_MIN_LENGTH long and both operands of a short concatenation are plain
+strings.
+
+IS_STRING() is false for a rope, anything that takes an ObjString (table
+keys, constants, names) still only ever sees flat interned strings.
+*/
+#ifndef ROPE_MIN_LENGTH
+#define ROPE_MIN_LENGTH 64
+#endif
+
+typedef struct {
+  Obj obj;
+  int length;
+  // ObjString or ObjRope halves, both NULL once the rope has been flattened
+  Obj* left;
+  Obj* right;
+  // The interned result of flattenRope(), NULL until then
+  ObjString* flat;
+} ObjRope;
+
 typedef struct ObjUpvalue {
   Obj obj;
   Value* location;
-  struct ObjUpvalue* next;
   Value closed;
 } ObjUpvalue;
 
-typedef struct {
+typedef struct ObjClosure {
   Obj obj;
   ObjFunction* function;
-  // This is only a double pointer because it points to an array 
-  // and an array is just a pointer to the first element
-  ObjUpvalue** upvalues;
   int upvalueCount;
+  // Inline like ObjString.chars, upvalueCount pointers follow the header
+  ObjUpvalue* upvalues[];
 } ObjClosure;
 
-ObjClosure* newClosure(ObjFunction* function);
-
-struct ObjString* takeString(char* chars, int length);
-struct ObjString* copyString(const char* chars, int length);
-
-ObjFunction* newFunction();
-ObjNative* newNative(NativeFn function);
-ObjUpvalue* newUpvalue(Value* slot);
+ObjClosure* newClosure(VM* vm, ObjFunction* function);
+
+struct ObjString* copyString(VM* vm, const char* chars, int length);
+/*
+A string built in place rather than copied from a buffer: newString() hands
+out one with room for length characters, the caller writes them to chars and
+internString() returns it, or frees it and returns the equal string that was
+already interned. Nothing may allocate in between, the new string isn't
+reachable by the GC until it is interned.
+*/
+struct ObjString* newString(VM* vm, int length);
+struct ObjString* internString(VM* vm, struct ObjString* string);
+
+ObjFunction* newFunction(VM* vm);
+ObjNative* newNative(VM* vm, NativeFn function);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot);
+// left and right must be reachable by the GC (on the stack) while it allocates
+ObjRope* newRope(VM* vm, Obj* left, Obj* right, int length);
+// Interns the characters of the rope and drops its halves, later calls
+// return the same string. The rope must be reachable by the GC
+ObjString* flattenRope(VM* vm, ObjRope* rope);
 
 void printObject(Value value);
+void writeObject(Output* output, Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && AS_OBJ(value)->type == type;
 }
 
+// A string or a rope, the operands `+` concatenates
+static inline bool isText(Value value) {
+  return IS_OBJ(value) && (AS_OBJ(value)->type == OBJ_STRING ||
+                           AS_OBJ(value)->type == OBJ_ROPE);
+}
+
+static inline int textLength(Obj* text) {
+  return text->type == OBJ_STRING ? ((ObjString*)text)->length
+                                  : ((ObjRope*)text)->length;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,14 @@
+#ifndef clox_optimizer_h
+#define clox_optimizer_h
+
+#include "chunk.h"
+
+/*
+Peephole pass over a finished chunk, run by endCompiler(). Rewrites hot
+instruction sequences into superinstructions, keeping the line table and
+every jump offset correct. A chunk that can't be decoded cleanly (which only
+happens after compile errors) is left untouched.
+*/
+void optimizeChunk(VM* vm, Chunk* chunk);
+
+#endif
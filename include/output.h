@@ -0,0 +1,81 @@
+#ifndef clox_output_h
+#define clox_output_h
+
+#include <string.h>
+
+#include "common.h"
+
+/*
+Where `print` goes. Every VM owns one Output: print statements append to its
+buffer and the buffer is handed to the sink in one piece once it is full,
+when the VM reports a runtime error, when interpret() returns and in
+freeVM(). The default sink writes straight to file descriptor 1 with
+write(2), stdio never sees the text.
+
+An embedder picks another sink with setOutput(&vm->output, sink, context),
+writeToDescriptor() for any other descriptor (context is the descriptor, cast
+to a pointer with (void*)(intptr_t)fd) and writeToMemory() to collect the
+output in an OutputMemory, or a function of its own.
+
+The buffer is only allocated on the first print and is flushed one whole
+line at a time, so the lines of several VMs printing to the same descriptor
+don't get cut into each other. On a terminal every line is flushed straight
+away, like stdio.
+*/
+#ifndef OUTPUT_BUFFER_SIZE
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+#endif
+
+// Returns false if the bytes couldn't be written, the output then drops
+// everything after
+typedef bool (*OutputSink)(void* context, const char* bytes, size_t length);
+
+typedef struct {
+  char* buffer;
+  size_t count;
+  size_t capacity; // 0 until the first write
+  OutputSink sink;
+  void* context;
+  bool lineBuffered;
+  bool failed;
+} Output;
+
+// Grows as needed, data is malloc'd and belongs to the embedder
+typedef struct {
+  char* data;
+  size_t length;
+  size_t capacity;
+} OutputMemory;
+
+bool writeToDescriptor(void* context, const char* bytes, size_t length);
+bool writeToMemory(void* context, const char* bytes, size_t length);
+
+// stdout, line buffered if it is a terminal
+void initOutput(Output* output);
+// Flushes and frees the buffer
+void freeOutput(Output* output);
+// Flushes what was written so far before switching
+void setOutput(Output* output, OutputSink sink, void* context);
+void flushOutput(Output* output);
+
+void writeOutputSlow(Output* output, const char* bytes, size_t length);
+// Same text as printf("%g"), without going through stdio
+void writeNumber(Output* output, double number);
+
+static inline void writeOutput(Output* output, const char* bytes,
+                               size_t length) {
+  if (length < output->capacity - output->count) {
+    memcpy(output->buffer + output->count, bytes, length);
+    output->count += length;
+  } else {
+    writeOutputSlow(output, bytes, length);
+  }
+}
+
+// The newline at the end of a print statement
+static inline void endLine(Output* output) {
+  writeOutput(output, "\n", 1);
+  if (output->lineBuffered) flushOutput(output);
+}
+
+#endif
@@ -0,0 +1,144 @@
+#ifndef clox_profiler_h
+#define clox_profiler_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+/*
+Sampling profiler and per-opcode counters, compiled in with -DPROFILE
+(`make build PROFILE=1`) and switched on at runtime with `--profile <path>`.
+
+While it runs it keeps
+  - the number of times every opcode was dispatched and the clock ticks
+    spent in it, charged from one dispatch to the next
+  - calls and inclusive ticks per function, a recursive function is only
+    timed from its outermost call so its time isn't counted twice
+  - a sample of the frame stack every PROFILE_SAMPLE_TICKS ticks, taken at
+    the next dispatch instead of from a signal handler
+
+Each VM has a profiler of its own, started with startProfiler(vm, path).
+stopProfiler() (called from freeVM()) writes the samples to the path as
+collapsed stacks, one "script;outer;inner <count>" line per distinct stack
+(the top level is "script", as in runtime error traces), which is what
+flamegraph.pl and speedscope read, and prints the counters to stderr.
+
+Without PROFILE every hook below compiles to nothing.
+*/
+
+#ifdef PROFILE
+
+// Ticks between two stack samples, about 0.3ms of TSC at 3GHz
+#ifndef PROFILE_SAMPLE_TICKS
+#define PROFILE_SAMPLE_TICKS 1000000
+#endif
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#elif !defined(__aarch64__)
+#include <time.h>
+#endif
+
+// The cheapest monotonic counter around: the TSC on x86, the virtual counter
+// on arm64 and nanoseconds anywhere else. stopProfiler() converts ticks to
+// milliseconds by comparing against the wall clock over the whole run
+static inline uint64_t profileClock() {
+#if defined(__x86_64__) || defined(__i386__)
+  return __rdtsc();
+#elif defined(__aarch64__)
+  uint64_t ticks;
+  __asm__ volatile("mrs %0, cntvct_el0" : "=r"(ticks));
+  return ticks;
+#else
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (uint64_t)time.tv_sec * 1000000000u + (uint64_t)time.tv_nsec;
+#endif
+}
+
+// Owned by the profiler rather than the function, so the numbers outlive a
+// function the GC frees before the report is written
+typedef struct FunctionProfile {
+  // Only set for a function of a Program, which several VMs run at once and
+  // so can't point back at any one VM's profile
+  ObjFunction* shared;
+  char* name;
+  uint64_t calls;
+  uint64_t ticks; // inclusive
+  int depth;      // activations currently on the frame stack
+  uint64_t enteredAt;
+  struct FunctionProfile* next;
+} FunctionProfile;
+
+// One distinct collapsed stack, kept in an open addressing table
+typedef struct {
+  char* stack; // NULL for an empty slot
+  uint64_t hash;
+  uint64_t count;
+} StackSample;
+
+// Sentinel for "no instruction dispatched yet", never a real opcode
+#define PROFILE_NO_INSTRUCTION UINT8_MAX
+
+typedef struct Profiler {
+  const char* path;
+  uint64_t instructionCounts[UINT8_COUNT];
+  uint64_t instructionTicks[UINT8_COUNT];
+  uint8_t lastInstruction;
+  uint64_t lastTick;
+  uint64_t nextSample;
+
+  FunctionProfile* functions;
+
+  StackSample* samples;
+  int sampleCount;
+  int sampleCapacity;
+
+  // Pairs of clock readings to convert ticks into time for the report
+  uint64_t startTick;
+  double startTime;
+} Profiler;
+
+void startProfiler(VM* vm, const char* path);
+// Writes the collapsed stacks and the report, a no-op while not profiling
+void stopProfiler(VM* vm);
+
+// Out of line, the per-instruction hook only calls it once per sample period
+void sampleStack(VM* vm, uint64_t now);
+void profileEnter(VM* vm, ObjFunction* function);
+void profileExit(VM* vm, ObjFunction* function);
+
+static inline void profileInstruction(VM* vm, uint8_t instruction) {
+  Profiler* profiler = vm->profiler;
+  uint64_t now = profileClock();
+  profiler->instructionTicks[profiler->lastInstruction] +=
+      now - profiler->lastTick;
+  profiler->instructionCounts[instruction]++;
+  profiler->lastInstruction = instruction;
+  profiler->lastTick = now;
+  if (now >= profiler->nextSample) sampleStack(vm, now);
+}
+
+// Restarts the per-opcode clock when run() is entered, so time spent outside
+// the interpreter (compiling the next REPL line) isn't charged to an opcode
+static inline void profileResume(VM* vm) {
+  vm->profiler->lastInstruction = PROFILE_NO_INSTRUCTION;
+  vm->profiler->lastTick = profileClock();
+}
+
+#define PROFILING(vm) ((vm)->profiler != NULL)
+#define PROFILE_INSTRUCTION(vm, instruction)                                   \
+  (PROFILING(vm) ? profileInstruction(vm, instruction) : (void)0)
+#define PROFILE_RESUME(vm) (PROFILING(vm) ? profileResume(vm) : (void)0)
+#define PROFILE_ENTER(vm, function)                                            \
+  (PROFILING(vm) ? profileEnter(vm, function) : (void)0)
+#define PROFILE_EXIT(vm, function)                                             \
+  (PROFILING(vm) ? profileExit(vm, function) : (void)0)
+#else
+#define PROFILE_INSTRUCTION(vm, instruction) ((void)0)
+#define PROFILE_RESUME(vm) ((void)0)
+#define PROFILE_ENTER(vm, function) ((void)0)
+#define PROFILE_EXIT(vm, function) ((void)0)
+#endif
+
+#endif
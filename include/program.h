@@ -0,0 +1,41 @@
+#ifndef clox_program_h
+#define clox_program_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+/*
+Compile once, run on many VMs
+
+compileProgram() compiles a script into a private VM of its own and then
+freezes everything in that heap:
+  - every object is left permanently marked (and old, with GC_GENERATIONAL),
+    so the collector of a VM running the program treats it as reachable and
+    never traces, moves or frees it
+  - every function is flagged isShared, which stops the interpreter from
+    quickening its bytecode or counting its hotness, the only places run()
+    writes to a function
+  - functions without upvalues get their one closure up front, OP_CLOSURE
+    would otherwise create it on first use, and with JIT every function gets
+    its machine code right away
+
+After that nothing writes to the program any more, so any number of VMs, on
+any threads, can run it at the same time with runProgram(). Each of them
+keeps its own globals, stack and heap, only the compiled code and its
+constants are shared. freeProgram() once none of them is running it.
+*/
+typedef struct Program Program;
+
+// NULL if the source doesn't compile, the errors have been printed
+Program* compileProgram(const char* source);
+/*
+Runs the program's top level code on vm. Meant for a VM that hasn't run
+anything else (it may have run this program before): the program's strings
+become the ones vm interns, a string vm interned earlier with the same
+characters would no longer compare equal to them.
+*/
+InterpretResult runProgram(VM* vm, Program* program);
+void freeProgram(Program* program);
+
+#endif
@@ -60,7 +60,16 @@ typedef struct {
   int line;
 } Token;
 
-void initScanner(const char* scanner);
-Token scanToken();
+// Everything the scanner needs between two tokens, one per compile so
+// several can run at once
+typedef struct {
+  const char* start;   // marks beginning of lexeme
+  const char* current; // marks current char
+  const char* end;     // the terminating '\0'
+  int line;            // marks current line
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source);
+Token scanToken(Scanner* scanner);
 
 #endif
\ No newline at end of file
@@ -6,21 +6,37 @@
 
 typedef struct {
   ObjString* key;
+  // Copy of key->hash, kept next to the key so probing and resizing never
+  // have to dereference the string
+  uint32_t hash;
   Value value;
 } Entry;
 
+/*
+Open addressing hash table. The default probes linearly, building with
+SWISS_TABLE (`make build SWISS_TABLE=1`) switches to a Swiss table that
+probes 16 control bytes per SSE2/NEON compare (see src/table.c). Both share
+this API and the entries layout.
+*/
 typedef struct {
+  // Live entries plus tombstones
   int count;
+  // Zero or a power of two
   int capacity;
   Entry* entries;
+#ifdef SWISS_TABLE
+  int tombstones;
+  // capacity + 16 control bytes, one per entry plus a mirrored first group
+  uint8_t* control;
+#endif
 } Table;
 
 void initTable(Table* table);
-void freeTable(Table* table);
+void freeTable(VM* vm, Table* table);
 
 /* Get a value from a table */
 bool tableGet(Table* table, ObjString* key, Value* value);
-bool tableSet(Table* table, ObjString* key, Value value);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value);
 /*
 Deletions in this implementation cannot just use find and set to NULL
 because of the probe sequencing of open addressing.
@@ -31,8 +47,12 @@ current "tombstone" is NULL key and true value
 bool tableDelete(Table* table, ObjString* key);
 
 /* Copies an entire table  */
-void tableAddAll(Table* from, Table* to);
+void tableAddAll(VM* vm, Table* from, Table* to);
 ObjString* tableFindString(Table* table, const char* chars, int length,
                            uint32_t hash);
 
+/* GC hooks, see collectGarbage() */
+void markTable(VM* vm, Table* table);
+void tableRemoveWhite(VM* vm, Table* table);
+
 #endif
\ No newline at end of file
@@ -19,15 +19,85 @@
   of the bytes themselves.
 */
 #include "common.h"
+#include "output.h"
 
 typedef struct Obj Obj;
 typedef struct ObjString ObjString;
 
+#ifdef NAN_BOXING
+
+#include <string.h>
+
+/*
+  NaN boxing packs every Value into a single 64 bit word.
+
+  A double whose exponent bits are all set and whose top mantissa bit is set is
+  a "quiet NaN". The CPU never produces one with any of the remaining mantissa
+  bits set, so those 51 bits are free to smuggle other types through.
+
+  +-+-----------+--+----------------------------------------------------+
+  |S| exponent  |QN|            payload (pointer or tag)               |
+  +-+-----------+--+----------------------------------------------------+
+   ^      11      ^^                       50/51
+   |              |+- Intel "QNaN Floating-Point Indefinite" bit
+   |              +-- quiet bit
+   +- set for object pointers
+
+  - Numbers are stored as-is
+  - nil/true/false are QNAN | a small tag in the lowest bits
+  - Obj pointers are SIGN_BIT | QNAN | pointer (x86-64 and ARM64 only use the
+    low 48 bits of an address)
+*/
+#define SIGN_BIT ((uint64_t)0x8000000000000000)
+#define QNAN ((uint64_t)0x7ffc000000000000)
+
+#define TAG_NIL 1       // 001.
+#define TAG_FALSE 2     // 010.
+#define TAG_TRUE 3      // 011.
+#define TAG_UNDEFINED 4 // 100.
+
+typedef uint64_t Value; // 64 bits/8 bytes
+
+#define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
+#define IS_NIL(value) ((value) == NIL_VAL)
+#define IS_UNDEFINED(value) ((value) == UNDEFINED_VAL)
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_OBJ(value) (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
+
+#define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_NUMBER(value) valueToNum(value)
+#define AS_OBJ(value) ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
+
+#define BOOL_VAL(b) ((b) ? TRUE_VAL : FALSE_VAL)
+#define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
+#define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
+#define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define UNDEFINED_VAL ((Value)(uint64_t)(QNAN | TAG_UNDEFINED))
+#define NUMBER_VAL(num) numToValue(num)
+#define OBJ_VAL(obj) (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
+
+// Type punning through memcpy, the compiler turns this into a plain register
+// move (a union or pointer cast would be undefined behaviour)
+static inline double valueToNum(Value value) {
+  double num;
+  memcpy(&num, &value, sizeof(Value));
+  return num;
+}
+
+static inline Value numToValue(double num) {
+  Value value;
+  memcpy(&value, &num, sizeof(double));
+  return value;
+}
+
+#else
+
 typedef enum {
   VAL_BOOL,
   VAL_NIL,
   VAL_NUMBER,
   VAL_OBJ,
+  VAL_UNDEFINED, // Internal, marks a global slot that has no value yet
 } ValueType;
 
 // ValueType is enum which is inherently 32bit
@@ -46,6 +116,7 @@ typedef struct {
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
+#define IS_UNDEFINED(value) ((value).type == VAL_UNDEFINED)
 #define IS_NUMBER(value) ((value).type == VAL_NUMBER)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
@@ -55,9 +126,12 @@ typedef struct {
 
 #define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
+#define UNDEFINED_VAL ((Value){VAL_UNDEFINED, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
+#endif
+
 /* Dynamic array limited to 65536 indexes. */
 typedef struct {
   uint16_t capacity;
@@ -67,8 +141,11 @@ typedef struct {
 
 bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray* array);
-void writeValueArray(ValueArray* array, Value value);
-void freeValueArray(ValueArray* array);
+void writeValueArray(VM* vm, ValueArray* array, Value value);
+void freeValueArray(VM* vm, ValueArray* array);
+// printf()s the value, for the disassembler and the trace
 void printValue(Value value);
+// What `print` shows, into the VM's output (see include/output.h)
+void writeValue(Output* output, Value value);
 
 #endif
\ No newline at end of file
@@ -6,8 +6,29 @@
 #include "table.h"
 #include "value.h"
 
-#define FRAMES_MAX 64 // Max recursion depth
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+/*
+Default limits of initVM(), an embedder picks others with initVMWithLimits()
+and the command line with --frames and --stack. Build time overrides are
+-DFRAMES_MAX=<n> and -DSTACK_MAX=<slots> (`make build STACK_MAX=<slots>`).
+
+FRAMES_MAX is the deepest the calls can nest (tail calls don't count, see
+OP_TAIL_CALL), the frames are allocated FRAMES_BLOCK at a time as the calls
+get deeper. The STACK_MAX value slots are allocated up front along with an
+open upvalue index as long, for every VM, the stack can't move. So the stack
+is sized for STACK_PER_FRAME slots a frame rather than the 256 a function
+could address: a frame only takes maxStack slots, its locals and
+temporaries, which stays far below that in real code. A recursion that runs
+out raises "Stack overflow." and can be given more with --stack.
+*/
+#ifndef FRAMES_MAX
+#define FRAMES_MAX 4096
+#endif
+#define FRAMES_BLOCK 64
+
+#define STACK_PER_FRAME 16
+#ifndef STACK_MAX
+#define STACK_MAX (FRAMES_MAX * STACK_PER_FRAME)
+#endif
 
 typedef struct {
   ObjClosure* closure;
@@ -17,24 +38,109 @@ typedef struct {
   Value* slots;
 } CallFrame;
 
+/*
+Pauses are counted in a histogram instead of being logged one by one, which
+would grow for as long as the process runs. The buckets are logarithmic, four
+per doubling of microseconds (the first four are 0-3us exactly), so the p99
+read off them is at most a quarter above the real one.
+*/
+#define GC_PAUSE_BUCKETS 128
+
+// Filled in by the collector, see printGCStats()
+typedef struct {
+  int collections;
+  int minorCollections;
+  double totalPause; // seconds
+  double maxPause;
+  int pauseBuckets[GC_PAUSE_BUCKETS];
+} GCStats;
+
 // The indexes for this stack can be fit into a single byte
 // #define STACK_MAX 256
 
-typedef struct {
-  CallFrame frames[FRAMES_MAX];
+/*
+Everything one interpreter owns: its stacks, globals, interned strings, heap
+and collector. VMs share nothing mutable, so an embedder can create one per
+thread and run them side by side (see include/program.h for running one
+compiled script on several of them).
+*/
+struct VM {
+  // frameCapacity frames allocated, grown a block at a time up to maxFrames
+  CallFrame* frames;
   int frameCount;
-  int stackCapacity;
-  Value* stack; // 8 bytes * 256 = 2048 bytes (2.048kb)
+  int frameCapacity;
+  int maxFrames;
+  // stackSlots slots allocated once in initVM(), the stack never moves so
+  // frame->slots and open upvalues can point straight into it
+  Value* stack;
+  int stackSlots;
+  // One past the last slot, what call() checks a new frame against
+  Value* stackLimit;
   /*
   The stack top is just a pointer to the next box in the stack,
   we just add the values directly into the box and then we increment the pointer
   */
   Value* stackTop; // 8 bytes
-  Table globals;
+  /*
+  Globals are resolved to a slot index by the compiler. globalNames maps each
+  name to its slot (stored as a number), globalValues holds the values
+  themselves. A slot that has been referenced but not defined yet holds
+  UNDEFINED_VAL, which is how late-bound and undefined names are caught at
+  runtime.
+  */
+  Table globalNames;
+  ValueArray globalValues;
   Table strings;
+  /*
+  The upvalue still pointing at each stack slot, NULL for a slot nothing has
+  captured. Indexed like the stack (stackSlots entries), so capturing a local
+  finds the upvalue to share in one load instead of walking a list, and a
+  return only looks at the slots of its own frame.
+  */
+  ObjUpvalue** openUpvalues;
+
+  /*
+  Garbage collector state. Every byte that goes through reallocate() is
+  counted in bytesAllocated, once it crosses nextGC a collection runs and the
+  threshold is moved to the surviving heap size times gcGrowFactor.
+  The gray stack holds marked objects whose references haven't been traced
+  yet, it is allocated with plain realloc() so growing it can't recurse into
+  the collector.
+  */
+  size_t bytesAllocated;
+  size_t nextGC;
+  double gcGrowFactor;
+  int grayCount;
+  int grayCapacity;
+  Obj** grayStack;
+  // With GC_GENERATIONAL this is the nursery, every new object starts here
   Obj* objects;
-  ObjUpvalue* openUpvalues;
-} VM; // 2072 bytes (2.072kb)
+#ifdef GC_GENERATIONAL
+  Obj* oldObjects;
+  // Bytes allocated since the last collection of either kind
+  size_t bytesSinceGC;
+  // Old objects written with a young reference since the last collection
+  int rememberedCount;
+  int rememberedCapacity;
+  Obj** rememberedSet;
+  // The collection currently running only traces the nursery
+  bool minorGC;
+#endif
+  GCStats gcStats;
+  ObjectPools pools;
+
+  // Where `print` goes (see include/output.h)
+  Output output;
+  // The compile in progress, its functions are GC roots (see compile())
+  struct Parser* parser;
+  bool compileReportedErrors;
+  // .loxc files whose bytecode the loaded functions point into
+  struct MappedCache* mappedCaches;
+#ifdef PROFILE
+  // NULL while not profiling (see include/profiler.h)
+  struct Profiler* profiler;
+#endif
+}; // 408 bytes, the frames, the stack and the output buffer live on the heap
 
 typedef enum {
   INTERPRET_OK,
@@ -42,16 +148,26 @@ typedef enum {
   INTERPRET_RUNTIME_ERROR,
 } InterpretResult;
 
-// Expose the global vm variable
-extern VM vm;
-
-void initVM();
-void freeVM();
+void initVM(VM* vm);
+// initVM() with room for maxFrames nested calls and stackSlots values, the
+// stack gets at least UINT8_COUNT slots
+void initVMWithLimits(VM* vm, int maxFrames, int stackSlots);
+void freeVM(VM* vm);
 // By saying "const" we prevent anything from manipulating the source downstream
-InterpretResult interpret(const char* source);
+InterpretResult interpret(VM* vm, const char* source);
+// Runs an already compiled top level function (see include/cache.h)
+InterpretResult interpretFunction(VM* vm, ObjFunction* function);
+
+// Returns the slot of a global, reserving a new (undefined) one the first
+// time a name is seen, or -1 once all UINT16_MAX slots the global array (a
+// ValueArray) can hold are taken
+int resolveGlobal(VM* vm, ObjString* name);
+// Reverse lookup of resolveGlobal(), only used for error messages and the
+// disassembler
+ObjString* globalName(VM* vm, int slot);
 
 // Stack methods
-void push(Value value);
-Value pop();
+void push(VM* vm, Value value);
+Value pop(VM* vm);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,658 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "chunk.h"
+#include "file.h"
+#include "memory.h"
+#include "object.h"
+#include "value.h"
+#include "vm.h"
+
+/*
+Layout, every integer little endian:
+
+  header    "LOXC" u32 version, u32 build flags, u64 source hash,
+            u64 source size, i64 source mtime
+  globals   u32 count, then one string per slot in slot order
+  function  the top level function, see writeFunction()
+
+  string    u32 length (0xffffffff for none) and the bytes
+  constant  u8 tag and its payload, nested functions are written in place
+
+Global slots are baked into the bytecode, so the names are stored in slot
+order and the loader only accepts the cache if every name lands in the same
+slot again (which it does in a fresh VM, the natives are defined first either
+way).
+*/
+
+#define CACHE_MAGIC "LOXC"
+#define NO_STRING 0xffffffffu
+
+// Loaded caches stay mapped until closeCaches(), their bytecode is used in
+// place. Each VM keeps the list of the ones it loaded
+typedef struct MappedCache {
+  FileView view;
+  struct MappedCache* next;
+} MappedCache;
+
+/*
+Every build option that changes what a cache holds. PEEPHOLE decides whether
+superinstructions show up in the code, NAN_BOXING how the constants the code
+refers to are represented and STRING_HASH_WYHASH the hashes every string is
+interned under. A cache from a build with any of them set differently is
+compiled again.
+*/
+#ifdef PEEPHOLE
+#define CACHE_FLAG_PEEPHOLE (1u << 0)
+#else
+#define CACHE_FLAG_PEEPHOLE 0u
+#endif
+#ifdef NAN_BOXING
+#define CACHE_FLAG_NAN_BOXING (1u << 1)
+#else
+#define CACHE_FLAG_NAN_BOXING 0u
+#endif
+#ifdef STRING_HASH_WYHASH
+#define CACHE_FLAG_WYHASH (1u << 2)
+#else
+#define CACHE_FLAG_WYHASH 0u
+#endif
+#define CACHE_FLAGS                                                            \
+  (CACHE_FLAG_PEEPHOLE | CACHE_FLAG_NAN_BOXING | CACHE_FLAG_WYHASH)
+
+typedef enum {
+  CONSTANT_NIL,
+  CONSTANT_FALSE,
+  CONSTANT_TRUE,
+  CONSTANT_NUMBER,
+  CONSTANT_STRING,
+  CONSTANT_FUNCTION,
+} ConstantTag;
+
+SourceKey sourceKey(const char* path, const char* source) {
+  SourceKey key;
+  key.hash = 14695981039346656037u;
+  key.size = 0;
+  for (const char* c = source; *c != '\0'; c++) {
+    key.hash ^= (uint8_t)*c;
+    key.hash *= 1099511628211u;
+    key.size++;
+  }
+
+  struct stat info;
+  key.mtime = stat(path, &info) == 0 ? (int64_t)info.st_mtime : 0;
+  return key;
+}
+
+char* cachePath(const char* sourcePath) {
+  size_t length = strlen(sourcePath);
+  char* path = malloc(length + 6);
+  memcpy(path, sourcePath, length + 1);
+
+  if (length >= 4 && strcmp(sourcePath + length - 4, ".lox") == 0) {
+    strcat(path, "c");
+  } else {
+    strcat(path, ".loxc");
+  }
+  return path;
+}
+
+// ============================================================================
+// WRITING
+// ============================================================================
+
+static void writeU8(FILE* file, uint8_t value) { fputc(value, file); }
+
+static void writeU32(FILE* file, uint32_t value) {
+  for (int i = 0; i < 4; i++) fputc((value >> (i * 8)) & 0xff, file);
+}
+
+static void writeU64(FILE* file, uint64_t value) {
+  for (int i = 0; i < 8; i++) fputc((value >> (i * 8)) & 0xff, file);
+}
+
+static void writeString(FILE* file, ObjString* string) {
+  if (string == NULL) {
+    writeU32(file, NO_STRING);
+    return;
+  }
+  writeU32(file, (uint32_t)string->length);
+  fwrite(string->chars, 1, string->length, file);
+}
+
+static void writeFunction(FILE* file, ObjFunction* function) {
+  writeU32(file, (uint32_t)function->arity);
+  writeU32(file, (uint32_t)function->upvalueCount);
+  writeU32(file, (uint32_t)function->maxStack);
+  writeU8(file, function->hasCaptures);
+  writeString(file, function->name);
+
+  Chunk* chunk = &function->chunk;
+  writeU32(file, (uint32_t)chunk->count);
+  fwrite(chunk->code, 1, chunk->count, file);
+
+  writeU32(file, (uint32_t)chunk->lineCount);
+  for (int i = 0; i < chunk->lineCount; i++) {
+    writeU32(file, (uint32_t)chunk->lines[i].offset);
+    writeU32(file, (uint32_t)chunk->lines[i].line);
+  }
+
+  writeU32(file, (uint32_t)chunk->constants.count);
+  for (int i = 0; i < chunk->constants.count; i++) {
+    Value value = chunk->constants.values[i];
+    if (IS_NIL(value)) {
+      writeU8(file, CONSTANT_NIL);
+    } else if (IS_BOOL(value)) {
+      writeU8(file, AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+    } else if (IS_NUMBER(value)) {
+      double number = AS_NUMBER(value);
+      uint64_t bits;
+      memcpy(&bits, &number, sizeof(bits));
+      writeU8(file, CONSTANT_NUMBER);
+      writeU64(file, bits);
+    } else if (IS_STRING(value)) {
+      writeU8(file, CONSTANT_STRING);
+      writeString(file, AS_STRING(value));
+    } else {
+      // The compiler only ever puts functions in the pool besides literals
+      writeU8(file, CONSTANT_FUNCTION);
+      writeFunction(file, AS_FUNCTION(value));
+    }
+  }
+}
+
+bool writeCache(VM* vm, const char* path, ObjFunction* function,
+                SourceKey* key) {
+  // Written next to the target and renamed over it, so a process starting up
+  // at the same time never reads half a file
+  size_t length = strlen(path);
+  char* temporary = malloc(length + 32);
+  snprintf(temporary, length + 32, "%s.%ld.tmp", path, (long)getpid());
+
+  FILE* file = fopen(temporary, "wb");
+  if (file == NULL) {
+    free(temporary);
+    return false;
+  }
+
+  fwrite(CACHE_MAGIC, 1, 4, file);
+  writeU32(file, CACHE_VERSION);
+  writeU32(file, CACHE_FLAGS);
+  writeU64(file, key->hash);
+  writeU64(file, key->size);
+  writeU64(file, (uint64_t)key->mtime);
+
+  int globalCount = vm->globalValues.count;
+  ObjString** names = calloc(globalCount > 0 ? globalCount : 1,
+                             sizeof(ObjString*));
+  for (int i = 0; i < vm->globalNames.capacity; i++) {
+    Entry* entry = &vm->globalNames.entries[i];
+    if (entry->key == NULL) continue;
+    int slot = (int)AS_NUMBER(entry->value);
+    if (slot < globalCount) names[slot] = entry->key;
+  }
+  writeU32(file, (uint32_t)globalCount);
+  for (int i = 0; i < globalCount; i++) writeString(file, names[i]);
+  free(names);
+
+  writeFunction(file, function);
+
+  bool written = !ferror(file);
+  written = fclose(file) == 0 && written;
+  if (written) written = rename(temporary, path) == 0;
+  if (!written) remove(temporary);
+
+  free(temporary);
+  return written;
+}
+
+// ============================================================================
+// READING
+// ============================================================================
+
+typedef struct {
+  const uint8_t* data;
+  size_t size;
+  size_t position;
+  bool failed; // set once anything runs past the end or doesn't add up
+} Reader;
+
+static bool readBytes(Reader* reader, size_t count) {
+  if (reader->failed || reader->size - reader->position < count) {
+    reader->failed = true;
+    return false;
+  }
+  return true;
+}
+
+static uint8_t readU8(Reader* reader) {
+  if (!readBytes(reader, 1)) return 0;
+  return reader->data[reader->position++];
+}
+
+static uint32_t readU32(Reader* reader) {
+  if (!readBytes(reader, 4)) return 0;
+  uint32_t value = 0;
+  for (int i = 0; i < 4; i++) {
+    value |= (uint32_t)reader->data[reader->position++] << (i * 8);
+  }
+  return value;
+}
+
+static uint64_t readU64(Reader* reader) {
+  if (!readBytes(reader, 8)) return 0;
+  uint64_t value = 0;
+  for (int i = 0; i < 8; i++) {
+    value |= (uint64_t)reader->data[reader->position++] << (i * 8);
+  }
+  return value;
+}
+
+// NULL for a missing string, check reader->failed to tell it from an error
+static ObjString* readString(VM* vm, Reader* reader) {
+  uint32_t length = readU32(reader);
+  if (length == NO_STRING || !readBytes(reader, length)) return NULL;
+
+  const char* chars = (const char*)reader->data + reader->position;
+  reader->position += length;
+  return copyString(vm, chars, (int)length);
+}
+
+/*
+Past the header a cache is still only bytes and run() trusts its code
+completely, so no function is handed out before its code has been checked:
+  - every instruction is one the compiler emits (quickened ones never reach a
+    cache and couldn't rewrite themselves in the read only mapping), whole,
+    and indexes a constant, global or upvalue that exists
+  - every jump lands on the start of an instruction
+  - following every path from the entry, the stack is as deep wherever two
+    paths meet, never has to give up more values than it holds above slot 0,
+    holds every local slot an instruction touches, never outgrows maxStack
+    (call() sizes the stack by it) and nothing runs off the end of the code
+Nested functions were checked as their constants were read.
+*/
+typedef struct {
+  int length;
+  int target;        // where a jump lands, -1 for anything else
+  bool fallsThrough; // false after OP_RETURN, OP_JUMP and OP_LOOP
+  int pops;
+  int pushes;
+  int peak;          // values it can briefly have on top of the pops
+  int slot;          // highest local slot it touches, -1 for none
+} Instruction;
+
+// false if the instruction at offset doesn't check out
+static bool decodeInstruction(VM* vm, ObjFunction* function, int offset,
+                              Instruction* instruction) {
+  Chunk* chunk = &function->chunk;
+  const uint8_t* code = chunk->code + offset;
+  int remaining = chunk->count - offset;
+  int constants = chunk->constants.count;
+  int globals = vm->globalValues.count;
+  *instruction = (Instruction){1, -1, true, 0, 0, 0, -1};
+
+#define OPERANDS(n) if (remaining < 1 + (n)) return false
+#define SHORT(n) ((code[n] << 8) | code[(n) + 1])
+#define CHECK(condition) if (!(condition)) return false
+#define EFFECT(length_, pops_, pushes_)                                        \
+  do {                                                                         \
+    instruction->length = (length_);                                          \
+    instruction->pops = (pops_);                                              \
+    instruction->pushes = (pushes_);                                          \
+  } while (false)
+
+  // clang-format off
+  switch (code[0]) {
+  case OP_NIL:
+  case OP_TRUE:
+  case OP_FALSE: EFFECT(1, 0, 1); break;
+  case OP_POP:
+  case OP_PRINT:
+  case OP_CLOSE_UPVALUE: EFFECT(1, 1, 0); break;
+  case OP_EQUAL:
+  case OP_GREATER:
+  case OP_LESS:
+  case OP_ADD:
+  case OP_SUBTRACT:
+  case OP_MULTIPLY:
+  case OP_DIVIDE: EFFECT(1, 2, 1); break;
+  case OP_NOT:
+  case OP_NEGATE: EFFECT(1, 1, 1); break;
+  case OP_RETURN: EFFECT(1, 1, 0); instruction->fallsThrough = false; break;
+  case OP_CALL_0:
+  case OP_CALL_1:
+  case OP_CALL_2:
+  case OP_CALL_3: EFFECT(1, code[0] - OP_CALL_0 + 1, 1); break;
+  case OP_CALL:
+  case OP_TAIL_CALL: OPERANDS(1); EFFECT(2, code[1] + 1, 1); break;
+  case OP_CONSTANT:
+    OPERANDS(1);
+    CHECK(code[1] < constants);
+    EFFECT(2, 0, 1);
+    break;
+  case OP_CONSTANT_LONG:
+    OPERANDS(2);
+    CHECK(SHORT(1) < constants);
+    EFFECT(3, 0, 1);
+    break;
+  case OP_GET_GLOBAL:
+  case OP_SET_GLOBAL:
+  case OP_DEFINE_GLOBAL:
+    OPERANDS(1);
+    CHECK(code[1] < globals);
+    if (code[0] == OP_GET_GLOBAL) EFFECT(2, 0, 1);
+    else if (code[0] == OP_SET_GLOBAL) EFFECT(2, 1, 1);
+    else EFFECT(2, 1, 0);
+    break;
+  case OP_GET_GLOBAL_LONG:
+  case OP_SET_GLOBAL_LONG:
+  case OP_DEFINE_GLOBAL_LONG:
+    OPERANDS(2);
+    CHECK(SHORT(1) < globals);
+    if (code[0] == OP_GET_GLOBAL_LONG) EFFECT(3, 0, 1);
+    else if (code[0] == OP_SET_GLOBAL_LONG) EFFECT(3, 1, 1);
+    else EFFECT(3, 1, 0);
+    break;
+  case OP_GET_LOCAL:
+  case OP_SET_LOCAL:
+  case OP_SET_LOCAL_POP:
+    OPERANDS(1);
+    instruction->slot = code[1];
+    if (code[0] == OP_GET_LOCAL) EFFECT(2, 0, 1);
+    else if (code[0] == OP_SET_LOCAL) EFFECT(2, 1, 1);
+    else EFFECT(2, 1, 0);
+    break;
+  case OP_GET_UPVALUE:
+  case OP_SET_UPVALUE:
+    OPERANDS(1);
+    CHECK(code[1] < function->upvalueCount);
+    if (code[0] == OP_GET_UPVALUE) EFFECT(2, 0, 1);
+    else EFFECT(2, 1, 1);
+    break;
+  case OP_ADD_LOCAL_CONST:
+    OPERANDS(2);
+    CHECK(code[2] < constants);
+    instruction->slot = code[1];
+    // Strings fall back to OP_ADD with both operands pushed
+    instruction->peak = 2;
+    EFFECT(3, 0, 1);
+    break;
+  case OP_JUMP:
+  case OP_JUMP_IF_FALSE:
+  case OP_POP_JUMP_IF_FALSE:
+    OPERANDS(2);
+    instruction->target = offset + 3 + SHORT(1);
+    if (code[0] == OP_JUMP) instruction->fallsThrough = false;
+    if (code[0] == OP_JUMP_IF_FALSE) EFFECT(3, 1, 1);
+    else if (code[0] == OP_POP_JUMP_IF_FALSE) EFFECT(3, 1, 0);
+    else EFFECT(3, 0, 0);
+    break;
+  case OP_LOOP:
+    OPERANDS(2);
+    instruction->target = offset + 3 - SHORT(1);
+    instruction->fallsThrough = false;
+    EFFECT(3, 0, 0);
+    break;
+  case OP_JUMP_IF_NOT_LESS_LOCALS:
+  case OP_JUMP_IF_NOT_LESS_LOCAL_CONST:
+    OPERANDS(4);
+    if (code[0] == OP_JUMP_IF_NOT_LESS_LOCALS) {
+      instruction->slot = code[1] > code[2] ? code[1] : code[2];
+    } else {
+      CHECK(code[2] < constants);
+      instruction->slot = code[1];
+    }
+    instruction->target = offset + 5 + SHORT(3);
+    EFFECT(5, 0, 0);
+    break;
+  case OP_CLOSURE:
+  case OP_CLOSURE_LONG: {
+    int length = code[0] == OP_CLOSURE_LONG ? 3 : 2;
+    OPERANDS(length - 1);
+    int index = length == 3 ? SHORT(1) : code[1];
+    CHECK(index < constants && IS_FUNCTION(chunk->constants.values[index]));
+
+    ObjFunction* closed = AS_FUNCTION(chunk->constants.values[index]);
+    OPERANDS(length - 1 + closed->upvalueCount * 2);
+    for (int i = 0; i < closed->upvalueCount; i++) {
+      uint8_t isLocal = code[length + i * 2];
+      uint8_t slot = code[length + i * 2 + 1];
+      CHECK(isLocal <= 1);
+      if (isLocal) {
+        if (slot > instruction->slot) instruction->slot = slot;
+      } else {
+        CHECK(slot < function->upvalueCount);
+      }
+    }
+    EFFECT(length + closed->upvalueCount * 2, 0, 1);
+    break;
+  }
+  default: return false;
+  }
+  // clang-format on
+  return true;
+
+#undef OPERANDS
+#undef SHORT
+#undef CHECK
+#undef EFFECT
+}
+
+// Records the depth the stack has when a path reaches offset, false if an
+// earlier path got there with a different one
+static bool reach(int* depths, int* pending, int* pendingCount, int offset,
+                  int depth) {
+  if (depths[offset] == -1) {
+    depths[offset] = depth;
+    pending[(*pendingCount)++] = offset;
+    return true;
+  }
+  return depths[offset] == depth;
+}
+
+static bool verifyFunction(VM* vm, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  int count = chunk->count;
+  if (function->arity < 0 || function->arity > UINT8_MAX ||
+      function->upvalueCount < 0 || function->upvalueCount > UINT8_COUNT ||
+      function->maxStack <= function->arity || count == 0) {
+    return false;
+  }
+
+  // Plain malloc(), none of this is part of the GC heap. depths[] is -1 for
+  // the bytes no path has reached yet, and stays -1 for operand bytes
+  bool* starts = calloc(count, sizeof(bool));
+  int* depths = malloc(sizeof(int) * count);
+  int* pending = malloc(sizeof(int) * count);
+  if (starts == NULL || depths == NULL || pending == NULL) {
+    fprintf(stderr, "Failed to allocate memory: cache verification\n");
+    exit(1);
+  }
+  for (int i = 0; i < count; i++) depths[i] = -1;
+
+  bool valid = true;
+  Instruction instruction;
+  for (int offset = 0; offset < count && valid; offset += instruction.length) {
+    valid = decodeInstruction(vm, function, offset, &instruction);
+    starts[offset] = valid;
+  }
+
+  // Slot 0 holds the function, the arguments follow it
+  int pendingCount = 0;
+  if (valid) {
+    valid = reach(depths, pending, &pendingCount, 0, function->arity + 1);
+  }
+
+  while (pendingCount > 0 && valid) {
+    int offset = pending[--pendingCount];
+    int depth = depths[offset];
+    decodeInstruction(vm, function, offset, &instruction);
+
+    int after = depth - instruction.pops + instruction.pushes;
+    if (instruction.slot >= depth || depth - instruction.pops < 1 ||
+        depth - instruction.pops + instruction.peak > function->maxStack ||
+        after > function->maxStack) {
+      valid = false;
+      break;
+    }
+
+    int next = offset + instruction.length;
+    if (instruction.fallsThrough) {
+      valid = next < count &&
+              reach(depths, pending, &pendingCount, next, after);
+    }
+    int target = instruction.target;
+    if (valid && target != -1) {
+      valid = target >= 0 && target < count && starts[target] &&
+              reach(depths, pending, &pendingCount, target, after);
+    }
+  }
+
+  free(starts);
+  free(depths);
+  free(pending);
+  return valid;
+}
+
+/*
+Every object is kept on the VM stack while it is filled in, loading allocates
+and any allocation can collect. The function may also get promoted by a minor
+collection half way through, hence the write barriers.
+*/
+static ObjFunction* readFunction(VM* vm, Reader* reader) {
+  ObjFunction* function = newFunction(vm);
+  push(vm, OBJ_VAL(function));
+
+  function->arity = (int)readU32(reader);
+  function->upvalueCount = (int)readU32(reader);
+  function->maxStack = (int)readU32(reader);
+  function->hasCaptures = readU8(reader) != 0;
+  function->name = readString(vm, reader);
+  if (function->name != NULL) {
+    WRITE_BARRIER(vm, function, OBJ_VAL(function->name));
+  }
+
+  // The code is used straight out of the mapping, capacity 0 tells
+  // freeChunk() the chunk doesn't own it and isCached keeps run() from
+  // writing to it
+  Chunk* chunk = &function->chunk;
+  uint32_t count = readU32(reader);
+  if (readBytes(reader, count) && count > 0) {
+    chunk->code = (uint8_t*)reader->data + reader->position;
+    chunk->capacity = 0;
+    chunk->count = (int)count;
+    reader->position += count;
+    function->isCached = true;
+  }
+
+  uint32_t lineCount = readU32(reader);
+  if (readBytes(reader, (size_t)lineCount * 8) && lineCount > 0) {
+    chunk->lines = ALLOCATE(vm, LineStart, lineCount);
+    chunk->lineCapacity = (int)lineCount;
+    chunk->lineCount = (int)lineCount;
+    for (uint32_t i = 0; i < lineCount; i++) {
+      chunk->lines[i].offset = (int)readU32(reader);
+      chunk->lines[i].line = (int)readU32(reader);
+    }
+  }
+
+  uint32_t constantCount = readU32(reader);
+  for (uint32_t i = 0; i < constantCount && !reader->failed; i++) {
+    Value value = NIL_VAL;
+    switch (readU8(reader)) {
+    case CONSTANT_NIL: value = NIL_VAL; break;
+    case CONSTANT_FALSE: value = BOOL_VAL(false); break;
+    case CONSTANT_TRUE: value = BOOL_VAL(true); break;
+    case CONSTANT_NUMBER: {
+      uint64_t bits = readU64(reader);
+      double number;
+      memcpy(&number, &bits, sizeof(number));
+      value = NUMBER_VAL(number);
+      break;
+    }
+    case CONSTANT_STRING: {
+      ObjString* string = readString(vm, reader);
+      if (string == NULL) reader->failed = true;
+      else value = OBJ_VAL(string);
+      break;
+    }
+    case CONSTANT_FUNCTION: value = OBJ_VAL(readFunction(vm, reader)); break;
+    default: reader->failed = true; break;
+    }
+
+    // Straight into the pool, addConstant() would merge slots the code
+    // refers to separately
+    push(vm, value);
+    writeValueArray(vm, &chunk->constants, value);
+    pop(vm);
+    WRITE_BARRIER(vm, function, value);
+  }
+
+  if (!reader->failed && !verifyFunction(vm, function)) reader->failed = true;
+  pop(vm);
+  return function;
+}
+
+ObjFunction* readCache(VM* vm, const char* path, SourceKey* key) {
+  FileView view;
+  if (!openFileView(path, &view, false)) return NULL;
+
+  const uint8_t* data = (const uint8_t*)view.data;
+  Reader reader = {data, view.size, 0, false};
+  ObjFunction* function = NULL;
+  // Global slots this load reserves are given back if it fails
+  int firstNewGlobal = vm->globalValues.count;
+
+  if (!readBytes(&reader, 4) || memcmp(data, CACHE_MAGIC, 4) != 0) goto done;
+  reader.position += 4;
+  if (readU32(&reader) != CACHE_VERSION) goto done;
+  if (readU32(&reader) != CACHE_FLAGS) goto done;
+
+  uint64_t hash = readU64(&reader);
+  uint64_t sourceSize = readU64(&reader);
+  int64_t mtime = (int64_t)readU64(&reader);
+  if (reader.failed) goto done;
+  if (key != NULL &&
+      (hash != key->hash || sourceSize != key->size || mtime != key->mtime)) {
+    goto done;
+  }
+
+  uint32_t globalCount = readU32(&reader);
+  for (uint32_t i = 0; i < globalCount && !reader.failed; i++) {
+    ObjString* name = readString(vm, &reader);
+    if (name == NULL || resolveGlobal(vm, name) != (int)i) reader.failed = true;
+  }
+  if (reader.failed) goto done;
+
+  function = readFunction(vm, &reader);
+  if (reader.failed) function = NULL;
+
+done:
+  if (function == NULL) {
+    closeFileView(&view);
+    // Nothing refers to them, the file will be recompiled into a fresh set
+    while (vm->globalValues.count > firstNewGlobal) {
+      int slot = --vm->globalValues.count;
+      tableDelete(&vm->globalNames, globalName(vm, slot));
+    }
+  } else {
+    MappedCache* cache = malloc(sizeof(MappedCache));
+    cache->view = view;
+    cache->next = vm->mappedCaches;
+    vm->mappedCaches = cache;
+  }
+  return function;
+}
+
+void closeCaches(VM* vm) {
+  while (vm->mappedCaches != NULL) {
+    MappedCache* next = vm->mappedCaches->next;
+    closeFileView(&vm->mappedCaches->view);
+    free(vm->mappedCaches);
+    vm->mappedCaches = next;
+  }
+}
@@ -1,16 +1,24 @@
 #include <stdlib.h>
+#include <string.h>
 
 #include "chunk.h"
+#include "object.h"
+#include "vm.h"
 
 void initChunk(Chunk* chunk) {
   chunk->count = 0;
   chunk->capacity = 0;
   chunk->code = NULL;
   chunk->lines = NULL;
+  chunk->lineCount = 0;
+  chunk->lineCapacity = 0;
   initValueArray(&chunk->constants);
+  chunk->constantIndex = NULL;
+  chunk->constantIndexCount = 0;
+  chunk->constantIndexCapacity = 0;
 }
 
-void writeChunk(Chunk* chunk, uint8_t byte, int line) {
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line) {
   // If the capacity is smaller the the count with one more added
   if (chunk->capacity < chunk->count + 1) {
     // Save the current capacity
@@ -20,39 +28,219 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     chunk->capacity = GROW_CAPACITY(oldCapacity);
     int newCapacity = chunk->capacity;
     // Allocate new memory, move the existing into the new and free the old
-    chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, newCapacity);
-    chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, newCapacity);
+    chunk->code =
+        GROW_ARRAY(vm, uint8_t, chunk->code, oldCapacity, newCapacity);
   }
 
   chunk->code[chunk->count] = byte;
-  chunk->lines[chunk->count] = line;
-
   chunk->count++;
+
+  // Still on the same line, the current run just gets longer
+  if (chunk->lineCount > 0 && chunk->lines[chunk->lineCount - 1].line == line) {
+    return;
+  }
+
+  if (chunk->lineCapacity < chunk->lineCount + 1) {
+    int oldCapacity = chunk->lineCapacity;
+    chunk->lineCapacity = GROW_CAPACITY(oldCapacity);
+    chunk->lines = GROW_ARRAY(vm, LineStart, chunk->lines, oldCapacity,
+                              chunk->lineCapacity);
+  }
+
+  LineStart* lineStart = &chunk->lines[chunk->lineCount++];
+  lineStart->offset = chunk->count - 1;
+  lineStart->line = line;
+}
+
+/* Binary search for the last run starting at or before offset */
+int getLine(Chunk* chunk, int offset) {
+  int start = 0;
+  int end = chunk->lineCount - 1;
+
+  while (start < end) {
+    int mid = start + (end - start + 1) / 2;
+    if (chunk->lines[mid].offset <= offset) {
+      start = mid;
+    } else {
+      end = mid - 1;
+    }
+  }
+
+  return chunk->lineCount == 0 ? 0 : chunk->lines[start].line;
 }
 
-void freeChunk(Chunk* chunk) {
-  FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-  FREE_ARRAY(int, chunk->lines, chunk->capacity);
-  freeValueArray(&chunk->constants);
+void truncateChunk(Chunk* chunk, int count) {
+  chunk->count = count;
+  while (chunk->lineCount > 0 &&
+         chunk->lines[chunk->lineCount - 1].offset >= count) {
+    chunk->lineCount--;
+  }
+}
+
+void freeChunk(VM* vm, Chunk* chunk) {
+  // Code loaded from a .loxc points into the mapped file and has no capacity
+  if (chunk->capacity > 0) {
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+  }
+  FREE_ARRAY(vm, LineStart, chunk->lines, chunk->lineCapacity);
+  freeValueArray(vm, &chunk->constants);
+  FREE_ARRAY(vm, int, chunk->constantIndex, chunk->constantIndexCapacity);
   // We leave the chunk in a well-defined known state (zeroed out)
   initChunk(chunk);
 }
 
 /*
-Adds a constant into the pool of constants of the passed chunk.
+Only numbers and strings are shared. Numbers compare by their bits so 0 and
+-0 stay apart, strings are interned so the pointer is enough.
+
+@return - false for values that always get their own slot
+*/
+static bool constantHash(Value value, uint32_t* hash) {
+  if (IS_NUMBER(value)) {
+    double number = AS_NUMBER(value);
+    uint64_t bits;
+    memcpy(&bits, &number, sizeof(bits));
+    bits *= 0x9e3779b97f4a7c15u;
+    *hash = (uint32_t)(bits >> 32);
+    return true;
+  }
+  if (IS_STRING(value)) {
+    *hash = AS_STRING(value)->hash;
+    return true;
+  }
+  return false;
+}
+
+static bool sameConstant(Value a, Value b) {
+  if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    return memcmp(&x, &y, sizeof(double)) == 0;
+  }
+  return IS_STRING(a) && IS_STRING(b) && AS_STRING(a) == AS_STRING(b);
+}
+
+/* Pool index of an equal constant, -1 if there is none. Entries past the end
+ * of the pool are left behind when the compiler takes constants back off it,
+ * they're skipped like any other mismatch */
+static int findConstant(Chunk* chunk, Value value, uint32_t hash) {
+  if (chunk->constantIndexCapacity == 0) return -1;
+
+  int mask = chunk->constantIndexCapacity - 1;
+  for (int slot = hash & mask;; slot = (slot + 1) & mask) {
+    int entry = chunk->constantIndex[slot];
+    if (entry == 0) return -1;
+
+    int index = entry - 1;
+    if (index < chunk->constants.count &&
+        sameConstant(chunk->constants.values[index], value)) {
+      return index;
+    }
+  }
+}
+
+static void insertConstantIndex(Chunk* chunk, int index, uint32_t hash) {
+  int mask = chunk->constantIndexCapacity - 1;
+  int slot = hash & mask;
+  while (chunk->constantIndex[slot] != 0) slot = (slot + 1) & mask;
+  chunk->constantIndex[slot] = index + 1;
+  chunk->constantIndexCount++;
+}
+
+/* Adds the pool slot to the index, rebuilding it from the pool at half load */
+static void indexConstant(VM* vm, Chunk* chunk, int index, uint32_t hash) {
+  if (chunk->constantIndexCount + 1 > chunk->constantIndexCapacity / 2) {
+    int oldCapacity = chunk->constantIndexCapacity;
+    FREE_ARRAY(vm, int, chunk->constantIndex, oldCapacity);
+
+    chunk->constantIndexCapacity = oldCapacity < 8 ? 8 : oldCapacity * 2;
+    chunk->constantIndex = ALLOCATE(vm, int, chunk->constantIndexCapacity);
+    memset(chunk->constantIndex, 0, sizeof(int) * chunk->constantIndexCapacity);
+    chunk->constantIndexCount = 0;
+
+    for (int i = 0; i < index; i++) {
+      uint32_t existing;
+      if (constantHash(chunk->constants.values[i], &existing)) {
+        insertConstantIndex(chunk, i, existing);
+      }
+    }
+  }
+
+  insertConstantIndex(chunk, index, hash);
+}
+
+/*
+Adds a constant into the pool of constants of the passed chunk, or finds the
+slot the same number or string already has.
 
 @return -The index of the constant
 */
-uint16_t addConstant(Chunk* chunk, Value value) {
-  writeValueArray(&chunk->constants, value);
+int addConstant(VM* vm, Chunk* chunk, Value value) {
+  uint32_t hash;
+  bool shared = constantHash(value, &hash);
+  if (shared) {
+    int existing = findConstant(chunk, value, hash);
+    if (existing != -1) return existing;
+  }
+
+  // Growing the constants array or its index can trigger a collection, keep
+  // the value on the stack so the GC can see it until both are done. Being in
+  // the pool isn't enough, a minor collection doesn't trace an old function's
+  // pool before the caller's write barrier has run
+  push(vm, value);
+  writeValueArray(vm, &chunk->constants, value);
   // The arrow syntax `->` is for accessing struct members through a pointer
   // The dot syntax `.` is for accessing struct members directly from a struct
   // variable
-  return chunk->constants.count - 1;
+  int index = chunk->constants.count - 1;
+  if (shared) indexConstant(vm, chunk, index, hash);
+  pop(vm);
+  return index;
 
   /*
     The `writeValueArray` function will end up incrementing the count of the
     ValueArray struct internally, so we return count-1 to return the index of
     the item we actually added
   */
-}
\ No newline at end of file
+}
+
+int instructionLength(Chunk* chunk, int offset) {
+  // clang-format off
+  switch (chunk->code[offset]) {
+    case OP_CONSTANT:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_GLOBAL:
+    case OP_DEFINE_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CALL:
+    case OP_TAIL_CALL:
+    case OP_SET_LOCAL_POP: return 2;
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_LOOP:
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_ADD_LOCAL_CONST:
+    case OP_POP_JUMP_IF_FALSE: return 3;
+    case OP_JUMP_IF_NOT_LESS_LOCALS:
+    case OP_JUMP_IF_NOT_LESS_LOCAL_CONST: return 5;
+    case OP_CLOSURE: {
+      if (offset + 1 >= chunk->count) return 2;
+      Value function = chunk->constants.values[chunk->code[offset + 1]];
+      return 2 + AS_FUNCTION(function)->upvalueCount * 2;
+    }
+    case OP_CLOSURE_LONG: {
+      if (offset + 2 >= chunk->count) return 3;
+      Value function = chunk->constants.values[(chunk->code[offset + 1] << 8) |
+                                                 chunk->code[offset + 2]];
+      return 3 + AS_FUNCTION(function)->upvalueCount * 2;
+    }
+    default: return 1;
+  }
+  // clang-format on
+}
@@ -7,7 +7,9 @@
 #include "chunk.h"
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
 #include "object.h"
+#include "optimizer.h"
 #include "scanner.h"
 #include "value.h"
 
@@ -15,11 +17,16 @@
 #include "debug.h"
 #endif
 
-typedef struct {
+typedef struct Parser {
+  VM* vm;
+  Scanner scanner;
+  // The innermost function being compiled
+  struct Compiler* compiler;
   Token current;
   Token previous;
   bool hadError;
   bool panicMode;
+  bool reportedError;
 } Parser;
 
 /*
@@ -39,7 +46,7 @@ typedef enum {
   PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser* parser, bool canAssign);
 
 typedef struct {
   /*
@@ -74,6 +81,24 @@ typedef enum {
   TYPE_FUNCTION, // Any other function
   TYPE_SCRIPT    // The outer implicit function wrapping the global
 } FunctionType;
+
+/*
+A constant the compiler has just emitted (OP_CONSTANT, OP_NIL, OP_TRUE or
+OP_FALSE). There's no AST to fold over, so instead the compiler remembers
+where its latest constant loads start and, when an operator finds its
+operands are exactly the trailing loads in the chunk, it truncates them and
+emits the result instead.
+*/
+typedef struct {
+  int offset;
+  int length;
+  Value value;
+  // Pool slot the load added, -1 for OP_NIL/TRUE/FALSE and shared constants
+  int poolIndex;
+} ConstantLoad;
+
+#define CONSTANT_HISTORY 8
+
 typedef struct Compiler {
   struct Compiler* enclosing;
 
@@ -84,21 +109,32 @@ typedef struct Compiler {
   Upvalue upvalues[UINT8_COUNT];
   int scopeDepth;
   Local locals[UINT8_COUNT]; // fixed array of 255 locals
-} Compiler;
 
-Parser parser;
-Compiler* current = NULL;
+  // The newest constant loads, only the ones that end exactly where the next
+  // one starts (and the last one at the end of the chunk) can be folded
+  ConstantLoad constants[CONSTANT_HISTORY];
+  int constantCount;
+  // Earliest offset code can be folded from, anything before it may be a
+  // jump target
+  int barrier;
+  // Where the newest call instruction starts, -1 if there's none, so a return
+  // can tell whether its value comes straight out of a call
+  int lastCall;
+} Compiler;
 
-static Chunk* currentChunk() { return &current->function->chunk; }
+static Chunk* currentChunk(Parser* parser) {
+  return &parser->compiler->function->chunk;
+}
 
 // ============================================================================
 // PARSER_UTILITIES
 // ============================================================================
 static void PARSER_UTILITIES() {}
 
-static void errorAt(Token* token, const char* message) {
-  if (parser.panicMode) return;
-  parser.panicMode = true;
+static void errorAt(Parser* parser, Token* token, const char* message) {
+  if (parser->panicMode) return;
+  parser->panicMode = true;
+  parser->reportedError = true;
 
   fprintf(stderr, "[line %d] Error", token->line);
 
@@ -115,159 +151,394 @@ static void errorAt(Token* token, const char* message) {
 }
 
 // Error at previous
-static void error(const char* message) { errorAt(&parser.previous, message); }
+static void error(Parser* parser, const char* message) {
+  errorAt(parser, &parser->previous, message);
+}
 
 // Error at current
-static void errorAtCurrent(const char* message) {
-  errorAt(&parser.current, message);
+static void errorAtCurrent(Parser* parser, const char* message) {
+  errorAt(parser, &parser->current, message);
 }
 
-static void advance() {
-  parser.previous = parser.current;
+static void advance(Parser* parser) {
+  parser->previous = parser->current;
 
   for (;;) {
-    parser.current = scanToken();
+    parser->current = scanToken(&parser->scanner);
 
-    if (parser.current.type != TOKEN_ERROR) break;
+    if (parser->current.type != TOKEN_ERROR) break;
 
-    errorAtCurrent(parser.current.start);
+    errorAtCurrent(parser, parser->current.start);
   }
 }
 
-static void consume(TokenType type, const char* message) {
-  if (parser.current.type == type) {
-    advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+  if (parser->current.type == type) {
+    advance(parser);
     return;
   }
 
-  errorAtCurrent(message);
+  errorAtCurrent(parser, message);
 }
 
-static bool check(TokenType type) { return parser.current.type == type; }
+static bool check(Parser* parser, TokenType type) {
+  return parser->current.type == type;
+}
 
 /* Check against type and advance */
-static bool match(TokenType type) {
-  if (!check(type)) return false;
+static bool match(Parser* parser, TokenType type) {
+  if (!check(parser, type)) return false;
 
-  advance();
+  advance(parser);
   return true;
 }
 
-static void emitByte(uint8_t byte) {
-  writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte) {
+  writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
+}
+
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+  emitByte(parser, byte1);
+  emitByte(parser, byte2);
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-  emitByte(byte1);
-  emitByte(byte2);
+/* Emits the byte sized form of an instruction when the operand fits and the
+ * _LONG form with a 16 bit operand otherwise */
+static void emitIndexed(Parser* parser, uint8_t shortOp, uint8_t longOp,
+                        uint16_t index) {
+  if (index <= UINT8_MAX) {
+    emitBytes(parser, shortOp, (uint8_t)index);
+  } else {
+    emitByte(parser, longOp);
+    emitBytes(parser, (index >> 8) & 0xff, index & 0xff);
+  }
 }
 
-static void emitLoop(int loopStart) {
-  emitByte(OP_LOOP);
+static void emitLoop(Parser* parser, int loopStart) {
+  emitByte(parser, OP_LOOP);
 
-  int offset = currentChunk()->count - loopStart + 2;
-  if (offset > UINT16_MAX) error("Loop body too large");
+  int offset = currentChunk(parser)->count - loopStart + 2;
+  if (offset > UINT16_MAX) error(parser, "Loop body too large");
 
-  emitByte((offset >> 8) & 0xff);
-  emitByte(offset & 0xff);
+  emitByte(parser, (offset >> 8) & 0xff);
+  emitByte(parser, offset & 0xff);
 }
 
 /* Emit an instruction and two bytes, return the index of the first offset byte
  * (to be used to find and overwrite it after the 'then' is parsed) */
-static int emitJump(uint8_t instruction) {
+static int emitJump(Parser* parser, uint8_t instruction) {
   // 2 byte/16 bit offset will allow us to jump 65,535 bytes of code
-  emitByte(instruction);
-  emitByte(0xff);
-  emitByte(0xff);
+  emitByte(parser, instruction);
+  emitByte(parser, 0xff);
+  emitByte(parser, 0xff);
 
-  return currentChunk()->count - 2; // Index of the empty bytes
+  return currentChunk(parser)->count - 2; // Index of the empty bytes
 }
 
-static void emitReturn() {
-  emitByte(OP_NIL);
-  emitByte(OP_RETURN);
+static void emitReturn(Parser* parser) {
+  emitByte(parser, OP_NIL);
+  emitByte(parser, OP_RETURN);
 }
 
 /* Adds the value into the chunks pool of constants
 @returns index of the constant
 */
-static uint16_t makeConstant(Value value) {
-  uint16_t constant = addConstant(currentChunk(), value);
-  if (constant > UINT16_MAX) {
-    error("Too many constants in one chunk");
+static uint16_t makeConstant(Parser* parser, Value value) {
+  // ValueArray stops at UINT16_MAX entries
+  if (currentChunk(parser)->constants.count == UINT16_MAX) {
+    error(parser, "Too many constants in one chunk");
     return 0;
   }
-  return constant;
+  int constant = addConstant(parser->vm, currentChunk(parser), value);
+  WRITE_BARRIER(parser->vm, parser->compiler->function, value);
+  return (uint16_t)constant;
+}
+
+/* Remembers the instruction from `offset` to the end of the chunk as a
+ * constant load, dropping the oldest one once the history is full */
+static void recordConstant(Parser* parser, int offset, Value value,
+                           int poolIndex) {
+  if (parser->compiler->constantCount == CONSTANT_HISTORY) {
+    memmove(parser->compiler->constants, parser->compiler->constants + 1,
+            sizeof(ConstantLoad) * (CONSTANT_HISTORY - 1));
+    parser->compiler->constantCount--;
+  }
+
+  Compiler* compiler = parser->compiler;
+  ConstantLoad* load = &compiler->constants[compiler->constantCount++];
+  load->offset = offset;
+  load->length = currentChunk(parser)->count - offset;
+  load->value = value;
+  load->poolIndex = poolIndex;
+}
+
+/* The constant load `depth` places from the end of the chunk (0 being the
+ * last instruction), NULL if any of the trailing instructions up to it isn't
+ * a constant load or it sits before the barrier */
+static ConstantLoad* trailingConstant(Parser* parser, int depth) {
+  int end = currentChunk(parser)->count;
+  for (int i = 0; i <= depth; i++) {
+    int index = parser->compiler->constantCount - 1 - i;
+    if (index < 0) return NULL;
+
+    ConstantLoad* load = &parser->compiler->constants[index];
+    if (load->offset + load->length != end) return NULL;
+    if (load->offset < parser->compiler->barrier) return NULL;
+    end = load->offset;
+  }
+  Compiler* compiler = parser->compiler;
+  return &compiler->constants[compiler->constantCount - 1 - depth];
+}
+
+/* Truncates the last `count` constant loads off the chunk. The pool slots
+ * they added are given back too when nothing was added after them */
+static void dropConstants(Parser* parser, int count) {
+  Chunk* chunk = currentChunk(parser);
+  for (int i = 0; i < count; i++) {
+    Compiler* compiler = parser->compiler;
+    ConstantLoad* load = &compiler->constants[--compiler->constantCount];
+    if (load->poolIndex != -1 &&
+        load->poolIndex == chunk->constants.count - 1) {
+      chunk->constants.count--;
+    }
+    truncateChunk(chunk, load->offset);
+  }
+}
+
+/* Throws away everything emitted from `start` on, used for code that can
+ * never run */
+static void discardCode(Parser* parser, int start) {
+  truncateChunk(currentChunk(parser), start);
+  parser->compiler->constantCount = 0;
+  parser->compiler->barrier = start;
+  if (parser->compiler->lastCall >= start) parser->compiler->lastCall = -1;
 }
 
-static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+/* Marks the end of the chunk as a place some jump lands on */
+static void markJumpTarget(Parser* parser) {
+  parser->compiler->barrier = currentChunk(parser)->count;
+}
+
+static void emitConstant(Parser* parser, Value value) {
+  int offset = currentChunk(parser)->count;
+  int poolCount = currentChunk(parser)->constants.count;
+  uint16_t constant = makeConstant(parser, value);
+  emitIndexed(parser, OP_CONSTANT, OP_CONSTANT_LONG, constant);
+  // Shared literals were already in the pool, some other load owns them
+  recordConstant(
+      parser, offset, value,
+      currentChunk(parser)->constants.count > poolCount ? constant : -1);
+}
+
+/* Emits the cheapest load for a folded value */
+static void emitFolded(Parser* parser, Value value) {
+  int offset = currentChunk(parser)->count;
+  if (IS_NIL(value)) {
+    emitByte(parser, OP_NIL);
+  } else if (IS_BOOL(value)) {
+    emitByte(parser, AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+  } else {
+    emitConstant(parser, value);
+    return;
+  }
+  recordConstant(parser, offset, value, -1);
 }
 
 /* Patch a bytecode at a give offset by computing the jump distance */
-static void patchJump(int offset) {
+static void patchJump(Parser* parser, int offset) {
   // -2 to adjust for the bytecode for the jump offset itself
-  int jump = currentChunk()->count - offset - 2;
+  int jump = currentChunk(parser)->count - offset - 2;
 
-  if (jump > UINT16_MAX) { error("Too much code to jump over."); }
+  if (jump > UINT16_MAX) { error(parser, "Too much code to jump over."); }
 
-  currentChunk()->code[offset] = (jump >> 8) & 0xff;
-  currentChunk()->code[offset + 1] = jump & 0xff;
+  currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+  currentChunk(parser)->code[offset + 1] = jump & 0xff;
+  markJumpTarget(parser);
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
-  compiler->enclosing = current;
+static void initCompiler(Parser* parser, Compiler* compiler,
+                         FunctionType type) {
+  compiler->enclosing = parser->compiler;
   compiler->function = NULL;
   compiler->type = type;
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
-  compiler->function = newFunction();
-  current = compiler;
+  compiler->constantCount = 0;
+  compiler->barrier = 0;
+  compiler->lastCall = -1;
+  compiler->function = newFunction(parser->vm);
+  parser->compiler = compiler;
 
   // Set the name of the function to the previous token
   if (type != TYPE_SCRIPT) {
-    current->function->name =
-        copyString(parser.previous.start, parser.previous.length);
+    compiler->function->name =
+        copyString(parser->vm, parser->previous.start, parser->previous.length);
+    WRITE_BARRIER(parser->vm, compiler->function,
+                  OBJ_VAL(compiler->function->name));
   }
 
-  Local* local = &current->locals[current->localCount++];
+  Local* local = &compiler->locals[compiler->localCount++];
   local->depth = 0;
   local->isCaptured = false;
   local->name.start = "";
   local->name.length = 0;
 }
 
-static ObjFunction* endCompiler() {
-  emitReturn();
+/*
+  Walks the finished bytecode once and records how deep the value stack can get
+  while this function runs, counted from slot 0 of its frame.
+
+  The compiler only emits structured control flow, so a single forward pass is
+  enough: every forward jump records the depth it arrives with at its target,
+  and the depth at any offset is the deepest of falling through and jumping
+  there. Backward jumps (OP_LOOP) always land where the depth matched already.
+*/
+static int computeMaxStack(Parser* parser, ObjFunction* function) {
+  Chunk* chunk = &function->chunk;
+  int* jumpDepths = ALLOCATE(parser->vm, int, chunk->count + 1);
+  for (int i = 0; i <= chunk->count; i++) jumpDepths[i] = 0;
+
+  // Slot 0 holds the function, the arguments follow it
+  int depth = function->arity + 1;
+  int maxDepth = depth;
+
+  for (int offset = 0; offset < chunk->count;) {
+    if (jumpDepths[offset] > depth) depth = jumpDepths[offset];
+
+    uint8_t instruction = chunk->code[offset];
+    int length = 1;
+
+    // clang-format off
+    switch (instruction) {
+      case OP_CONSTANT:
+      case OP_GET_LOCAL:
+      case OP_GET_GLOBAL:
+      case OP_GET_UPVALUE: depth++; length = 2; break;
+      case OP_CONSTANT_LONG:
+      case OP_GET_GLOBAL_LONG: depth++; length = 3; break;
+      case OP_SET_LOCAL:
+      case OP_SET_GLOBAL:
+      case OP_SET_UPVALUE: length = 2; break;
+      case OP_SET_GLOBAL_LONG: length = 3; break;
+      case OP_DEFINE_GLOBAL: depth--; length = 2; break;
+      case OP_DEFINE_GLOBAL_LONG: depth--; length = 3; break;
+      case OP_NIL:
+      case OP_TRUE:
+      case OP_FALSE: depth++; break;
+      case OP_POP:
+      case OP_EQUAL:
+      case OP_GREATER:
+      case OP_LESS:
+      case OP_ADD:
+      case OP_SUBTRACT:
+      case OP_MULTIPLY:
+      case OP_DIVIDE:
+      case OP_PRINT:
+      case OP_CLOSE_UPVALUE:
+      case OP_RETURN:
+      // Only ever written by the VM, here for completeness
+      case OP_ADD_NUM:
+      case OP_ADD_STR:
+      case OP_SUBTRACT_NUM:
+      case OP_MULTIPLY_NUM:
+      case OP_DIVIDE_NUM:
+      case OP_GREATER_NUM:
+      case OP_LESS_NUM: depth--; break;
+      case OP_NOT:
+      case OP_NEGATE: break;
+      case OP_JUMP:
+      case OP_JUMP_IF_FALSE: {
+        int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+        int target = offset + 3 + jump;
+        if (jumpDepths[target] < depth) jumpDepths[target] = depth;
+        length = 3;
+        break;
+      }
+      case OP_LOOP: length = 3; break;
+      // Superinstructions from the peephole pass
+      case OP_ADD_LOCAL_CONST: {
+        // Strings fall back to OP_ADD with both operands pushed
+        if (depth + 2 > maxDepth) maxDepth = depth + 2;
+        depth++;
+        length = 3;
+        break;
+      }
+      case OP_SET_LOCAL_POP: depth--; length = 2; break;
+      case OP_POP_JUMP_IF_FALSE:
+      case OP_JUMP_IF_NOT_LESS_LOCALS:
+      case OP_JUMP_IF_NOT_LESS_LOCAL_CONST: {
+        if (instruction == OP_POP_JUMP_IF_FALSE) depth--;
+        length = instruction == OP_POP_JUMP_IF_FALSE ? 3 : 5;
+        int jump = (chunk->code[offset + length - 2] << 8) |
+                   chunk->code[offset + length - 1];
+        int target = offset + length + jump;
+        if (jumpDepths[target] < depth) jumpDepths[target] = depth;
+        break;
+      }
+      // The callee and its arguments are replaced by the return value
+      case OP_CALL: depth -= chunk->code[offset + 1]; length = 2; break;
+      case OP_CALL_0:
+      case OP_CALL_1:
+      case OP_CALL_2:
+      case OP_CALL_3: depth -= instruction - OP_CALL_0; break;
+      case OP_TAIL_CALL: depth -= chunk->code[offset + 1]; length = 2; break;
+      case OP_CLOSURE:
+      case OP_CLOSURE_LONG: {
+        bool wide = instruction == OP_CLOSURE_LONG;
+        int index = wide ? (chunk->code[offset + 1] << 8) | chunk->code[offset + 2]
+                         : chunk->code[offset + 1];
+        ObjFunction* closed = AS_FUNCTION(chunk->constants.values[index]);
+        depth++;
+        length = (wide ? 3 : 2) + closed->upvalueCount * 2;
+        break;
+      }
+    }
+    // clang-format on
+
+    if (depth > maxDepth) maxDepth = depth;
+    offset += length;
+  }
+
+  FREE_ARRAY(parser->vm, int, jumpDepths, chunk->count + 1);
+  return maxDepth;
+}
+
+static ObjFunction* endCompiler(Parser* parser) {
+  emitReturn(parser);
 
-  ObjFunction* function = current->function;
+  ObjFunction* function = parser->compiler->function;
+#ifdef PEEPHOLE
+  optimizeChunk(parser->vm, &function->chunk);
+#endif
+  function->maxStack = computeMaxStack(parser, function);
 
 #ifdef DEBUG_PRINT_CODE
-  if (!parser.hadError) {
-    disassembleChunk(currentChunk(), function->name != NULL
+  if (!parser->hadError) {
+    disassembleChunk(parser->vm, currentChunk(parser), function->name != NULL
                                          ? function->name->chars
                                          : "<script>");
   }
 #endif
 
-  current = current->enclosing;
+  parser->compiler = parser->compiler->enclosing;
   return function;
 }
 
-static void beginScope() { current->scopeDepth++; }
+static void beginScope(Parser* parser) { parser->compiler->scopeDepth++; }
 
-static void endScope() {
-  current->scopeDepth--;
+static void endScope(Parser* parser) {
+  Compiler* compiler = parser->compiler;
+  compiler->scopeDepth--;
 
-  while (current->localCount > 0 &&
-         current->locals[current->localCount - 1].depth > current->scopeDepth) {
-    if (current->locals[current->localCount - 1].isCaptured) {
-      emitByte(OP_CLOSE_UPVALUE);
+  while (compiler->localCount > 0 &&
+         compiler->locals[compiler->localCount - 1].depth > compiler->scopeDepth) {
+    if (compiler->locals[compiler->localCount - 1].isCaptured) {
+      emitByte(parser, OP_CLOSE_UPVALUE);
     } else {
 
-      emitByte(OP_POP);
+      emitByte(parser, OP_POP);
     }
-    current->localCount--;
+    compiler->localCount--;
   }
 }
 
@@ -281,96 +552,157 @@ Forward declaration allows for the functions to be declared even tho the full
 bodies are further down, this is okay because the function that make these calls
 are defined before these are declared
 */
-static void expression();
-static void and_(bool canAssign);
-static void or_(bool canAssign);
-static uint8_t argumentList();
+static void expression(Parser* parser);
+static void and_(Parser* parser, bool canAssign);
+static void or_(Parser* parser, bool canAssign);
+static uint8_t argumentList(Parser* parser);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Parser* parser, Precedence precedence);
+
+/* Evaluates the operator at compile time if both operands are the trailing
+ * constant loads. Anything the VM would report as a runtime error is left
+ * for the VM, so the error still happens and on the right line */
+static bool foldBinary(Parser* parser, TokenType operatorType) {
+  ConstantLoad* right = trailingConstant(parser, 0);
+  ConstantLoad* left = trailingConstant(parser, 1);
+  if (left == NULL || right == NULL) return false;
+
+  Value a = left->value;
+  Value b = right->value;
+  Value result;
+
+  if (operatorType == TOKEN_EQUAL_EQUAL) {
+    result = BOOL_VAL(valuesEqual(a, b));
+  } else if (operatorType == TOKEN_BANG_EQUAL) {
+    result = BOOL_VAL(!valuesEqual(a, b));
+  } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operatorType) {
+      // clang-format off
+    case TOKEN_GREATER: result = BOOL_VAL(x > y); break;
+    case TOKEN_GREATER_EQUAL: result = BOOL_VAL(!(x < y)); break;
+    case TOKEN_LESS: result = BOOL_VAL(x < y); break;
+    case TOKEN_LESS_EQUAL: result = BOOL_VAL(!(x > y)); break;
+    case TOKEN_PLUS: result = NUMBER_VAL(x + y); break;
+    case TOKEN_MINUS: result = NUMBER_VAL(x - y); break;
+    case TOKEN_STAR: result = NUMBER_VAL(x * y); break;
+    case TOKEN_SLASH: result = NUMBER_VAL(x / y); break;
+    default: return false;
+      // clang-format on
+    }
+  } else if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+    // Both operands are still held by the constant pool at this point
+    ObjString* x = AS_STRING(a);
+    ObjString* y = AS_STRING(b);
+    ObjString* string = newString(parser->vm, x->length + y->length);
+    memcpy(string->chars, x->chars, x->length);
+    memcpy(string->chars + x->length, y->chars, y->length);
+    result = OBJ_VAL(internString(parser->vm, string));
+  } else {
+    return false;
+  }
 
-static void binary(bool canAssign) {
-  TokenType operatorType = parser.previous.type;
+  dropConstants(parser, 2);
+  emitFolded(parser, result);
+  return true;
+}
+
+static void binary(Parser* parser, bool canAssign) {
+  TokenType operatorType = parser->previous.type;
   ParseRule* rule = getRule(operatorType);
   // Keep winding the recursion
-  parsePrecedence((Precedence)(rule->precedence + 1));
+  parsePrecedence(parser, (Precedence)(rule->precedence + 1));
+
+  if (foldBinary(parser, operatorType)) return;
 
   switch (operatorType) {
     // clang-format off
-  case TOKEN_BANG_EQUAL: emitBytes(OP_EQUAL, OP_NOT); break;
-  case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL); break;
-  case TOKEN_GREATER: emitByte(OP_GREATER); break;
-  case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-  case TOKEN_LESS: emitByte(OP_LESS); break;
-  case TOKEN_LESS_EQUAL: emitBytes(OP_GREATER, OP_NOT); break;
-  case TOKEN_BANG: emitByte(OP_NOT); break;
-  case TOKEN_PLUS: emitByte(OP_ADD); break;
-  case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
-  case TOKEN_STAR: emitByte(OP_MULTIPLY); break;
-  case TOKEN_SLASH: emitByte(OP_DIVIDE); break;
+  case TOKEN_BANG_EQUAL: emitBytes(parser, OP_EQUAL, OP_NOT); break;
+  case TOKEN_EQUAL_EQUAL: emitByte(parser, OP_EQUAL); break;
+  case TOKEN_GREATER: emitByte(parser, OP_GREATER); break;
+  case TOKEN_GREATER_EQUAL: emitBytes(parser, OP_LESS, OP_NOT); break;
+  case TOKEN_LESS: emitByte(parser, OP_LESS); break;
+  case TOKEN_LESS_EQUAL: emitBytes(parser, OP_GREATER, OP_NOT); break;
+  case TOKEN_BANG: emitByte(parser, OP_NOT); break;
+  case TOKEN_PLUS: emitByte(parser, OP_ADD); break;
+  case TOKEN_MINUS: emitByte(parser, OP_SUBTRACT); break;
+  case TOKEN_STAR: emitByte(parser, OP_MULTIPLY); break;
+  case TOKEN_SLASH: emitByte(parser, OP_DIVIDE); break;
   // clang-format on
   // Unreachable
   default:
-    errorAt(&parser.previous, "Token not yet processable.");
+    errorAt(parser, &parser->previous, "Token not yet processable.");
     break;
   }
 }
 
-static void call(bool canAssign) {
-  uint8_t argCount = argumentList();
-  emitBytes(OP_CALL, argCount);
+static void call(Parser* parser, bool canAssign) {
+  uint8_t argCount = argumentList(parser);
+  parser->compiler->lastCall = currentChunk(parser)->count;
+  if (argCount <= 3) {
+    emitByte(parser, OP_CALL_0 + argCount);
+  } else {
+    emitBytes(parser, OP_CALL, argCount);
+  }
 }
 
-/* This function just emits bytes as is */
-static void literal(bool canAssign) {
-  switch (parser.previous.type) {
+/* Emits the literal, remembered as a constant load for folding */
+static void literal(Parser* parser, bool canAssign) {
+  switch (parser->previous.type) {
     // clang-format off
-  case TOKEN_FALSE: emitByte(OP_FALSE); break;
-  case TOKEN_NIL: emitByte(OP_NIL); break;
-  case TOKEN_TRUE: emitByte(OP_TRUE); break;
+  case TOKEN_FALSE: emitFolded(parser, BOOL_VAL(false)); break;
+  case TOKEN_NIL: emitFolded(parser, NIL_VAL); break;
+  case TOKEN_TRUE: emitFolded(parser, BOOL_VAL(true)); break;
   default: return;
   // clang-format off
   }
 }
 
 /* Calls `expression()` and consumes the closing ')' paren */
-static void grouping(bool canAssign) {
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void grouping(Parser* parser, bool canAssign) {
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
 /* Emits a constant of the string as float and continues */
-static void number(bool canAssign) {
+static void number(Parser* parser, bool canAssign) {
   // String to double (parseFloat)
-  double value = strtod(parser.previous.start, NULL);
-  emitConstant(NUMBER_VAL(value));
+  double value = strtod(parser->previous.start, NULL);
+  emitConstant(parser, NUMBER_VAL(value));
 }
 
-static void or_(bool canAssign) {
-  int elseJump = emitJump(OP_JUMP_IF_FALSE);
-  int endJump = emitJump(OP_JUMP);
+static void or_(Parser* parser, bool canAssign) {
+  int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  int endJump = emitJump(parser, OP_JUMP);
 
-  patchJump(elseJump);
-  emitByte(OP_POP);
+  patchJump(parser, elseJump);
+  emitByte(parser, OP_POP);
 
-  parsePrecedence(PREC_OR);
-  patchJump(endJump);
+  parsePrecedence(parser, PREC_OR);
+  patchJump(parser, endJump);
 }
 
 /* Emits the string as constant */
-static void string(bool canAssign) {
+static void string(Parser* parser, bool canAssign) {
   // Takes the strings characters directly from the source code/lexeme, the + 1 and -2 trims the quotes
-  emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+  emitConstant(parser, OBJ_VAL(copyString(parser->vm, parser->previous.start + 1, parser->previous.length - 2)));
 }
 
-/* Creates a new copy the string from the source, wraps it in a value, loads it into the chunks constants and passes back the index */
-static uint16_t identifierConstant(Token* name) {
-  // Copy the identifier string from the token
-  ObjString* identifier = copyString(name->start, name->length);
-  // Wrap it as a value
-  Value value = OBJ_VAL(identifier);
-  // Add it to the constant table and get its index
-  uint16_t constant = makeConstant(value);
-  return constant;
+/* Interns the identifier and resolves it to its slot in the VM's global
+ * array, new names get a fresh slot that stays undefined until the runtime
+ * executes their OP_DEFINE_GLOBAL */
+static uint16_t identifierGlobal(Parser* parser, Token* name) {
+  ObjString* identifier = copyString(parser->vm, name->start, name->length);
+  int slot = resolveGlobal(parser->vm, identifier);
+  if (slot == -1) {
+    error(parser, "Too many global variables.");
+    // Unlike the other errors this one always stops the script, every name
+    // past the limit would otherwise share slot 0
+    parser->hadError = true;
+    return 0;
+  }
+  return (uint16_t)slot;
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -379,12 +711,12 @@ static bool identifiersEqual(Token* a, Token* b) {
 }
 
 /* Walks backwards in the compilers local list and checks for one with the same name and returns its index */
-static int resolveLocal(Compiler* compiler, Token* name) {
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
   for(int i = compiler->localCount -1; i >= 0; i--) {
     Local* local = &compiler->locals[i];
     if(identifiersEqual(name, &local->name)) {
       if(local->depth == -1) {
-        error("Can't read local variable in its own initializer");
+        error(parser, "Can't read local variable in its own initializer");
       }
       return i;
     }
@@ -394,7 +726,8 @@ static int resolveLocal(Compiler* compiler, Token* name) {
 }
 
 /* Returns the index of the upvalue in the functions list of upvalues */
-static int addUpValue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpValue(Parser* parser, Compiler* compiler, uint8_t index,
+                      bool isLocal) {
   int upvalueCount = compiler->function->upvalueCount;
 
   for(int i = 0; i < upvalueCount; i++) {
@@ -405,7 +738,7 @@ static int addUpValue(Compiler* compiler, uint8_t index, bool isLocal) {
   }
 
   if(upvalueCount == UINT8_COUNT) {
-    error("Too many closure variables in function.");
+    error(parser, "Too many closure variables in function.");
     return 0;
   }
 
@@ -415,31 +748,32 @@ static int addUpValue(Compiler* compiler, uint8_t index, bool isLocal) {
 }
 
 /* Try to find the value anywhere in the locals, if not found return -1 */
-static int resolveUpvalue(Compiler* compiler, Token* name) {
+static int resolveUpvalue(Parser* parser, Compiler* compiler, Token* name) {
   if(compiler->enclosing == NULL) return -1;
 
-  int local = resolveLocal(compiler->enclosing, name);
+  int local = resolveLocal(parser, compiler->enclosing, name);
   if(local != -1) {
     compiler->enclosing->locals[local].isCaptured = true;
-    return addUpValue(compiler, (uint8_t)local, true);
+    compiler->enclosing->function->hasCaptures = true;
+    return addUpValue(parser, compiler, (uint8_t)local, true);
   }
 
   // Recursively traverse up the scope tree to see if any of the wrapping compilers have the value
-  int upvalue = resolveUpvalue(compiler->enclosing, name);
+  int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
   if(upvalue != -1) {
-    return addUpValue(compiler, (uint8_t)upvalue, false);
+    return addUpValue(parser, compiler, (uint8_t)upvalue, false);
   }
   
   return -1;
 }
 
-static void addLocal(Token name) {
-  if(current->localCount == UINT8_COUNT) {
-    error("Too many local variables in function.");
+static void addLocal(Parser* parser, Token name) {
+  if(parser->compiler->localCount == UINT8_COUNT) {
+    error(parser, "Too many local variables in function.");
     return;
   }
 
-  Local* local = &current->locals[current->localCount++];
+  Local* local = &parser->compiler->locals[parser->compiler->localCount++];
   local->name = name;
   // local->depth = current->scopeDepth;
   local->depth = -1;
@@ -450,18 +784,18 @@ static void addLocal(Token name) {
   Checks for duplicate variable names in the current scope and adds a new local variable.
   Only runs for local (non-global) variables.
 */
-static void declareVariable() {
+static void declareVariable(Parser* parser) {
   // If we're in the global scope, no need to declare a local variable.
   // if (current->scopeDepth == 0) return;
 
   // The name of the variable being declared.
-  Token* name = &parser.previous;
-  int localCount = current->localCount;
-  int scopeDepth = current->scopeDepth;
+  Token* name = &parser->previous;
+  int localCount = parser->compiler->localCount;
+  int scopeDepth = parser->compiler->scopeDepth;
 
   // Walk backwards through the list of locals to check for duplicates in the same scope.
   for (int i = localCount - 1; i >= 0; i--) {
-    Local* local = &current->locals[i];
+    Local* local = &parser->compiler->locals[i];
     int localDepth = local->depth;
 
     // Stop if we've reached a variable from an outer scope.
@@ -471,52 +805,62 @@ static void declareVariable() {
 
     // If a variable with the same name exists in this scope, throw an error.
     if (identifiersEqual(name, &local->name)) {
-      error("Already a variable with same name in this scope.");
+      error(parser, "Already a variable with same name in this scope.");
     }
   }
 
   // Add the new local variable to the list.
-  addLocal(*name);
+  addLocal(parser, *name);
 }
 
-static void namedVariable(Token name, bool canAssign) {
+static void namedVariable(Parser* parser, Token name, bool canAssign) {
   uint8_t getOp, setOp;
-  int arg = resolveLocal(current, &name);
+  // Locals and upvalues always fit in a byte, only globals need these
+  uint8_t longGetOp = OP_GET_GLOBAL_LONG, longSetOp = OP_SET_GLOBAL_LONG;
+  int arg = resolveLocal(parser, parser->compiler, &name);
   
   if(arg != -1) {
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
-  } else if((arg = resolveUpvalue(current, &name)) != -1) {
+  } else if((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1) {
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
-    arg = identifierConstant(&name);
+    arg = identifierGlobal(parser, &name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
 
-  if(canAssign && match(TOKEN_EQUAL)) {
-    expression();
-    emitBytes(setOp, (uint8_t)arg);
+  if(canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emitIndexed(parser, setOp, longSetOp, (uint16_t)arg);
   } else {
-    emitBytes(getOp, (uint8_t)arg);
+    emitIndexed(parser, getOp, longGetOp, (uint16_t)arg);
   }
 }
 
-static void variable(bool canAssign) {
-  namedVariable(parser.previous, canAssign);
+static void variable(Parser* parser, bool canAssign) {
+  namedVariable(parser, parser->previous, canAssign);
 }
 
-static void unary(bool canAssign) {
-  TokenType operatorType = parser.previous.type;
+static void unary(Parser* parser, bool canAssign) {
+  TokenType operatorType = parser->previous.type;
 
   // Compile the operand
-  parsePrecedence(PREC_UNARY);
+  parsePrecedence(parser, PREC_UNARY);
 
   switch (operatorType) {
-  case TOKEN_MINUS:
-    emitByte(OP_NEGATE);
+  case TOKEN_MINUS: {
+    ConstantLoad* operand = trailingConstant(parser, 0);
+    if (operand != NULL && IS_NUMBER(operand->value)) {
+      double value = AS_NUMBER(operand->value);
+      dropConstants(parser, 1);
+      emitFolded(parser, NUMBER_VAL(-value));
+      break;
+    }
+    emitByte(parser, OP_NEGATE);
     break;
+  }
   default:
     return; // Unreachable
   }
@@ -568,10 +912,10 @@ ParseRule rules[] = {
 };
 // clang-format on
 
-static void parsePrecedence(Precedence precedence) {
-  advance();
+static void parsePrecedence(Parser* parser, Precedence precedence) {
+  advance(parser);
 
-  ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+  ParseFn prefixRule = getRule(parser->previous.type)->prefix;
 
   /*
   Each expr needs to start withe either a TOKEN_NUMBER, a TOKEN_MINUS, or a
@@ -579,90 +923,95 @@ static void parsePrecedence(Precedence precedence) {
   Expressions cannot start with *, + or &&
   */
   if (prefixRule == NULL) {
-    error("Expect expression.");
+    error(parser, "Expect expression.");
     return;
   }
 
   bool canAssign = precedence <= PREC_ASSIGNMENT;
-  prefixRule(canAssign);
+  prefixRule(parser, canAssign);
 
   // * If the precedence of the previous frame is higher then the prec of
   // * the current frame - we start unwinding the recursion,
   // * otherwise - keep opening stack frames
-  while (precedence <= getRule(parser.current.type)->precedence) {
+  while (precedence <= getRule(parser->current.type)->precedence) {
     // Move to the next token (the operator)
-    advance();
+    advance(parser);
     // Get the infix rule for the operator we just advanced past
-    ParseFn infixRule = getRule(parser.previous.type)->infix;
+    ParseFn infixRule = getRule(parser->previous.type)->infix;
     // Call the infix rule to parse the right-hand side of the operator
-    infixRule(canAssign);
+    infixRule(parser, canAssign);
   }
 
-  if (canAssign && match(TOKEN_EQUAL)) { error("Invalid assignment target."); }
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    error(parser, "Invalid assignment target.");
+  }
 }
 
 /* Parse out the variable identifier
-  *`GLOBAL` - add the variable identifier to the constants table and get its
-  * index
+  *`GLOBAL` - resolve the variable identifier to its slot in the VM's global
+  * array
   *`LOCAL`  - declare the variable inside the locals, the index handle will be
   grabbed from the locals stack mirror
   * when lookup is required
 
   @returns
-  *`GLOBAL` - the index of the variable inside the constants
+  *`GLOBAL` - the slot of the variable inside vm->globalValues
   *`LOCAL`  - 0
 */
-static uint16_t parseVariable(const char* errorMessage) {
-  consume(TOKEN_IDENTIFIER, errorMessage);
+static uint16_t parseVariable(Parser* parser, const char* errorMessage) {
+  consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-  bool isGlobal = current->scopeDepth == 0;
-  if (isGlobal) return identifierConstant(&parser.previous);
+  bool isGlobal = parser->compiler->scopeDepth == 0;
+  if (isGlobal) return identifierGlobal(parser, &parser->previous);
 
-  declareVariable();
+  declareVariable(parser);
   return 0;
 }
 
 /* Flips the depth of the variable from -1 to the current scope */
-static void markInitialized() {
-  if (current->scopeDepth == 0) return;
-  current->locals[current->localCount - 1].depth = current->scopeDepth;
+static void markInitialized(Parser* parser) {
+  if (parser->compiler->scopeDepth == 0) return;
+  Compiler* compiler = parser->compiler;
+  compiler->locals[compiler->localCount - 1].depth = compiler->scopeDepth;
 }
 
 /*
 `local` - flip the depth from -1 to the current depth
-`global` - emit as bytecode and add to the chunks constants
+`global` - emit OP_DEFINE_GLOBAL with the slot of the variable
  */
-static void defineVariable(uint8_t global) {
-  if (current->scopeDepth > 0) {
-    markInitialized();
+static void defineVariable(Parser* parser, uint16_t global) {
+  if (parser->compiler->scopeDepth > 0) {
+    markInitialized(parser);
     return;
   }
 
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitIndexed(parser, OP_DEFINE_GLOBAL, OP_DEFINE_GLOBAL_LONG, global);
 }
 
-static uint8_t argumentList() {
+static uint8_t argumentList(Parser* parser) {
   uint8_t argCount = 0;
 
-  if (!check(TOKEN_RIGHT_PAREN)) {
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
     do {
-      expression();
-      if (argCount == 255) { error("Can't have more than 255 arguments."); }
+      expression(parser);
+      if (argCount == 255) {
+        error(parser, "Can't have more than 255 arguments.");
+      }
       argCount++;
-    } while (match(TOKEN_COMMA));
+    } while (match(parser, TOKEN_COMMA));
   }
 
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
   return argCount;
 }
 
-static void and_(bool canAssign) {
-  int endJump = emitJump(OP_JUMP_IF_FALSE);
+static void and_(Parser* parser, bool canAssign) {
+  int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
 
-  emitByte(OP_POP);
-  parsePrecedence(PREC_AND);
+  emitByte(parser, OP_POP);
+  parsePrecedence(parser, PREC_AND);
 
-  patchJump(endJump);
+  patchJump(parser, endJump);
 }
 
 static ParseRule* getRule(TokenType type) { return &rules[type]; }
@@ -675,9 +1024,9 @@ The indexes in the array correspond to the TokenType enum values, and the
 function at each index is the code to compile an expression of that token type.
 */
 
-static void expression() {
+static void expression(Parser* parser) {
   // Each expr call starts at the lowest level of prec
-  parsePrecedence(PREC_ASSIGNMENT);
+  parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
 // ============================================================================
@@ -685,191 +1034,281 @@ static void expression() {
 // ============================================================================
 static void STATEMENT_PARSING() {}
 
-static void declaration();
-static void statement();
-
-static void block() {
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    declaration();
+static void declaration(Parser* parser);
+static void statement(Parser* parser);
+
+static void block(Parser* parser) {
+  // Whatever follows a return at this level can never run, it is still
+  // compiled for the errors and then thrown away
+  int deadStart = -1;
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    bool isReturn = check(parser, TOKEN_RETURN);
+    declaration(parser);
+    if (isReturn && deadStart == -1) deadStart = currentChunk(parser)->count;
   }
+  if (deadStart != -1) discardCode(parser, deadStart);
 
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
+static void function(Parser* parser, FunctionType type) {
   Compiler compiler;
-  initCompiler(&compiler, type);
-  beginScope();
+  initCompiler(parser, &compiler, type);
+  beginScope(parser);
 
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
 
-  if (!check(TOKEN_RIGHT_PAREN)) {
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
     do {
-      current->function->arity++;
-      if (current->function->arity > 255) {
-        errorAtCurrent("Can't have more than 255 parameters.");
+      parser->compiler->function->arity++;
+      if (parser->compiler->function->arity > 255) {
+        errorAtCurrent(parser, "Can't have more than 255 parameters.");
       }
-      uint8_t constant = parseVariable("Expect parameter name.");
-      defineVariable(constant);
-    } while (match(TOKEN_COMMA));
+      uint16_t constant = parseVariable(parser, "Expect parameter name.");
+      defineVariable(parser, constant);
+    } while (match(parser, TOKEN_COMMA));
   }
 
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
-  consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-  block();
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  block(parser);
 
-  ObjFunction* function = endCompiler();
-  emitBytes(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+  ObjFunction* function = endCompiler(parser);
+  emitIndexed(parser, OP_CLOSURE, OP_CLOSURE_LONG,
+              makeConstant(parser, OBJ_VAL(function)));
 
   for (int i = 0; i < function->upvalueCount; i++) {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
+    emitByte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
+    emitByte(parser, compiler.upvalues[i].index);
   }
 }
 
-static void funDeclaration() {
-  uint8_t global = parseVariable("Expect function name");
-  markInitialized();
-  function(TYPE_FUNCTION);
-  defineVariable(global);
+static void funDeclaration(Parser* parser) {
+  uint16_t global = parseVariable(parser, "Expect function name");
+  markInitialized(parser);
+  function(parser, TYPE_FUNCTION);
+  defineVariable(parser, global);
 }
 
 /* Parse out the variable identifier, parse out the expression and finally
- * define the value. `GLOBAL` - emits an OP_DEFINE_GLOBAL and the index of the
- * Chunk constants `LOCAL`  - flips the depth from -1 to the current to mark as
+ * define the value. `GLOBAL` - emits an OP_DEFINE_GLOBAL and the slot of the
+ * global `LOCAL`  - flips the depth from -1 to the current to mark as
  * initialized
  */
-static void varDeclaration() {
-  uint16_t global = parseVariable("Expect variable name.");
+static void varDeclaration(Parser* parser) {
+  uint16_t global = parseVariable(parser, "Expect variable name.");
 
-  if (match(TOKEN_EQUAL)) {
-    expression();
+  if (match(parser, TOKEN_EQUAL)) {
+    expression(parser);
   } else {
-    emitByte(OP_NIL);
+    emitByte(parser, OP_NIL);
   }
 
-  consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration");
-  defineVariable(global);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration");
+  defineVariable(parser, global);
 }
 
-static void expressionStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
+static void expressionStatement(Parser* parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+  // The value of an expression statement is discarded
+  emitByte(parser, OP_POP);
 }
 
-static void ifStatement() {
+/* If the condition just compiled folded down to a constant, removes it and
+ * returns its truthiness (1 or 0), otherwise -1 */
+static int constantCondition(Parser* parser) {
+  ConstantLoad* load = trailingConstant(parser, 0);
+  if (load == NULL) return -1;
+
+  Value value = load->value;
+  dropConstants(parser, 1);
+  return !(IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value)));
+}
+
+static void ifStatement(Parser* parser) {
   // Consume the parens and expression inside - if(expr)
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+  // Only one branch can ever run, so no jumps. The other branch is compiled
+  // and then thrown away
+  int condition = constantCondition(parser);
+  if (condition != -1) {
+    int start = currentChunk(parser)->count;
+    statement(parser);
+    if (!condition) discardCode(parser, start);
+
+    if (match(parser, TOKEN_ELSE)) {
+      start = currentChunk(parser)->count;
+      statement(parser);
+      if (condition) discardCode(parser, start);
+    }
+    return;
+  }
 
   // Save the location of the bytecode
 
   // thenJump is conditional - it will check the value on top of stack and jump
   // if false
-  int thenJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
-  statement();
+  int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
+  statement(parser);
 
   // elseJump is unconditional - the program will always jump to this
-  int elseJump = emitJump(OP_JUMP);
+  int elseJump = emitJump(parser, OP_JUMP);
 
-  patchJump(thenJump);
-  emitByte(OP_POP);
+  patchJump(parser, thenJump);
+  emitByte(parser, OP_POP);
 
-  if (match(TOKEN_ELSE)) statement();
+  if (match(parser, TOKEN_ELSE)) statement(parser);
 
-  patchJump(elseJump);
+  patchJump(parser, elseJump);
 }
 
-static void whileStatement() {
-  int loopStart = currentChunk()->count;
+static void whileStatement(Parser* parser) {
+  int loopStart = currentChunk(parser)->count;
+  markJumpTarget(parser);
 
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-  int exitJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
-  statement();
-  emitLoop(loopStart);
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-  patchJump(exitJump);
-  emitByte(OP_POP);
+  int condition = constantCondition(parser);
+  if (condition == 0) {
+    statement(parser);
+    discardCode(parser, loopStart);
+    return;
+  }
+  if (condition == 1) {
+    // Loops until something in the body returns
+    statement(parser);
+    emitLoop(parser, loopStart);
+    return;
+  }
+
+  int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  emitByte(parser, OP_POP);
+  statement(parser);
+  emitLoop(parser, loopStart);
+
+  patchJump(parser, exitJump);
+  emitByte(parser, OP_POP);
 }
 
-static void printStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after statement value.");
-  emitByte(OP_PRINT);
+static void printStatement(Parser* parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after statement value.");
+  emitByte(parser, OP_PRINT);
 }
 
-static void returnStatement() {
-  if (current->type == TYPE_SCRIPT) {
-    error("Can't return from top-level code.");
+/* Turns the call that ends the chunk, if the return value comes from one,
+ * into an OP_TAIL_CALL. A jump landing on the call lands on the tail call
+ * instead. OP_TAIL_CALL is two bytes, so after OP_CALL it ends where the call
+ * did and a jump landing past it still finds the OP_RETURN. OP_CALL_0..3 are
+ * a byte shorter, a jump past one of those would land on the operand, so
+ * those stay plain calls when anything jumps to the end of the chunk */
+static void emitTailCall(Parser* parser) {
+  Chunk* chunk = currentChunk(parser);
+  int call = parser->compiler->lastCall;
+  if (call == -1) return;
+
+  uint8_t instruction = chunk->code[call];
+  int argCount;
+  if (instruction == OP_CALL && call + 2 == chunk->count) {
+    argCount = chunk->code[call + 1];
+  } else if (instruction >= OP_CALL_0 && instruction <= OP_CALL_3 &&
+             call + 1 == chunk->count && parser->compiler->barrier <= call) {
+    argCount = instruction - OP_CALL_0;
+  } else {
+    return;
+  }
+
+  truncateChunk(chunk, call);
+  emitBytes(parser, OP_TAIL_CALL, (uint8_t)argCount);
+}
+
+static void returnStatement(Parser* parser) {
+  if (parser->compiler->type == TYPE_SCRIPT) {
+    error(parser, "Can't return from top-level code.");
   }
 
-  if (match(TOKEN_SEMICOLON)) {
-    emitReturn();
+  if (match(parser, TOKEN_SEMICOLON)) {
+    emitReturn(parser);
   } else {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-    emitByte(OP_RETURN);
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+    emitTailCall(parser);
+    emitByte(parser, OP_RETURN);
   }
 }
 
-static void forStatement() {
-  beginScope();
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
-  if (match(TOKEN_SEMICOLON)) {
+static void forStatement(Parser* parser) {
+  beginScope(parser);
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  if (match(parser, TOKEN_SEMICOLON)) {
     // No initializer.
-  } else if (match(TOKEN_VAR)) {
-    varDeclaration();
+  } else if (match(parser, TOKEN_VAR)) {
+    varDeclaration(parser);
   } else {
-    expressionStatement();
+    expressionStatement(parser);
   }
 
-  int loopStart = currentChunk()->count;
+  int loopStart = currentChunk(parser)->count;
+  markJumpTarget(parser);
   int exitJump = -1;
-  if (!match(TOKEN_SEMICOLON)) {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
-
-    // Jump out of the loop if the condition is false.
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP); // Condition.
+  // A constant false condition means nothing past the initializer runs
+  bool isDead = false;
+  if (!match(parser, TOKEN_SEMICOLON)) {
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+
+    // A constant true condition is the same as leaving it out
+    int condition = constantCondition(parser);
+    if (condition == 0) {
+      isDead = true;
+    } else if (condition == -1) {
+      // Jump out of the loop if the condition is false.
+      exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+      emitByte(parser, OP_POP); // Condition.
+    }
   }
+  int deadStart = loopStart;
 
-  if (!match(TOKEN_RIGHT_PAREN)) {
-    int bodyJump = emitJump(OP_JUMP);
-    int incrementStart = currentChunk()->count;
-    expression();
-    emitByte(OP_POP);
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+  if (!match(parser, TOKEN_RIGHT_PAREN)) {
+    int bodyJump = emitJump(parser, OP_JUMP);
+    int incrementStart = currentChunk(parser)->count;
+    markJumpTarget(parser);
+    expression(parser);
+    emitByte(parser, OP_POP);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-    emitLoop(loopStart);
+    emitLoop(parser, loopStart);
     loopStart = incrementStart;
-    patchJump(bodyJump);
+    patchJump(parser, bodyJump);
   }
 
-  statement();
-  emitLoop(loopStart);
+  statement(parser);
+  emitLoop(parser, loopStart);
 
   if (exitJump != -1) {
-    patchJump(exitJump);
-    emitByte(OP_POP); // Condition.
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP); // Condition.
   }
-  endScope();
+  if (isDead) discardCode(parser, deadStart);
+  endScope(parser);
 }
 
 /* Keep advancing until we hit a new statement or until the current statement
  * completes (ie - semicolon) */
-static void synchronize() {
-  parser.panicMode = false;
+static void synchronize(Parser* parser) {
+  parser->panicMode = false;
 
-  while (parser.current.type != TOKEN_EOF) {
-    if (parser.previous.type == TOKEN_SEMICOLON) return;
+  while (parser->current.type != TOKEN_EOF) {
+    if (parser->previous.type == TOKEN_SEMICOLON) return;
 
-    switch (parser.current.type) {
+    switch (parser->current.type) {
     case TOKEN_CLASS:
     case TOKEN_FUN:
     case TOKEN_VAR:
@@ -882,40 +1321,40 @@ static void synchronize() {
     default:;
     }
 
-    advance();
+    advance(parser);
   }
 }
 
 /* Statements leave the stack where it was after completion */
 
-static void declaration() {
-  if (match(TOKEN_FUN)) {
-    funDeclaration();
-  } else if (match(TOKEN_VAR)) {
-    varDeclaration();
+static void declaration(Parser* parser) {
+  if (match(parser, TOKEN_FUN)) {
+    funDeclaration(parser);
+  } else if (match(parser, TOKEN_VAR)) {
+    varDeclaration(parser);
   } else {
-    statement();
+    statement(parser);
   }
-  if (parser.panicMode) synchronize();
+  if (parser->panicMode) synchronize(parser);
 };
 
-static void statement() {
-  if (match(TOKEN_PRINT)) {
-    printStatement();
-  } else if (match(TOKEN_FOR)) {
-    forStatement();
-  } else if (match(TOKEN_IF)) {
-    ifStatement();
-  } else if (match(TOKEN_RETURN)) {
-    returnStatement();
-  } else if (match(TOKEN_WHILE)) {
-    whileStatement();
-  } else if (match(TOKEN_LEFT_BRACE)) {
-    beginScope();
-    block();
-    endScope();
+static void statement(Parser* parser) {
+  if (match(parser, TOKEN_PRINT)) {
+    printStatement(parser);
+  } else if (match(parser, TOKEN_FOR)) {
+    forStatement(parser);
+  } else if (match(parser, TOKEN_IF)) {
+    ifStatement(parser);
+  } else if (match(parser, TOKEN_RETURN)) {
+    returnStatement(parser);
+  } else if (match(parser, TOKEN_WHILE)) {
+    whileStatement(parser);
+  } else if (match(parser, TOKEN_LEFT_BRACE)) {
+    beginScope(parser);
+    block(parser);
+    endScope(parser);
   } else {
-    expressionStatement();
+    expressionStatement(parser);
   }
 }
 
@@ -924,23 +1363,42 @@ static void statement() {
 // ============================================================================
 static void COMPILER_MAIN() {}
 
-ObjFunction* compile(const char* source) {
-  initScanner(source);
-  Compiler compiler;
-  initCompiler(&compiler, TYPE_SCRIPT);
-  // compilingChunk = chunk;
-
+ObjFunction* compile(VM* vm, const char* source) {
+  Parser parser;
+  parser.vm = vm;
+  parser.compiler = NULL;
   parser.hadError = false;
   parser.panicMode = false;
+  parser.reportedError = false;
+  initScanner(&parser.scanner, source);
+  // The functions being compiled are GC roots until the compile is done
+  vm->parser = &parser;
+
+  Compiler compiler;
+  initCompiler(&parser, &compiler, TYPE_SCRIPT);
+  // compilingChunk = chunk;
 
   // The call to advance() “primes the pump” on the scanner.
-  advance();
-  while (!match(TOKEN_EOF)) {
-    declaration();
+  advance(&parser);
+  while (!match(&parser, TOKEN_EOF)) {
+    declaration(&parser);
   }
   // expression();
   // consume(TOKEN_EOF, "Expect end of expression");
 
-  ObjFunction* function = endCompiler();
+  ObjFunction* function = endCompiler(&parser);
+  vm->parser = NULL;
+  vm->compileReportedErrors = parser.reportedError;
   return parser.hadError ? NULL : function;
-}
\ No newline at end of file
+}
+
+bool compileReportedErrors(VM* vm) { return vm->compileReportedErrors; }
+
+void markCompilerRoots(VM* vm) {
+  if (vm->parser == NULL) return;
+  Compiler* compiler = vm->parser->compiler;
+  while (compiler != NULL) {
+    markObject(vm, (Obj*)compiler->function);
+    compiler = compiler->enclosing;
+  }
+}
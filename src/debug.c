@@ -4,6 +4,7 @@
 #include "chunk.h"
 #include "object.h"
 #include "value.h"
+#include "vm.h"
 
 static void printStackColumn(Value* stack, Value* stackTop) {
   printf(" [");
@@ -34,6 +35,8 @@ static void printValueColumn(Value value) {
       snprintf(buffer, sizeof(buffer), "\"%.*s\"", 
                      (int)(sizeof(buffer) - 3 < str->length ? sizeof(buffer) - 3 : str->length), 
                      str->chars);
+    } else if (IS_ROPE(value)) {
+      snprintf(buffer, sizeof(buffer), "<rope %d>", AS_ROPE(value)->length);
     } else if (IS_FUNCTION(value)) {
       ObjFunction* fn = AS_FUNCTION(value);
       if (fn->name == NULL) {
@@ -51,13 +54,13 @@ static void printValueColumn(Value value) {
   printf("%-14s", buffer);
 }
 
-void disassembleChunk(Chunk* chunk, const char* name) {
+void disassembleChunk(VM* vm, Chunk* chunk, const char* name) {
   printf("CHUNK == %s ==\n", name);
   printf("SIZE | OFFSET | LINE | INSTRUCTION        | OPERAND | VALUE\n");
   printf("-----|-------|------|--------------------|---------|-----------\n");
 
   for (int offset = 0; offset < chunk->count;) {
-    offset = disassembleInstruction(chunk, offset, NULL, NULL);
+    offset = disassembleInstruction(vm, chunk, offset, NULL, NULL);
   }
 }
 
@@ -112,6 +115,43 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset,
   return offset + 3;
 }
 
+// [op][slot][constant]
+static int localConstantInstruction(const char* name, Chunk* chunk, int offset, Value* stack, Value* stackTop) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t constant = chunk->code[offset + 2];
+  printf("%-18s | %7d | ", name, slot);
+  printValueColumn(chunk->constants.values[constant]);
+  printf(" |");
+  if (stack != NULL) {
+    printStackColumn(stack, stackTop);
+  }
+  printf("\n");
+  return offset + 3;
+}
+
+// [op][slot][slot | constant][offset16]
+static int compareJumpInstruction(const char* name, bool constantOperand, Chunk* chunk, int offset, Value* stack, Value* stackTop) {
+  uint8_t slot = chunk->code[offset + 1];
+  uint8_t operand = chunk->code[offset + 2];
+  uint16_t jump = (uint16_t)(chunk->code[offset + 3] << 8);
+  jump |= chunk->code[offset + 4];
+
+  char buffer[32];
+  if (constantOperand) {
+    Value constant = chunk->constants.values[operand];
+    snprintf(buffer, sizeof(buffer), "%.6g -> %04d",
+             IS_NUMBER(constant) ? AS_NUMBER(constant) : 0, offset + 5 + jump);
+  } else {
+    snprintf(buffer, sizeof(buffer), "%d -> %04d", operand, offset + 5 + jump);
+  }
+  printf("%-18s | %7d | %-14s |", name, slot, buffer);
+  if (stack != NULL) {
+    printStackColumn(stack, stackTop);
+  }
+  printf("\n");
+  return offset + 5;
+}
+
 static int constantInstruction(const char* name, Chunk* chunk, int offset, Value* stack, Value* stackTop) {
   uint8_t constant = chunk->code[offset + 1];
   printf("%-18s | %7d | ", name, constant);
@@ -133,6 +173,45 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset, Value
   return offset + 2;
 }
 
+static int globalInstruction(VM* vm, const char* name, Chunk* chunk, int offset, Value* stack, Value* stackTop) {
+  uint8_t slot = chunk->code[offset + 1];
+  printf("%-18s | %7d | ", name, slot);
+
+  ObjString* global = globalName(vm, slot);
+  if (global == NULL) {
+    printf("INVALID GLOBAL |");
+  } else {
+    printValueColumn(OBJ_VAL(global));
+    printf(" |");
+  }
+
+  if (stack != NULL) {
+    printStackColumn(stack, stackTop);
+  }
+  printf("\n");
+  return offset + 2;
+}
+
+static int globalLongInstruction(VM* vm, const char* name, Chunk* chunk, int offset, Value* stack, Value* stackTop) {
+  uint16_t slot = (uint16_t)(chunk->code[offset + 1] << 8);
+  slot |= chunk->code[offset + 2];
+  printf("%-18s | %7u | ", name, slot);
+
+  ObjString* global = globalName(vm, slot);
+  if (global == NULL) {
+    printf("INVALID GLOBAL |");
+  } else {
+    printValueColumn(OBJ_VAL(global));
+    printf(" |");
+  }
+
+  if (stack != NULL) {
+    printStackColumn(stack, stackTop);
+  }
+  printf("\n");
+  return offset + 3;
+}
+
 static int constantLongInstruction(const char* name, Chunk* chunk, int offset, Value* stack, Value* stackTop) {
   uint16_t constant = (uint16_t)(chunk->code[offset + 1] << 8);
   constant |= chunk->code[offset + 2];
@@ -153,9 +232,10 @@ static int constantLongInstruction(const char* name, Chunk* chunk, int offset, V
   return offset + 3;
 }
 
-static int closureInstruction(const char* name, Chunk* chunk, int offset, Value* stack, Value* stackTop) {
+static int closureInstruction(const char* name, bool wide, Chunk* chunk, int offset, Value* stack, Value* stackTop) {
   offset++;
-  uint8_t constant = chunk->code[offset++];
+  uint16_t constant = chunk->code[offset++];
+  if (wide) constant = (uint16_t)((constant << 8) | chunk->code[offset++]);
   printf("%-18s | %7d | ", name, constant);
   
   // Defensive check: ensure constant index is valid
@@ -197,7 +277,7 @@ static int closureInstruction(const char* name, Chunk* chunk, int offset, Value*
   
   Pass NULL for stack and stackTop to omit stack visualization.
 */
-int disassembleInstruction(Chunk* chunk, int offset, Value* stack, Value* stackTop) {
+int disassembleInstruction(VM* vm, Chunk* chunk, int offset, Value* stack, Value* stackTop) {
   uint8_t instruction = chunk->code[offset];
   int size = 1; // default size for simple instructions
   switch (instruction) {
@@ -211,6 +291,7 @@ int disassembleInstruction(Chunk* chunk, int offset, Value* stack, Value* stackT
     case OP_GET_LOCAL:
     case OP_SET_LOCAL:
     case OP_CALL:
+    case OP_TAIL_CALL:
       size = 2;
       break;
     case OP_JUMP:
@@ -218,6 +299,24 @@ int disassembleInstruction(Chunk* chunk, int offset, Value* stack, Value* stackT
     case OP_LOOP:
       size = 3;
       break;
+    case OP_CONSTANT_LONG:
+    case OP_GET_GLOBAL_LONG:
+    case OP_DEFINE_GLOBAL_LONG:
+    case OP_SET_GLOBAL_LONG:
+    case OP_CLOSURE_LONG:
+      size = 3;
+      break;
+    case OP_SET_LOCAL_POP:
+      size = 2;
+      break;
+    case OP_ADD_LOCAL_CONST:
+    case OP_POP_JUMP_IF_FALSE:
+      size = 3;
+      break;
+    case OP_JUMP_IF_NOT_LESS_LOCALS:
+    case OP_JUMP_IF_NOT_LESS_LOCAL_CONST:
+      size = 5;
+      break;
     default:
       size = 1;
       break;
@@ -225,10 +324,11 @@ int disassembleInstruction(Chunk* chunk, int offset, Value* stack, Value* stackT
 
   // Print size and offset
   printf("%4d | %04d   | ", size, offset);
-  if (offset > 0 && chunk->lines[offset] == chunk->lines[offset - 1]) {
+  int line = getLine(chunk, offset);
+  if (offset > 0 && line == getLine(chunk, offset - 1)) {
     printf("   - | ");
   } else {
-    printf("%4d | ", chunk->lines[offset]);
+    printf("%4d | ", line);
   }
 
   switch (instruction) {
@@ -261,11 +361,11 @@ int disassembleInstruction(Chunk* chunk, int offset, Value* stack, Value* stackT
   case OP_SET_LOCAL:
     return byteInstruction("OP_SET_LOCAL", chunk, offset, stack, stackTop);
   case OP_DEFINE_GLOBAL:
-    return constantInstruction("OP_DEFINE_GLOBAL", chunk, offset, stack, stackTop);
+    return globalInstruction(vm, "OP_DEFINE_GLOBAL", chunk, offset, stack, stackTop);
   case OP_GET_GLOBAL:
-    return constantInstruction("OP_GET_GLOBAL", chunk, offset, stack, stackTop);
+    return globalInstruction(vm, "OP_GET_GLOBAL", chunk, offset, stack, stackTop);
   case OP_SET_GLOBAL:
-    return constantInstruction("OP_SET_GLOBAL", chunk, offset, stack, stackTop);
+    return globalInstruction(vm, "OP_SET_GLOBAL", chunk, offset, stack, stackTop);
   case OP_NOT:
     return simpleInstruction("OP_NOT", offset, stack, stackTop);
   case OP_TRUE:
@@ -282,14 +382,58 @@ int disassembleInstruction(Chunk* chunk, int offset, Value* stack, Value* stackT
     return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset, stack, stackTop);
   case OP_CALL:
     return byteInstruction("OP_CALL", chunk, offset, stack, stackTop);
+  case OP_CALL_0:
+    return simpleInstruction("OP_CALL_0", offset, stack, stackTop);
+  case OP_CALL_1:
+    return simpleInstruction("OP_CALL_1", offset, stack, stackTop);
+  case OP_CALL_2:
+    return simpleInstruction("OP_CALL_2", offset, stack, stackTop);
+  case OP_CALL_3:
+    return simpleInstruction("OP_CALL_3", offset, stack, stackTop);
+  case OP_TAIL_CALL:
+    return byteInstruction("OP_TAIL_CALL", chunk, offset, stack, stackTop);
+  case OP_ADD_NUM:
+    return simpleInstruction("OP_ADD_NUM", offset, stack, stackTop);
+  case OP_ADD_STR:
+    return simpleInstruction("OP_ADD_STR", offset, stack, stackTop);
+  case OP_SUBTRACT_NUM:
+    return simpleInstruction("OP_SUBTRACT_NUM", offset, stack, stackTop);
+  case OP_MULTIPLY_NUM:
+    return simpleInstruction("OP_MULTIPLY_NUM", offset, stack, stackTop);
+  case OP_DIVIDE_NUM:
+    return simpleInstruction("OP_DIVIDE_NUM", offset, stack, stackTop);
+  case OP_GREATER_NUM:
+    return simpleInstruction("OP_GREATER_NUM", offset, stack, stackTop);
+  case OP_LESS_NUM:
+    return simpleInstruction("OP_LESS_NUM", offset, stack, stackTop);
   case OP_LOOP:
     return jumpInstruction("OP_LOOP", -1, chunk, offset, stack, stackTop);    
   case OP_CLOSURE:
-    return closureInstruction("OP_CLOSURE", chunk, offset, stack, stackTop);
+    return closureInstruction("OP_CLOSURE", false, chunk, offset, stack, stackTop);
+  case OP_CONSTANT_LONG:
+    return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset, stack, stackTop);
+  case OP_GET_GLOBAL_LONG:
+    return globalLongInstruction(vm, "OP_GET_GLOBAL_LONG", chunk, offset, stack, stackTop);
+  case OP_DEFINE_GLOBAL_LONG:
+    return globalLongInstruction(vm, "OP_DEFINE_GLOBAL_LONG", chunk, offset, stack, stackTop);
+  case OP_SET_GLOBAL_LONG:
+    return globalLongInstruction(vm, "OP_SET_GLOBAL_LONG", chunk, offset, stack, stackTop);
+  case OP_CLOSURE_LONG:
+    return closureInstruction("OP_CLOSURE_LONG", true, chunk, offset, stack, stackTop);
   case OP_GET_UPVALUE:
     return byteInstruction("OP_GET_UPVALUE", chunk, offset, stack, stackTop);
   case OP_SET_UPVALUE:
     return byteInstruction("OP_SET_UPVALUE", chunk, offset, stack, stackTop);
+  case OP_ADD_LOCAL_CONST:
+    return localConstantInstruction("OP_ADD_LOCAL_CONST", chunk, offset, stack, stackTop);
+  case OP_SET_LOCAL_POP:
+    return byteInstruction("OP_SET_LOCAL_POP", chunk, offset, stack, stackTop);
+  case OP_POP_JUMP_IF_FALSE:
+    return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset, stack, stackTop);
+  case OP_JUMP_IF_NOT_LESS_LOCALS:
+    return compareJumpInstruction("OP_JUMP_IF_NOT_LESS_LOCALS", false, chunk, offset, stack, stackTop);
+  case OP_JUMP_IF_NOT_LESS_LOCAL_CONST:
+    return compareJumpInstruction("OP_JUMP_IF_NOT_LESS_LOCAL_CONST", true, chunk, offset, stack, stackTop);
 
   default:
     printf("%-18s | %7d | %-14s |", "Unknown opcode", (int)instruction, "");
@@ -301,6 +445,65 @@ int disassembleInstruction(Chunk* chunk, int offset, Value* stack, Value* stackT
   }
 }
 
-void disassembleInstructionWithStack(Chunk* chunk, int offset, Value* stack, Value* stackTop) {
-  disassembleInstruction(chunk, offset, stack, stackTop);
-}
\ No newline at end of file
+void disassembleInstructionWithStack(VM* vm, Chunk* chunk, int offset, Value* stack, Value* stackTop) {
+  disassembleInstruction(vm, chunk, offset, stack, stackTop);
+}
+
+const char* opcodeName(uint8_t instruction) {
+  // clang-format off
+  switch (instruction) {
+  case OP_CONSTANT: return "OP_CONSTANT";
+  case OP_NEGATE: return "OP_NEGATE";
+  case OP_ADD: return "OP_ADD";
+  case OP_SUBTRACT: return "OP_SUBTRACT";
+  case OP_MULTIPLY: return "OP_MULTIPLY";
+  case OP_DIVIDE: return "OP_DIVIDE";
+  case OP_RETURN: return "OP_RETURN";
+  case OP_CLOSE_UPVALUE: return "OP_CLOSE_UPVALUE";
+  case OP_PRINT: return "OP_PRINT";
+  case OP_NIL: return "OP_NIL";
+  case OP_FALSE: return "OP_FALSE";
+  case OP_POP: return "OP_POP";
+  case OP_GET_LOCAL: return "OP_GET_LOCAL";
+  case OP_SET_LOCAL: return "OP_SET_LOCAL";
+  case OP_DEFINE_GLOBAL: return "OP_DEFINE_GLOBAL";
+  case OP_GET_GLOBAL: return "OP_GET_GLOBAL";
+  case OP_SET_GLOBAL: return "OP_SET_GLOBAL";
+  case OP_NOT: return "OP_NOT";
+  case OP_TRUE: return "OP_TRUE";
+  case OP_EQUAL: return "OP_EQUAL";
+  case OP_GREATER: return "OP_GREATER";
+  case OP_LESS: return "OP_LESS";
+  case OP_JUMP: return "OP_JUMP";
+  case OP_JUMP_IF_FALSE: return "OP_JUMP_IF_FALSE";
+  case OP_CALL: return "OP_CALL";
+  case OP_CALL_0: return "OP_CALL_0";
+  case OP_CALL_1: return "OP_CALL_1";
+  case OP_CALL_2: return "OP_CALL_2";
+  case OP_CALL_3: return "OP_CALL_3";
+  case OP_TAIL_CALL: return "OP_TAIL_CALL";
+  case OP_ADD_NUM: return "OP_ADD_NUM";
+  case OP_ADD_STR: return "OP_ADD_STR";
+  case OP_SUBTRACT_NUM: return "OP_SUBTRACT_NUM";
+  case OP_MULTIPLY_NUM: return "OP_MULTIPLY_NUM";
+  case OP_DIVIDE_NUM: return "OP_DIVIDE_NUM";
+  case OP_GREATER_NUM: return "OP_GREATER_NUM";
+  case OP_LESS_NUM: return "OP_LESS_NUM";
+  case OP_LOOP: return "OP_LOOP";
+  case OP_CLOSURE: return "OP_CLOSURE";
+  case OP_CONSTANT_LONG: return "OP_CONSTANT_LONG";
+  case OP_GET_GLOBAL_LONG: return "OP_GET_GLOBAL_LONG";
+  case OP_DEFINE_GLOBAL_LONG: return "OP_DEFINE_GLOBAL_LONG";
+  case OP_SET_GLOBAL_LONG: return "OP_SET_GLOBAL_LONG";
+  case OP_CLOSURE_LONG: return "OP_CLOSURE_LONG";
+  case OP_GET_UPVALUE: return "OP_GET_UPVALUE";
+  case OP_SET_UPVALUE: return "OP_SET_UPVALUE";
+  case OP_ADD_LOCAL_CONST: return "OP_ADD_LOCAL_CONST";
+  case OP_SET_LOCAL_POP: return "OP_SET_LOCAL_POP";
+  case OP_POP_JUMP_IF_FALSE: return "OP_POP_JUMP_IF_FALSE";
+  case OP_JUMP_IF_NOT_LESS_LOCALS: return "OP_JUMP_IF_NOT_LESS_LOCALS";
+  case OP_JUMP_IF_NOT_LESS_LOCAL_CONST: return "OP_JUMP_IF_NOT_LESS_LOCAL_CONST";
+  default: return NULL;
+  }
+  // clang-format on
+}
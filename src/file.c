@@ -0,0 +1,80 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "file.h"
+
+static bool readCopy(int descriptor, FileView* view, size_t size) {
+  char* buffer = malloc(size + 1);
+  if (buffer == NULL) return false;
+
+  size_t bytesRead = 0;
+  while (bytesRead < size) {
+    ssize_t count = read(descriptor, buffer + bytesRead, size - bytesRead);
+    if (count <= 0) {
+      free(buffer);
+      return false;
+    }
+    bytesRead += (size_t)count;
+  }
+  buffer[size] = '\0';
+
+  view->data = buffer;
+  view->size = size;
+  view->isMapped = false;
+  return true;
+}
+
+bool openFileView(const char* path, FileView* view, bool needsTerminator) {
+  int descriptor = open(path, O_RDONLY);
+  if (descriptor < 0) return false;
+
+  struct stat info;
+  if (fstat(descriptor, &info) != 0) {
+    close(descriptor);
+    return false;
+  }
+  size_t size = (size_t)info.st_size;
+
+  /*
+  The kernel zero fills the rest of the last page past the end of the file,
+  so that byte is the terminator for free. A file that ends exactly on a page
+  boundary has no such byte (touching the next page faults), and empty files
+  can't be mapped at all, those two get a copy.
+  */
+  long pageSize = sysconf(_SC_PAGESIZE);
+  bool canMap = size > 0;
+  if (needsTerminator && pageSize > 0 && size % (size_t)pageSize == 0) {
+    canMap = false;
+  }
+
+  if (canMap) {
+    void* data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+    if (data != MAP_FAILED) {
+      close(descriptor);
+      view->data = data;
+      view->size = size;
+      view->isMapped = true;
+      return true;
+    }
+  }
+
+  bool copied = readCopy(descriptor, view, size);
+  close(descriptor);
+  return copied;
+}
+
+void closeFileView(FileView* view) {
+  if (view->data == NULL) return;
+
+  if (view->isMapped) {
+    munmap((void*)view->data, view->size);
+  } else {
+    free((void*)view->data);
+  }
+  view->data = NULL;
+  view->size = 0;
+}
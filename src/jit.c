@@ -0,0 +1,738 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "chunk.h"
+#include "jit.h"
+#include "vm.h"
+
+#ifdef JIT
+
+#include <sys/mman.h>
+
+/*
+Each instruction is translated on its own into a fixed sequence of machine
+code with its operands (slots, constants, jump targets) patched in, there is
+no register allocation across instructions. Inside the machine code
+
+  rbx  frame->slots of the running frame
+  r12  vm->stackTop, only written back to the VM when leaving
+  r13  frame->closure
+  r14  QNAN, a value is a number unless all of its bits are set
+  r15  the VM
+  rax, rcx, rdx, rsi, rdi, r8-r10, xmm0, xmm1 are scratch
+
+Every function's code starts with the same entry trampoline, which runJit()
+calls: it saves the callee saved registers, loads the ones above and jumps
+to the requested instruction. The VM is an argument rather than a constant
+in the code, so shared functions (see include/program.h) are compiled once
+for every VM that runs them. The shared exit right after it stores r12 in
+vm->stackTop, restores the registers and returns the ip in rax. Instructions
+leave through a stub after the body that loads their own ip and jumps to the
+shared exit.
+
+Calls and returns between two compiled functions push and pop the CallFrame
+in vm->frames exactly like run() does and jump straight into the other
+function's code, the registers are only saved once by whichever trampoline
+was entered first. Its exit then belongs to whatever frame is on top, which
+is why runJit() leaves the ip in the top frame instead of returning it.
+
+Everything here is allocated with plain malloc(), like the profiler, so
+compiling can't start a collection in the middle of an instruction.
+*/
+
+typedef void (*NativeCode)(Value* slots, Value* stackTop, ObjClosure* closure,
+                           uint8_t* entry, VM* vm);
+
+// Registers by their number in the ModRM byte
+#define RAX 0
+#define RCX 1
+#define RDX 2
+
+// Second opcode byte of the jcc rel32 forms, JMP stands for the plain jmp
+#define JMP 0x00
+#define JE 0x84
+#define JNE 0x85
+#define JBE 0x86
+#define JA 0x87
+#define JGE 0x8d
+#define JLE 0x8e
+
+// disp32 of a field of the VM, r15 holds the VM
+#define VM_FIELD(field) ((uint32_t)offsetof(VM, field))
+#define FRAME_FIELD(field) ((uint32_t)offsetof(CallFrame, field))
+
+typedef struct {
+  int at;     // offset of the rel32 in the machine code
+  int target; // bytecode offset jumped to, or left at for an exit
+  bool exit;
+} Fixup;
+
+typedef struct {
+  ObjFunction* function;
+  Chunk* chunk;
+  uint8_t* code;
+  int count;
+  int capacity;
+  uint32_t* entries;
+  Fixup* fixups;
+  int fixupCount;
+  int fixupCapacity;
+  int exitAt; // the shared exit
+  int offset; // bytecode offset of the instruction being translated
+} Assembler;
+
+static void* growOrDie(void* pointer, size_t size) {
+  void* result = realloc(pointer, size);
+  if (result == NULL) {
+    fprintf(stderr, "Failed to allocate memory for the JIT: size=%zu\n", size);
+    exit(1);
+  }
+  return result;
+}
+
+static void emit(Assembler* a, const uint8_t* bytes, int length) {
+  if (a->count + length > a->capacity) {
+    while (a->count + length > a->capacity) {
+      a->capacity = a->capacity < 256 ? 256 : a->capacity * 2;
+    }
+    a->code = growOrDie(a->code, a->capacity);
+  }
+  memcpy(a->code + a->count, bytes, length);
+  a->count += length;
+}
+
+#define EMIT(a, ...)                                                           \
+  emit(a, (const uint8_t[]){__VA_ARGS__},                                      \
+       sizeof((const uint8_t[]){__VA_ARGS__}))
+
+// x86 is little endian like the immediates it reads
+static void emit32(Assembler* a, uint32_t value) {
+  emit(a, (const uint8_t*)&value, sizeof(value));
+}
+
+static void emit64(Assembler* a, uint64_t value) {
+  emit(a, (const uint8_t*)&value, sizeof(value));
+}
+
+static void addFixup(Assembler* a, int at, int target, bool exit) {
+  if (a->fixupCount == a->fixupCapacity) {
+    a->fixupCapacity = a->fixupCapacity < 16 ? 16 : a->fixupCapacity * 2;
+    a->fixups = growOrDie(a->fixups, sizeof(Fixup) * a->fixupCapacity);
+  }
+  a->fixups[a->fixupCount++] = (Fixup){at, target, exit};
+}
+
+// jmp or jcc with a rel32 to fill in later, returns where the rel32 is
+static int jump(Assembler* a, uint8_t condition) {
+  if (condition == JMP) {
+    EMIT(a, 0xe9);
+  } else {
+    EMIT(a, 0x0f, condition);
+  }
+  emit32(a, 0);
+  return a->count - 4;
+}
+
+static void patchJump(Assembler* a, int at, int to) {
+  int32_t relative = to - (at + 4);
+  memcpy(a->code + at, &relative, sizeof(relative));
+}
+
+// Jumps to the current count, the end of a local forward jump
+static void patchHere(Assembler* a, int at) { patchJump(a, at, a->count); }
+
+// Leaves the machine code at the instruction being translated, before it has
+// changed anything, so the interpreter runs all of it
+static void exitIf(Assembler* a, uint8_t condition) {
+  addFixup(a, jump(a, condition), a->offset, true);
+}
+
+static void branchIf(Assembler* a, uint8_t condition, int target) {
+  addFixup(a, jump(a, condition), target, false);
+}
+
+// ============================================================================
+// TEMPLATES
+// ============================================================================
+
+// movabs reg, value
+static void loadImmediate(Assembler* a, int reg, uint64_t value) {
+  EMIT(a, 0x48, 0xb8 + reg);
+  emit64(a, value);
+}
+
+// mov reg, [rbx + slot * 8]
+static void loadLocal(Assembler* a, int reg, int slot) {
+  EMIT(a, 0x48, 0x8b, 0x83 | reg << 3);
+  emit32(a, slot * sizeof(Value));
+}
+
+// mov [rbx + slot * 8], rax
+static void storeLocal(Assembler* a, int slot) {
+  EMIT(a, 0x48, 0x89, 0x83);
+  emit32(a, slot * sizeof(Value));
+}
+
+// mov reg, [r12 - 8 - distance * 8]
+static void loadStack(Assembler* a, int reg, int distance) {
+  EMIT(a, 0x49, 0x8b, 0x44 | reg << 3, 0x24,
+       (uint8_t)(-8 * (distance + 1)));
+}
+
+// mov [r12 - 8 - distance * 8], reg
+static void storeStack(Assembler* a, int reg, int distance) {
+  EMIT(a, 0x49, 0x89, 0x44 | reg << 3, 0x24,
+       (uint8_t)(-8 * (distance + 1)));
+}
+
+// mov [r12], rax; add r12, 8
+static void pushRax(Assembler* a) {
+  EMIT(a, 0x49, 0x89, 0x04, 0x24);
+  EMIT(a, 0x49, 0x83, 0xc4, 0x08);
+}
+
+// sub r12, count * 8
+static void drop(Assembler* a, int count) {
+  EMIT(a, 0x49, 0x83, 0xec, (uint8_t)(count * 8));
+}
+
+// The two operands of a binary instruction are replaced by rax
+static void replaceOperands(Assembler* a) {
+  drop(a, 1);
+  storeStack(a, RAX, 0);
+}
+
+// Exits unless reg holds a number, clobbers rdx
+static void checkNumber(Assembler* a, int reg) {
+  EMIT(a, 0x48, 0x89, 0xc2 | reg << 3); // mov rdx, reg
+  EMIT(a, 0x4c, 0x21, 0xf2);            // and rdx, r14
+  EMIT(a, 0x4c, 0x39, 0xf2);            // cmp rdx, r14
+  exitIf(a, JE);
+}
+
+// rax and rcx into xmm0 and xmm1
+static void moveToDoubles(Assembler* a) {
+  EMIT(a, 0x66, 0x48, 0x0f, 0x6e, 0xc0); // movq xmm0, rax
+  EMIT(a, 0x66, 0x48, 0x0f, 0x6e, 0xc9); // movq xmm1, rcx
+}
+
+// The operands of a binary instruction, a in xmm0 and b in xmm1
+static void loadNumbers(Assembler* a) {
+  loadStack(a, RAX, 1);
+  loadStack(a, RCX, 0);
+  checkNumber(a, RAX);
+  checkNumber(a, RCX);
+  moveToDoubles(a);
+}
+
+// al (0 or 1, upper bits of rax clear) into FALSE_VAL or TRUE_VAL
+static void boolFromAl(Assembler* a) {
+  loadImmediate(a, RDX, FALSE_VAL);
+  EMIT(a, 0x48, 0x01, 0xd0); // add rax, rdx
+}
+
+// Jumps to target if rax is nil or false, clobbers rdx
+static void branchIfFalsey(Assembler* a, int target) {
+  loadImmediate(a, RDX, NIL_VAL);
+  EMIT(a, 0x48, 0x39, 0xd0); // cmp rax, rdx
+  branchIf(a, JE, target);
+  loadImmediate(a, RDX, FALSE_VAL);
+  EMIT(a, 0x48, 0x39, 0xd0); // cmp rax, rdx
+  branchIf(a, JE, target);
+}
+
+// addsd, subsd, mulsd or divsd by the third byte of their encoding
+static void arithmetic(Assembler* a, uint8_t operation) {
+  loadNumbers(a);
+  EMIT(a, 0xf2, 0x0f, operation, 0xc1);  // <op>sd xmm0, xmm1
+  EMIT(a, 0x66, 0x48, 0x0f, 0x7e, 0xc0); // movq rax, xmm0
+  replaceOperands(a);
+}
+
+// ucomisd sets "above" only for an ordered greater side, NaN compares false
+static void comparison(Assembler* a, bool less) {
+  loadNumbers(a);
+  EMIT(a, 0x31, 0xc0); // xor eax, eax
+  if (less) {
+    EMIT(a, 0x66, 0x0f, 0x2e, 0xc8); // ucomisd xmm1, xmm0
+  } else {
+    EMIT(a, 0x66, 0x0f, 0x2e, 0xc1); // ucomisd xmm0, xmm1
+  }
+  EMIT(a, 0x0f, 0x97, 0xc0); // seta al
+  boolFromAl(a);
+  replaceOperands(a);
+}
+
+/*
+Numbers compare as doubles and anything else by its bits, like
+valuesEqual(). Two different objects could be a rope and the string it spells,
+only the interpreter can flatten one, so that case exits.
+*/
+static void emitEqual(Assembler* a) {
+  loadStack(a, RAX, 1);
+  loadStack(a, RCX, 0);
+  EMIT(a, 0x48, 0x89, 0xc2);       // mov rdx, rax
+  EMIT(a, 0x4c, 0x21, 0xf2);       // and rdx, r14
+  EMIT(a, 0x4c, 0x39, 0xf2);       // cmp rdx, r14
+  int notNumbers = jump(a, JE);
+  EMIT(a, 0x48, 0x89, 0xca);       // mov rdx, rcx
+  EMIT(a, 0x4c, 0x21, 0xf2);       // and rdx, r14
+  EMIT(a, 0x4c, 0x39, 0xf2);       // cmp rdx, r14
+  int notNumber = jump(a, JE);
+  moveToDoubles(a);
+  EMIT(a, 0x31, 0xc0);             // xor eax, eax
+  EMIT(a, 0x66, 0x0f, 0x2e, 0xc1); // ucomisd xmm0, xmm1
+  EMIT(a, 0x0f, 0x94, 0xc0);       // sete al
+  EMIT(a, 0x0f, 0x9b, 0xc1);       // setnp cl
+  EMIT(a, 0x20, 0xc8);             // and al, cl
+  int doneNumbers = jump(a, JMP);
+
+  patchHere(a, notNumbers);
+  patchHere(a, notNumber);
+  EMIT(a, 0x48, 0x39, 0xc8); // cmp rax, rcx
+  int same = jump(a, JE);
+  loadImmediate(a, RDX, SIGN_BIT | QNAN);
+  EMIT(a, 0x48, 0x89, 0xc6); // mov rsi, rax
+  EMIT(a, 0x48, 0x21, 0xd6); // and rsi, rdx
+  EMIT(a, 0x48, 0x39, 0xd6); // cmp rsi, rdx
+  exitIf(a, JE);
+  EMIT(a, 0x48, 0x89, 0xce); // mov rsi, rcx
+  EMIT(a, 0x48, 0x21, 0xd6); // and rsi, rdx
+  EMIT(a, 0x48, 0x39, 0xd6); // cmp rsi, rdx
+  exitIf(a, JE);
+  EMIT(a, 0x31, 0xc0); // xor eax, eax
+  int doneOther = jump(a, JMP);
+  patchHere(a, same);
+  EMIT(a, 0xb8, 0x01, 0x00, 0x00, 0x00); // mov eax, 1
+
+  patchHere(a, doneNumbers);
+  patchHere(a, doneOther);
+  boolFromAl(a);
+  replaceOperands(a);
+}
+
+// rax = vm->globalValues.values
+static void loadGlobals(Assembler* a) {
+  EMIT(a, 0x49, 0x8b, 0x87);
+  emit32(a, VM_FIELD(globalValues.values));
+}
+
+static void getGlobal(Assembler* a, int index) {
+  loadGlobals(a);
+  EMIT(a, 0x48, 0x8b, 0x80); // mov rax, [rax + index * 8]
+  emit32(a, index * sizeof(Value));
+  loadImmediate(a, RDX, UNDEFINED_VAL);
+  EMIT(a, 0x48, 0x39, 0xd0); // cmp rax, rdx
+  exitIf(a, JE);
+  pushRax(a);
+}
+
+static void setGlobal(Assembler* a, int index) {
+  loadGlobals(a);
+  loadImmediate(a, RDX, UNDEFINED_VAL);
+  EMIT(a, 0x48, 0x39, 0x90); // cmp [rax + index * 8], rdx
+  emit32(a, index * sizeof(Value));
+  exitIf(a, JE);
+  loadStack(a, RCX, 0);
+  EMIT(a, 0x48, 0x89, 0x88); // mov [rax + index * 8], rcx
+  emit32(a, index * sizeof(Value));
+}
+
+// rax = frame->closure->upvalues[slot]->location
+static void loadUpvalue(Assembler* a, int slot) {
+  EMIT(a, 0x49, 0x8b, 0x85); // mov rax, [r13 + upvalues[slot]]
+  emit32(a, offsetof(ObjClosure, upvalues) + slot * sizeof(ObjUpvalue*));
+  EMIT(a, 0x48, 0x8b, 0x80); // mov rax, [rax + location]
+  emit32(a, offsetof(ObjUpvalue, location));
+}
+
+// r8 = &r8[rcx] for r8 pointing at a CallFrame array, the stride comes from
+// sizeof(CallFrame) so adding a field can't put the frames out of step
+static void frameAddress(Assembler* a) {
+  EMIT(a, 0x4c, 0x69, 0xc9); // imul r9, rcx, sizeof(CallFrame)
+  emit32(a, (uint32_t)sizeof(CallFrame));
+  EMIT(a, 0x4d, 0x01, 0xc8); // add r8, r9
+}
+
+static void emitNot(Assembler* a) {
+  loadStack(a, RAX, 0);
+  loadImmediate(a, RCX, TRUE_VAL);
+  loadImmediate(a, RDX, NIL_VAL);
+  EMIT(a, 0x48, 0x39, 0xd0); // cmp rax, rdx
+  int isNil = jump(a, JE);
+  loadImmediate(a, RDX, FALSE_VAL);
+  EMIT(a, 0x48, 0x39, 0xd0); // cmp rax, rdx
+  int isFalse = jump(a, JE);
+  EMIT(a, 0x48, 0x89, 0xd1); // mov rcx, rdx
+  patchHere(a, isNil);
+  patchHere(a, isFalse);
+  storeStack(a, RCX, 0);
+}
+
+// Only used without PROFILE, the profiler has to see every call and return
+#ifndef PROFILE
+/*
+The fast path of OP_CALL for a compiled closure with the right arity whose
+frame fits: push the frame and jump into the callee's code. Everything else
+(natives, errors, a callee the interpreter still runs) exits to run().
+*/
+static void emitCall(Assembler* a, int argCount) {
+  uint32_t callee = (uint32_t)(-8 * (argCount + 1));
+  EMIT(a, 0x49, 0x8b, 0x84, 0x24); // mov rax, [r12 - (argCount + 1) * 8]
+  emit32(a, callee);
+  loadImmediate(a, RDX, SIGN_BIT | QNAN);
+  EMIT(a, 0x48, 0x89, 0xc6); // mov rsi, rax
+  EMIT(a, 0x48, 0x21, 0xd6); // and rsi, rdx
+  EMIT(a, 0x48, 0x39, 0xd6); // cmp rsi, rdx
+  exitIf(a, JNE);
+  EMIT(a, 0x48, 0x31, 0xd0); // xor rax, rdx, the Obj* now
+  EMIT(a, 0x81, 0xb8);       // cmp dword [rax + type], OBJ_CLOSURE
+  emit32(a, offsetof(Obj, type));
+  emit32(a, OBJ_CLOSURE);
+  exitIf(a, JNE);
+  EMIT(a, 0x48, 0x8b, 0xb0); // mov rsi, [rax + function]
+  emit32(a, offsetof(ObjClosure, function));
+  EMIT(a, 0x81, 0xbe);       // cmp dword [rsi + arity], argCount
+  emit32(a, offsetof(ObjFunction, arity));
+  emit32(a, argCount);
+  exitIf(a, JNE);
+  EMIT(a, 0x48, 0x8b, 0x96); // mov rdx, [rsi + jit]
+  emit32(a, offsetof(ObjFunction, jit));
+  EMIT(a, 0x48, 0x85, 0xd2); // test rdx, rdx
+  exitIf(a, JE);
+  EMIT(a, 0x41, 0x8b, 0x8f); // mov ecx, [r15 + frameCount]
+  emit32(a, VM_FIELD(frameCount));
+  EMIT(a, 0x41, 0x3b, 0x8f); // cmp ecx, [r15 + frameCapacity]
+  emit32(a, VM_FIELD(frameCapacity));
+  exitIf(a, JGE);
+  EMIT(a, 0x49, 0x8d, 0xbc, 0x24); // lea rdi, [r12 - (argCount + 1) * 8]
+  emit32(a, callee);
+  EMIT(a, 0x4c, 0x63, 0x86); // movsxd r8, dword [rsi + maxStack]
+  emit32(a, offsetof(ObjFunction, maxStack));
+  EMIT(a, 0x4e, 0x8d, 0x04, 0xc7); // lea r8, [rdi + r8 * 8]
+  EMIT(a, 0x4d, 0x3b, 0x87);       // cmp r8, [r15 + stackLimit]
+  emit32(a, VM_FIELD(stackLimit));
+  exitIf(a, JA);
+
+  // r8 = &vm->frames[vm->frameCount], the caller's frame is right below it
+  EMIT(a, 0x4d, 0x8b, 0x87); // mov r8, [r15 + frames]
+  emit32(a, VM_FIELD(frames));
+  frameAddress(a);
+  EMIT(a, 0x49, 0xba);             // movabs r10, return ip
+  emit64(a, (uint64_t)(uintptr_t)(a->chunk->code + a->offset +
+                                  instructionLength(a->chunk, a->offset)));
+  EMIT(a, 0x4d, 0x89, 0x90); // mov [r8 - frame + ip], r10
+  emit32(a, (uint32_t)(FRAME_FIELD(ip) - sizeof(CallFrame)));
+  EMIT(a, 0x49, 0x89, 0x80); // mov [r8 + closure], rax
+  emit32(a, FRAME_FIELD(closure));
+  EMIT(a, 0x4c, 0x8b, 0x96); // mov r10, [rsi + chunk.code]
+  emit32(a, offsetof(ObjFunction, chunk.code));
+  EMIT(a, 0x4d, 0x89, 0x90); // mov [r8 + ip], r10
+  emit32(a, FRAME_FIELD(ip));
+  EMIT(a, 0x49, 0x89, 0xb8); // mov [r8 + slots], rdi
+  emit32(a, FRAME_FIELD(slots));
+  EMIT(a, 0x41, 0xff, 0x87); // inc dword [r15 + frameCount]
+  emit32(a, VM_FIELD(frameCount));
+  EMIT(a, 0x48, 0x89, 0xfb); // mov rbx, rdi
+  EMIT(a, 0x49, 0x89, 0xc5); // mov r13, rax
+  EMIT(a, 0xff, 0xa2);       // jmp [rdx + start]
+  emit32(a, offsetof(JitCode, start));
+}
+
+/*
+OP_RETURN into a compiled caller pops the frame and jumps to where the
+caller left off. Returning from the script, into the interpreter or with
+upvalues to close exits instead.
+*/
+static void emitReturn(Assembler* a) {
+  if (a->function->hasCaptures) {
+    exitIf(a, JMP);
+    return;
+  }
+  EMIT(a, 0x41, 0x8b, 0x8f); // mov ecx, [r15 + frameCount]
+  emit32(a, VM_FIELD(frameCount));
+  EMIT(a, 0x83, 0xf9, 0x01); // cmp ecx, 1
+  exitIf(a, JLE);
+  // r8 = &vm->frames[vm->frameCount], the caller's frame is two below it
+  EMIT(a, 0x4d, 0x8b, 0x87); // mov r8, [r15 + frames]
+  emit32(a, VM_FIELD(frames));
+  frameAddress(a);
+  uint32_t caller = (uint32_t)(-2 * (int)sizeof(CallFrame));
+  EMIT(a, 0x49, 0x8b, 0x80); // mov rax, [r8 - 2 frames + closure]
+  emit32(a, caller + FRAME_FIELD(closure));
+  EMIT(a, 0x48, 0x8b, 0xb0); // mov rsi, [rax + function]
+  emit32(a, offsetof(ObjClosure, function));
+  EMIT(a, 0x48, 0x8b, 0x96); // mov rdx, [rsi + jit]
+  emit32(a, offsetof(ObjFunction, jit));
+  EMIT(a, 0x48, 0x85, 0xd2); // test rdx, rdx
+  exitIf(a, JE);
+
+  // The result replaces the callee, like in run()
+  EMIT(a, 0x4d, 0x8b, 0x54, 0x24, 0xf8); // mov r10, [r12 - 8]
+  EMIT(a, 0x4c, 0x89, 0x13);             // mov [rbx], r10
+  EMIT(a, 0x4c, 0x8d, 0x63, 0x08);       // lea r12, [rbx + 8]
+  EMIT(a, 0x41, 0xff, 0x8f);             // dec dword [r15 + frameCount]
+  emit32(a, VM_FIELD(frameCount));
+  EMIT(a, 0x49, 0x8b, 0x98); // mov rbx, [r8 - 2 frames + slots]
+  emit32(a, caller + FRAME_FIELD(slots));
+  EMIT(a, 0x49, 0x89, 0xc5); // mov r13, rax
+  // Resume at caller->ip, through the caller's entries
+  EMIT(a, 0x49, 0x8b, 0x88); // mov rcx, [r8 - 2 frames + ip]
+  emit32(a, caller + FRAME_FIELD(ip));
+  EMIT(a, 0x48, 0x2b, 0x8e); // sub rcx, [rsi + chunk.code]
+  emit32(a, offsetof(ObjFunction, chunk.code));
+  EMIT(a, 0x4c, 0x8b, 0x8a); // mov r9, [rdx + entries]
+  emit32(a, offsetof(JitCode, entries));
+  EMIT(a, 0x41, 0x8b, 0x0c, 0x89); // mov ecx, [r9 + rcx * 4]
+  EMIT(a, 0x48, 0x03, 0x8a);       // add rcx, [rdx + code]
+  emit32(a, offsetof(JitCode, code));
+  EMIT(a, 0xff, 0xe1); // jmp rcx
+}
+#endif
+
+static uint16_t readShort(Chunk* chunk, int offset) {
+  return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+
+static void translate(Assembler* a) {
+  Chunk* chunk = a->chunk;
+  int offset = a->offset;
+  uint8_t* code = chunk->code + offset;
+  Value* constants = chunk->constants.values;
+
+  // clang-format off
+  switch (code[0]) {
+    case OP_CONSTANT: loadImmediate(a, RAX, constants[code[1]]); pushRax(a); break;
+    case OP_CONSTANT_LONG:
+      loadImmediate(a, RAX, constants[readShort(chunk, offset + 1)]);
+      pushRax(a);
+      break;
+    case OP_NIL: loadImmediate(a, RAX, NIL_VAL); pushRax(a); break;
+    case OP_TRUE: loadImmediate(a, RAX, TRUE_VAL); pushRax(a); break;
+    case OP_FALSE: loadImmediate(a, RAX, FALSE_VAL); pushRax(a); break;
+    case OP_POP: drop(a, 1); break;
+    case OP_GET_LOCAL: loadLocal(a, RAX, code[1]); pushRax(a); break;
+    case OP_SET_LOCAL: loadStack(a, RAX, 0); storeLocal(a, code[1]); break;
+    case OP_SET_LOCAL_POP:
+      loadStack(a, RAX, 0);
+      drop(a, 1);
+      storeLocal(a, code[1]);
+      break;
+    case OP_GET_GLOBAL: getGlobal(a, code[1]); break;
+    case OP_GET_GLOBAL_LONG: getGlobal(a, readShort(chunk, offset + 1)); break;
+    case OP_SET_GLOBAL: setGlobal(a, code[1]); break;
+    case OP_SET_GLOBAL_LONG: setGlobal(a, readShort(chunk, offset + 1)); break;
+    case OP_GET_UPVALUE:
+      loadUpvalue(a, code[1]);
+      EMIT(a, 0x48, 0x8b, 0x00); // mov rax, [rax]
+      pushRax(a);
+      break;
+#ifndef GC_GENERATIONAL
+    // With the generational GC the store needs the write barrier in C
+    case OP_SET_UPVALUE:
+      loadUpvalue(a, code[1]);
+      loadStack(a, RCX, 0);
+      EMIT(a, 0x48, 0x89, 0x08); // mov [rax], rcx
+      break;
+#endif
+    case OP_EQUAL: emitEqual(a); break;
+    case OP_GREATER:
+    case OP_GREATER_NUM: comparison(a, false); break;
+    case OP_LESS:
+    case OP_LESS_NUM: comparison(a, true); break;
+    case OP_ADD:
+    case OP_ADD_NUM: arithmetic(a, 0x58); break;
+    case OP_SUBTRACT:
+    case OP_SUBTRACT_NUM: arithmetic(a, 0x5c); break;
+    case OP_MULTIPLY:
+    case OP_MULTIPLY_NUM: arithmetic(a, 0x59); break;
+    case OP_DIVIDE:
+    case OP_DIVIDE_NUM: arithmetic(a, 0x5e); break;
+    case OP_NOT: emitNot(a); break;
+    case OP_NEGATE:
+      loadStack(a, RAX, 0);
+      checkNumber(a, RAX);
+      EMIT(a, 0x48, 0x0f, 0xba, 0xf8, 0x3f); // btc rax, 63
+      storeStack(a, RAX, 0);
+      break;
+    case OP_JUMP:
+      branchIf(a, JMP, offset + 3 + readShort(chunk, offset + 1));
+      break;
+    case OP_LOOP:
+      branchIf(a, JMP, offset + 3 - readShort(chunk, offset + 1));
+      break;
+    case OP_JUMP_IF_FALSE:
+      loadStack(a, RAX, 0);
+      branchIfFalsey(a, offset + 3 + readShort(chunk, offset + 1));
+      break;
+    case OP_POP_JUMP_IF_FALSE:
+      loadStack(a, RAX, 0);
+      drop(a, 1);
+      branchIfFalsey(a, offset + 3 + readShort(chunk, offset + 1));
+      break;
+    case OP_JUMP_IF_NOT_LESS_LOCALS:
+      loadLocal(a, RAX, code[1]);
+      loadLocal(a, RCX, code[2]);
+      checkNumber(a, RAX);
+      checkNumber(a, RCX);
+      moveToDoubles(a);
+      EMIT(a, 0x66, 0x0f, 0x2e, 0xc8); // ucomisd xmm1, xmm0
+      branchIf(a, JBE, offset + 5 + readShort(chunk, offset + 3));
+      break;
+    case OP_JUMP_IF_NOT_LESS_LOCAL_CONST: {
+      // The interpreter reports the error for a constant that's no number
+      Value constant = constants[code[2]];
+      if (!IS_NUMBER(constant)) { exitIf(a, JMP); break; }
+      loadLocal(a, RAX, code[1]);
+      checkNumber(a, RAX);
+      loadImmediate(a, RCX, constant);
+      moveToDoubles(a);
+      EMIT(a, 0x66, 0x0f, 0x2e, 0xc8); // ucomisd xmm1, xmm0
+      branchIf(a, JBE, offset + 5 + readShort(chunk, offset + 3));
+      break;
+    }
+    case OP_ADD_LOCAL_CONST: {
+      Value constant = constants[code[2]];
+      if (!IS_NUMBER(constant)) { exitIf(a, JMP); break; }
+      loadLocal(a, RAX, code[1]);
+      checkNumber(a, RAX);
+      loadImmediate(a, RCX, constant);
+      moveToDoubles(a);
+      EMIT(a, 0xf2, 0x0f, 0x58, 0xc1);       // addsd xmm0, xmm1
+      EMIT(a, 0x66, 0x48, 0x0f, 0x7e, 0xc0); // movq rax, xmm0
+      pushRax(a);
+      break;
+    }
+#ifndef PROFILE
+    // The profiler has to see every call and return
+    case OP_CALL: emitCall(a, code[1]); break;
+    case OP_CALL_0:
+    case OP_CALL_1:
+    case OP_CALL_2:
+    case OP_CALL_3: emitCall(a, code[0] - OP_CALL_0); break;
+    case OP_RETURN: emitReturn(a); break;
+#endif
+    // Prints, definitions, closures, upvalues to close, tail calls and string
+    // concatenation are left to the interpreter
+    default: exitIf(a, JMP); break;
+  }
+  // clang-format on
+}
+
+// Saves the callee saved registers, loads the ones the templates use from
+// the arguments and jumps to the entry. The shared exit follows it
+static void emitTrampoline(Assembler* a) {
+  EMIT(a, 0x53);             // push rbx
+  EMIT(a, 0x41, 0x54);       // push r12
+  EMIT(a, 0x41, 0x55);       // push r13
+  EMIT(a, 0x41, 0x56);       // push r14
+  EMIT(a, 0x41, 0x57);       // push r15
+  EMIT(a, 0x48, 0x89, 0xfb); // mov rbx, rdi
+  EMIT(a, 0x49, 0x89, 0xf4); // mov r12, rsi
+  EMIT(a, 0x49, 0x89, 0xd5); // mov r13, rdx
+  EMIT(a, 0x49, 0xbe);       // movabs r14, QNAN
+  emit64(a, QNAN);
+  EMIT(a, 0x4d, 0x89, 0xc7); // mov r15, r8
+  EMIT(a, 0xff, 0xe1);       // jmp rcx
+
+  a->exitAt = a->count;
+  EMIT(a, 0x4d, 0x89, 0xa7); // mov [r15 + stackTop], r12
+  emit32(a, VM_FIELD(stackTop));
+  EMIT(a, 0x41, 0x8b, 0x8f); // mov ecx, [r15 + frameCount]
+  emit32(a, VM_FIELD(frameCount));
+  EMIT(a, 0x4d, 0x8b, 0x87); // mov r8, [r15 + frames]
+  emit32(a, VM_FIELD(frames));
+  frameAddress(a);
+  EMIT(a, 0x49, 0x89, 0x80);       // mov [r8 - frame + ip], rax
+  emit32(a, (uint32_t)(FRAME_FIELD(ip) - sizeof(CallFrame)));
+  EMIT(a, 0x41, 0x5f); // pop r15
+  EMIT(a, 0x41, 0x5e); // pop r14
+  EMIT(a, 0x41, 0x5d); // pop r13
+  EMIT(a, 0x41, 0x5c); // pop r12
+  EMIT(a, 0x5b);       // pop rbx
+  EMIT(a, 0xc3);       // ret
+}
+
+// One stub per instruction that can exit: movabs rax, its ip; jmp exit
+static void emitExits(Assembler* a) {
+  int stubTarget = -1;
+  int stub = 0;
+  for (int i = 0; i < a->fixupCount; i++) {
+    Fixup* fixup = &a->fixups[i];
+    if (!fixup->exit) continue;
+    // Fixups are added in bytecode order, an instruction's are adjacent
+    if (fixup->target != stubTarget) {
+      stubTarget = fixup->target;
+      stub = a->count;
+      loadImmediate(a, RAX, (uint64_t)(uintptr_t)(a->chunk->code + stubTarget));
+      patchJump(a, jump(a, JMP), a->exitAt);
+    }
+    patchJump(a, fixup->at, stub);
+  }
+}
+
+void compileJit(ObjFunction* function) {
+  Assembler a;
+  memset(&a, 0, sizeof(a));
+  a.function = function;
+  a.chunk = &function->chunk;
+  a.entries = calloc(a.chunk->count + 1, sizeof(uint32_t));
+  if (a.entries == NULL) return;
+
+  emitTrampoline(&a);
+  for (a.offset = 0; a.offset < a.chunk->count;
+       a.offset += instructionLength(a.chunk, a.offset)) {
+    a.entries[a.offset] = (uint32_t)a.count;
+    translate(&a);
+  }
+  for (int i = 0; i < a.fixupCount; i++) {
+    Fixup* fixup = &a.fixups[i];
+    if (!fixup->exit) patchJump(&a, fixup->at, a.entries[fixup->target]);
+  }
+  emitExits(&a);
+
+  // Written while writable, then flipped to executable, never both at once
+  JitCode* jit = malloc(sizeof(JitCode));
+  uint8_t* code = mmap(NULL, a.count, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (jit == NULL || code == MAP_FAILED) {
+    free(jit);
+    free(a.entries);
+  } else {
+    memcpy(code, a.code, a.count);
+    if (mprotect(code, a.count, PROT_READ | PROT_EXEC) != 0) {
+      munmap(code, a.count);
+      free(jit);
+      free(a.entries);
+    } else {
+      jit->code = code;
+      jit->start = code + a.entries[0];
+      jit->size = a.count;
+      jit->entries = a.entries;
+      function->jit = jit;
+    }
+  }
+  free(a.code);
+  free(a.fixups);
+}
+
+void runJit(VM* vm, ObjClosure* closure, Value* slots, uint8_t* ip) {
+  JitCode* jit = closure->function->jit;
+  NativeCode native = (NativeCode)jit->code;
+  native(slots, vm->stackTop, closure,
+         jit->code + jit->entries[ip - closure->function->chunk.code], vm);
+}
+
+void freeJit(ObjFunction* function) {
+  JitCode* jit = function->jit;
+  if (jit == NULL) return;
+  munmap(jit->code, jit->size);
+  free(jit->entries);
+  free(jit);
+  function->jit = NULL;
+}
+
+#endif
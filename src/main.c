@@ -1,91 +1,398 @@
 // <> means its a global lib/bin, available across the system
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 // means its a relative/specified path
+#include "cache.h"
 #include "chunk.h"
 #include "common.h"
+#include "compiler.h"
 #include "debug.h"
+#include "file.h"
+#include "memory.h"
+#include "profiler.h"
+#include "program.h"
+#include "scanner.h"
 #include "vm.h"
 
-static void repl() {
-  char line[1024];
+// A command typed into the REPL, as many lines as it took
+typedef struct {
+  char* chars;
+  size_t length;
+  size_t capacity;
+} Command;
+
+static void appendLine(Command* command, const char* line, size_t length) {
+  if (command->capacity < command->length + length + 1) {
+    size_t capacity = command->capacity < 256 ? 256 : command->capacity;
+    while (capacity < command->length + length + 1) capacity *= 2;
+    command->chars = (char*)realloc(command->chars, capacity);
+    if (command->chars == NULL) {
+      fprintf(stderr, "Failed to allocate a command of %zu bytes\n",
+              command->length + length);
+      exit(1);
+    }
+    command->capacity = capacity;
+  }
+  memcpy(command->chars + command->length, line, length);
+  command->length += length;
+  command->chars[command->length] = '\0';
+}
+
+static bool isSpace(char c) {
+  return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool isBlank(const char* chars) {
+  while (isSpace(*chars)) chars++;
+  return *chars == '\0';
+}
+
+// True once every string, parenthesis and brace the source opens is closed
+static bool isComplete(const char* source) {
+  Scanner scanner;
+  initScanner(&scanner, source);
+  int depth = 0;
   for (;;) {
-    printf("> ");
+    Token token = scanToken(&scanner);
+    switch (token.type) {
+    case TOKEN_LEFT_PAREN:
+    case TOKEN_LEFT_BRACE:
+      depth++;
+      break;
+    case TOKEN_RIGHT_PAREN:
+    case TOKEN_RIGHT_BRACE:
+      depth--;
+      break;
+    case TOKEN_ERROR:
+      // Error tokens point at their message
+      if (strcmp(token.start, "Unterminated string.") == 0) return false;
+      break;
+    case TOKEN_EOF:
+      return depth <= 0;
+    default:
+      break;
+    }
+  }
+}
 
-    if (!fgets(line, sizeof(line), stdin)) {
+/*
+Reads lines until they make a complete command, the prompt turns to "... "
+while a string, parenthesis or brace is still open. A blank line runs what
+there is anyway. False at the end of the input.
+*/
+static bool readCommand(Command* command, char** line, size_t* lineCapacity) {
+  command->length = 0;
+  printf("> ");
+  for (;;) {
+    ssize_t length = getline(line, lineCapacity, stdin);
+    if (length < 0) {
+      if (command->length > 0) return true;
       printf("\n");
-      break;
+      return false;
     }
 
-    interpret(line);
+    if (isBlank(*line)) {
+      if (command->length > 0) return true;
+      printf("> ");
+      continue;
+    }
+    appendLine(command, *line, (size_t)length);
+    if (isComplete(command->chars)) return true;
+    printf("... ");
   }
 }
 
-/*
-We open the file, but before reading it, we seek to the very end using fseek().
-Then we call ftell() which tells us how many bytes we are from the start of the
-file. Since we sought to the end, that’s the size. We rewind back to the
-beginning, allocate a string of that size, and read the whole file in a single
-batch.
- */
-static char* readFile(const char* path) {
-  FILE* file = fopen(path, "rb");
+static double replClock() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
 
-  if (file == NULL) {
-    fprintf(stderr, "Could not open file \"%s\".\n", path);
-    exit(74);
+// Lines starting with ':' talk to the REPL instead of running as Lox
+static void replCommand(VM* vm, const char* chars, double lastTime) {
+  size_t length = strlen(chars);
+  while (length > 0 && isSpace(chars[length - 1])) length--;
+
+  if (length == 6 && memcmp(chars, ":stats", 6) == 0) {
+    printHeapStats(vm);
+    printf("last     %.3f ms\n", lastTime * 1000);
+  } else {
+    printf("Unknown command '%.*s', try :stats.\n", (int)length, chars);
   }
+}
 
-  fseek(file, 0L, SEEK_END);     // go to last byte of file
-  size_t fileSize = ftell(file); // tell the size
-  rewind(file);                  // rewind back to first byte
+/*
+One VM for the whole session, so the globals and interned strings of one
+command are there for the next. Every command compiles to a script function
+of its own which nothing refers to once it has run. Collecting right after
+each command frees it, along with the rest of what the command left behind,
+while the user is still reading the result. With GC_GENERATIONAL a minor
+collection is enough, unless one that ran during the command already
+promoted the function.
+*/
+static void repl(VM* vm) {
+  Command command = {NULL, 0, 0};
+  char* line = NULL;
+  size_t lineCapacity = 0;
+  double lastTime = 0;
 
-  char* buffer = (char*)malloc(fileSize + 1);
-  if (buffer == NULL) {
-    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-    exit(74);
+  while (readCommand(&command, &line, &lineCapacity)) {
+    const char* start = command.chars;
+    while (isSpace(*start)) start++;
+    if (*start == ':') {
+      replCommand(vm, start, lastTime);
+      continue;
+    }
+
+    double began = replClock();
+    ObjFunction* function = compile(vm, command.chars);
+    if (function != NULL) interpretFunction(vm, function);
+    lastTime = replClock() - began;
+#ifdef GC_GENERATIONAL
+    if (function != NULL && !function->obj.isOld) {
+      collectYoung(vm);
+      continue;
+    }
+#endif
+    collectGarbage(vm);
   }
 
-  // [buffer] is the ptr to where it will start reading bytes into
-  // [sizeof(char)] is the size of each element/increment
-  // [fileSize] number of elements to read
-  // [file] file handle to read from
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-  if (bytesRead < fileSize) {
+  free(line);
+  free(command.chars);
+}
+
+/*
+The source is mapped rather than copied when it can be (see include/file.h),
+either way it ends in a '\0' for the scanner.
+ */
+static void readFile(const char* path, FileView* source) {
+  if (!openFileView(path, source, true)) {
     fprintf(stderr, "Could not read file \"%s\".\n", path);
     exit(74);
   }
+}
 
-  buffer[bytesRead] = '\n';
+typedef enum {
+  CACHE_USE,   // load script.loxc when it matches, write it when it doesn't
+  CACHE_OFF,   // --no-cache
+  CACHE_WRITE, // --compile, only write script.loxc
+} CacheMode;
 
-  fclose(file);
-  return buffer;
+static bool hasExtension(const char* path, const char* extension) {
+  size_t length = strlen(path);
+  size_t extensionLength = strlen(extension);
+  return length >= extensionLength &&
+         strcmp(path + length - extensionLength, extension) == 0;
 }
 
-static void runFile(const char* path) {
-  char* source = readFile(path);
-  InterpretResult result = interpret(source);
-  free(source);
+/* Compiles the script, or picks its function straight out of the bytecode
+ * cache when the cache was compiled from exactly this source */
+static ObjFunction* loadScript(VM* vm, const char* path, CacheMode mode) {
+  // A .loxc given directly runs without its source
+  if (hasExtension(path, ".loxc")) {
+    ObjFunction* function = readCache(vm, path, NULL);
+    if (function == NULL) {
+      fprintf(stderr, "Could not load bytecode \"%s\".\n", path);
+      exit(74);
+    }
+    return function;
+  }
+
+  FileView source;
+  readFile(path, &source);
+  SourceKey key = sourceKey(path, source.data);
+  char* bytecodePath = cachePath(path);
 
-  if (result == INTERPRET_COMPILER_ERROR) exit(65);
-  if (result == INTERPRET_RUNTIME_ERROR) exit(70);
+  ObjFunction* function = NULL;
+  if (mode == CACHE_USE) function = readCache(vm, bytecodePath, &key);
+  if (function == NULL) {
+    function = compile(vm, source.data);
+    if (function != NULL && mode != CACHE_OFF && !compileReportedErrors(vm) &&
+        !writeCache(vm, bytecodePath, function, &key) && mode == CACHE_WRITE) {
+      fprintf(stderr, "Could not write bytecode \"%s\".\n", bytecodePath);
+    }
+  }
+
+  free(bytecodePath);
+  closeFileView(&source);
+  return function;
+}
+
+// Returns the process exit code
+static int runFile(VM* vm, const char* path, CacheMode mode) {
+  ObjFunction* function = loadScript(vm, path, mode);
+  if (function == NULL || (mode == CACHE_WRITE && compileReportedErrors(vm))) {
+    return 65;
+  }
+  if (mode == CACHE_WRITE) return 0;
+
+  InterpretResult result = interpretFunction(vm, function);
+  if (result == INTERPRET_RUNTIME_ERROR) return 70;
+  return 0;
+}
+
+typedef struct {
+  Program* program;
+  int maxFrames;
+  int stackSlots;
+  bool gcStats;
+  int status;
+} Worker;
+
+static void* runWorker(void* argument) {
+  Worker* worker = (Worker*)argument;
+  VM vm;
+  initVMWithLimits(&vm, worker->maxFrames, worker->stackSlots);
+  InterpretResult result = runProgram(&vm, worker->program);
+  worker->status = result == INTERPRET_RUNTIME_ERROR ? 70 : 0;
+  if (worker->gcStats) printGCStats(&vm);
+  freeVM(&vm);
+  return NULL;
+}
+
+/*
+Compiles the script once and runs it on count VMs at the same time, one
+thread each (see include/program.h). Their output goes to the same stdout, so
+lines of different workers can come out in any order.
+*/
+static int runWorkers(const char* path, int count, Worker config) {
+  FileView source;
+  readFile(path, &source);
+  config.program = compileProgram(source.data);
+  closeFileView(&source);
+  if (config.program == NULL) return 65;
+
+  Worker* workers = (Worker*)malloc(sizeof(Worker) * count);
+  pthread_t* threads = (pthread_t*)malloc(sizeof(pthread_t) * count);
+  if (workers == NULL || threads == NULL) {
+    fprintf(stderr, "Failed to allocate %d workers\n", count);
+    exit(1);
+  }
+
+  int started = 0;
+  while (started < count) {
+    workers[started] = config;
+    if (pthread_create(&threads[started], NULL, runWorker,
+                       &workers[started]) != 0) {
+      fprintf(stderr, "Could only start %d of %d workers.\n", started, count);
+      break;
+    }
+    started++;
+  }
+
+  int status = started < count ? 70 : 0;
+  for (int i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+    if (workers[i].status != 0) status = workers[i].status;
+  }
+
+  free(threads);
+  free(workers);
+  freeProgram(config.program);
+  return status;
+}
+
+// A count for --frames, --stack or --workers, sets *error unless it's a
+// positive number that keeps a stack of 256 slots per frame addressable
+static int parseLimit(const char* text, bool* error) {
+  char* end;
+  long value = strtol(text, &end, 10);
+  if (*end != '\0' || value < 1 || value > INT_MAX / UINT8_COUNT) {
+    *error = true;
+    return 0;
+  }
+  return (int)value;
 }
 
 int main(int argc, char* argv[]) {
-  initVM();
+  // --gc-stats prints collection counts and pause times to stderr on exit
+  // --compile writes the bytecode cache for the script without running it
+  // --no-cache neither reads nor writes the bytecode cache
+  // --profile <file> writes sampled stacks to file and opcode and function
+  //   timings to stderr on exit, needs a PROFILE=1 build
+  // --frames <n> allows n nested calls, --stack <slots> sizes the value stack
+  //   (by default STACK_PER_FRAME slots per frame, never fewer than 256), see
+  //   include/vm.h
+  // --workers <n> compiles the script once and runs it on n VMs in parallel
+  //   threads, without the bytecode cache, see include/program.h
+  bool gcStats = false;
+  bool usageError = false;
+  CacheMode cacheMode = CACHE_USE;
+  const char* path = NULL;
+  const char* profilePath = NULL;
+  int maxFrames = 0;
+  int stackSlots = 0;
+  int workers = 0;
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--gc-stats") == 0) {
+      gcStats = true;
+    } else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc) {
+      profilePath = argv[++i];
+    } else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+      maxFrames = parseLimit(argv[++i], &usageError);
+    } else if (strcmp(argv[i], "--stack") == 0 && i + 1 < argc) {
+      stackSlots = parseLimit(argv[++i], &usageError);
+    } else if (strcmp(argv[i], "--workers") == 0 && i + 1 < argc) {
+      workers = parseLimit(argv[++i], &usageError);
+    } else if (strcmp(argv[i], "--compile") == 0) {
+      cacheMode = CACHE_WRITE;
+    } else if (strcmp(argv[i], "--no-cache") == 0) {
+      cacheMode = CACHE_OFF;
+    } else if (path == NULL) {
+      path = argv[i];
+    } else {
+      usageError = true;
+    }
+  }
+  // --compile needs something to compile, --workers a script to compile.
+  // The profiler follows a single VM
+  if (workers > 0) {
+    usageError = usageError || path == NULL || hasExtension(path, ".loxc") ||
+                 cacheMode == CACHE_WRITE || profilePath != NULL;
+  }
+  if (usageError || (path == NULL && cacheMode == CACHE_WRITE)) {
+    fprintf(stderr, "Usage: clox [--gc-stats] [--profile <file>] "
+                    "[--frames <n>] [--stack <slots>] "
+                    "[--compile | --no-cache | --workers <n>] [path]\n");
+    exit(64);
+  }
+#ifndef PROFILE
+  if (profilePath != NULL) {
+    fprintf(stderr, "--profile needs a build with PROFILE=1.\n");
+    exit(64);
+  }
+#endif
 
-  if (argc == 1) {
-    repl();
-  } else if (argc == 2) {
-    runFile(argv[1]);
+  if (stackSlots == 0) {
+    stackSlots = maxFrames == 0 ? STACK_MAX : maxFrames * STACK_PER_FRAME;
+  }
+  if (maxFrames == 0) maxFrames = FRAMES_MAX;
+  if (workers > 0) {
+    Worker config = {NULL, maxFrames, stackSlots, gcStats, 0};
+    return runWorkers(path, workers, config);
+  }
+
+  VM vm;
+  initVMWithLimits(&vm, maxFrames, stackSlots);
+#ifdef PROFILE
+  if (profilePath != NULL) startProfiler(&vm, profilePath);
+#endif
+
+  int status = 0;
+  if (path == NULL) {
+    repl(&vm);
   } else {
-    fprintf(stderr, "Usage: clox [path]\n");
-    exit(64);
+    status = runFile(&vm, path, cacheMode);
   }
 
-  freeVM();
+  if (gcStats) printGCStats(&vm);
+  freeVM(&vm);
+  closeCaches(&vm);
 
   // Chunk chunk;
   // Chunk *ptr = &chunk;
@@ -111,7 +418,7 @@ int main(int argc, char* argv[]) {
   // interpret(&chunk);
   // freeChunk(&chunk);
 
-  return 0;
+  return status;
 }
 
 /*
@@ -1,13 +1,59 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
 
 #include "chunk.h"
+#include "compiler.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "table.h"
 #include "vm.h"
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+#ifdef DEBUG_LOG_GC
+#include "debug.h"
+#endif
+
+// Every heap size change goes through here, this is where collections start
+static void trackAllocation(VM* vm, size_t oldSize, size_t newSize) {
+  vm->bytesAllocated += newSize - oldSize;
+
+  // Only growing the heap can push us over the threshold
+  if (newSize > oldSize) {
+#ifdef GC_GENERATIONAL
+    vm->bytesSinceGC += newSize - oldSize;
+#endif
+
+#ifdef DEBUG_STRESS_GC
+#ifdef GC_GENERATIONAL
+    // Minor collections are the ones that depend on the write barriers, every
+    // other one is full so those also run with a populated remembered set
+    if (vm->gcStats.collections % 2 == 0) {
+      collectYoung(vm);
+    } else {
+      collectGarbage(vm);
+    }
+#else
+    collectGarbage(vm);
+#endif
+#endif
+
+    if (vm->bytesAllocated > vm->nextGC) {
+      collectGarbage(vm);
+    }
+#ifdef GC_GENERATIONAL
+    else if (vm->bytesSinceGC > GC_NURSERY_SIZE) {
+      collectYoung(vm);
+    }
+#endif
+  }
+}
+
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize) {
+  trackAllocation(vm, oldSize, newSize);
+
   if (newSize == 0) {
     free(pointer);
     return NULL;
@@ -23,43 +69,516 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
   return result;
 }
 
-static void freeObject(Obj* object) {
+// ============================================================================
+// OBJECT_POOLS
+// ============================================================================
+
+#ifdef POOL_ALLOCATOR
+static int poolClass(size_t size) { return (int)((size - 1) / POOL_GRANULE); }
+
+// Carve a new slab into blocks of one class and put them on its free list
+static void refillPool(VM* vm, int sizeClass) {
+  size_t blockSize = (size_t)(sizeClass + 1) * POOL_GRANULE;
+  PoolSlab* slab = (PoolSlab*)malloc(POOL_SLAB_SIZE);
+  if (slab == NULL) {
+    fprintf(stderr, "Failed to allocate memory: pool slab of %d bytes\n",
+            POOL_SLAB_SIZE);
+    exit(1);
+  }
+  slab->next = vm->pools.slabs;
+  vm->pools.slabs = slab;
+
+  // The slab header takes the first granule so blocks stay 16 byte aligned
+  char* block = (char*)slab + POOL_GRANULE;
+  char* end = (char*)slab + POOL_SLAB_SIZE;
+  PoolBlock** freeList = &vm->pools.freeLists[sizeClass];
+  for (; block + blockSize <= end; block += blockSize) {
+    PoolBlock* entry = (PoolBlock*)block;
+    entry->next = *freeList;
+    *freeList = entry;
+  }
+}
+#endif
+
+void* poolAllocate(VM* vm, size_t size) {
+#ifdef POOL_ALLOCATOR
+  if (size > POOL_MAX_SIZE) return reallocate(vm, NULL, 0, size);
+
+  // Collect first, whatever it frees is reused straight away
+  trackAllocation(vm, 0, size);
+
+  int sizeClass = poolClass(size);
+  if (vm->pools.freeLists[sizeClass] == NULL) refillPool(vm, sizeClass);
+
+  PoolBlock* block = vm->pools.freeLists[sizeClass];
+  vm->pools.freeLists[sizeClass] = block->next;
+  return block;
+#else
+  return reallocate(vm, NULL, 0, size);
+#endif
+}
+
+void poolFree(VM* vm, void* pointer, size_t size) {
+#ifdef POOL_ALLOCATOR
+  if (size > POOL_MAX_SIZE) {
+    reallocate(vm, pointer, size, 0);
+    return;
+  }
+
+  trackAllocation(vm, size, 0);
+
+  PoolBlock* block = (PoolBlock*)pointer;
+  int sizeClass = poolClass(size);
+  block->next = vm->pools.freeLists[sizeClass];
+  vm->pools.freeLists[sizeClass] = block;
+#else
+  reallocate(vm, pointer, size, 0);
+#endif
+}
+
+static void freePools(VM* vm) {
+  PoolSlab* slab = vm->pools.slabs;
+  while (slab != NULL) {
+    PoolSlab* next = slab->next;
+    free(slab);
+    slab = next;
+  }
+  vm->pools = (ObjectPools){0};
+}
+
+static void freeObject(VM* vm, Obj* object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p free type %d\n", (void*)object, object->type);
+#endif
+
   switch (object->type) {
   case OBJ_STRING: {
     ObjString* string = (ObjString*)object;
-    FREE_ARRAY(char, string->chars, string->length + 1);
-    FREE(ObjString, object);
+    poolFree(vm, object, sizeof(ObjString) + string->length + 1);
     break;
   }
   case OBJ_FUNCTION: {
     ObjFunction* function = (ObjFunction*)object;
-    freeChunk(&function->chunk);
-    FREE(ObjFunction, object);
+    freeChunk(vm, &function->chunk);
+#ifdef JIT
+    freeJit(function);
+#endif
+    FREE(vm, ObjFunction, object);
     break;
   }
   case OBJ_NATIVE: {
-    FREE(ObjNative, object);
+    FREE(vm, ObjNative, object);
     break;
   }
   case OBJ_CLOSURE: {
     ObjClosure* closure = (ObjClosure*)object;
-    FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
-    FREE(ObjClosure, object);
+    poolFree(vm, object,
+             sizeof(ObjClosure) + sizeof(ObjUpvalue*) * closure->upvalueCount);
     break;
   }
   case OBJ_UPVALUE: {
-    FREE(ObjUpvalue, object);
+    FREE(vm, ObjUpvalue, object);
     break;
   }
+  case OBJ_ROPE: {
+    FREE(vm, ObjRope, object);
+    break;
+  }
+  }
+}
+
+// ============================================================================
+// GARBAGE_COLLECTOR
+// ============================================================================
+
+/*
+Tri-color marking:
+  white  - not reached yet (isMarked == false)
+  gray   - reached, but its own references haven't been traced (on grayStack)
+  black  - reached and fully traced (marked and off the gray stack)
+When the gray stack runs dry every white object is unreachable.
+*/
+void markObject(VM* vm, Obj* object) {
+  if (object == NULL) return;
+  if (object->isMarked) return;
+#ifdef GC_GENERATIONAL
+  // A minor collection treats the whole old generation as alive, old objects
+  // pointing back into the nursery are found through the remembered set
+  if (vm->minorGC && object->isOld) return;
+#endif
+
+#ifdef DEBUG_LOG_GC
+  printf("%p mark ", (void*)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+
+  object->isMarked = true;
+
+  if (vm->grayCapacity < vm->grayCount + 1) {
+    vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
+    // Plain realloc(), going through reallocate() could start a nested GC
+    vm->grayStack =
+        (Obj**)realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
+    if (vm->grayStack == NULL) {
+      fprintf(stderr, "Failed to allocate the GC gray stack\n");
+      exit(1);
+    }
+  }
+
+  vm->grayStack[vm->grayCount++] = object;
+}
+
+void markValue(VM* vm, Value value) {
+  if (IS_OBJ(value)) markObject(vm, AS_OBJ(value));
+}
+
+static void markArray(VM* vm, ValueArray* array) {
+  for (int i = 0; i < array->count; i++) {
+    markValue(vm, array->values[i]);
+  }
+}
+
+// Trace the references of a gray object, turning it black
+static void blackenObject(VM* vm, Obj* object) {
+#ifdef DEBUG_LOG_GC
+  printf("%p blacken ", (void*)object);
+  printValue(OBJ_VAL(object));
+  printf("\n");
+#endif
+
+  switch (object->type) {
+  case OBJ_CLOSURE: {
+    ObjClosure* closure = (ObjClosure*)object;
+    markObject(vm, (Obj*)closure->function);
+    // Slots can still be NULL while OP_CLOSURE is capturing
+    for (int i = 0; i < closure->upvalueCount; i++) {
+      markObject(vm, (Obj*)closure->upvalues[i]);
+    }
+    break;
+  }
+  case OBJ_FUNCTION: {
+    ObjFunction* function = (ObjFunction*)object;
+    markObject(vm, (Obj*)function->name);
+    markObject(vm, (Obj*)function->shared);
+    markArray(vm, &function->chunk.constants);
+    break;
+  }
+  case OBJ_UPVALUE:
+    // Open upvalues point into the stack which is marked anyway
+    markValue(vm, ((ObjUpvalue*)object)->closed);
+    break;
+  case OBJ_ROPE: {
+    ObjRope* rope = (ObjRope*)object;
+    markObject(vm, rope->left);
+    markObject(vm, rope->right);
+    markObject(vm, (Obj*)rope->flat);
+    break;
+  }
+  case OBJ_NATIVE:
+  case OBJ_STRING:
+    break;
+  }
+}
+
+static void markRoots(VM* vm) {
+  for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+    markValue(vm, *slot);
+  }
+
+  for (int i = 0; i < vm->frameCount; i++) {
+    markObject(vm, (Obj*)vm->frames[i].closure);
+  }
+
+  // Open upvalues can only point below the stack top
+  for (int i = 0; i < vm->stackTop - vm->stack; i++) {
+    if (vm->openUpvalues[i] != NULL) markObject(vm, (Obj*)vm->openUpvalues[i]);
   }
+
+  markTable(vm, &vm->globalNames);
+  markArray(vm, &vm->globalValues);
+  markCompilerRoots(vm);
 }
 
-void freeObjects() {
-  Obj* object = vm.objects;
+static void traceReferences(VM* vm) {
+  while (vm->grayCount > 0) {
+    Obj* object = vm->grayStack[--vm->grayCount];
+    blackenObject(vm, object);
+  }
+}
+
+// Walk an object list, free every white object and whiten the survivors for
+// the next cycle
+static void sweep(VM* vm, Obj** list) {
+  Obj* previous = NULL;
+  Obj* object = *list;
+
+  while (object != NULL) {
+    if (object->isMarked) {
+      object->isMarked = false;
+      previous = object;
+      object = object->next;
+    } else {
+      Obj* unreached = object;
+      object = object->next;
+      if (previous != NULL) {
+        previous->next = object;
+      } else {
+        *list = object;
+      }
+
+      freeObject(vm, unreached);
+    }
+  }
+}
+
+#ifdef GC_GENERATIONAL
+// Free what died in the nursery and promote every survivor, which leaves the
+// nursery empty and means no old object can point into it afterwards
+static void sweepYoung(VM* vm) {
+  Obj* object = vm->objects;
 
   while (object != NULL) {
     Obj* next = object->next;
-    freeObject(object);
+    if (object->isMarked) {
+      object->isMarked = false;
+      object->isOld = true;
+      object->next = vm->oldObjects;
+      vm->oldObjects = object;
+    } else {
+      freeObject(vm, object);
+    }
     object = next;
   }
+
+  vm->objects = NULL;
+}
+
+void rememberObject(VM* vm, Obj* object) {
+  if (object->isRemembered) return;
+  object->isRemembered = true;
+
+  if (vm->rememberedCapacity < vm->rememberedCount + 1) {
+    vm->rememberedCapacity = GROW_CAPACITY(vm->rememberedCapacity);
+    // Plain realloc() for the same reason as the gray stack
+    vm->rememberedSet = (Obj**)realloc(vm->rememberedSet,
+                                      sizeof(Obj*) * vm->rememberedCapacity);
+    if (vm->rememberedSet == NULL) {
+      fprintf(stderr, "Failed to allocate the GC remembered set\n");
+      exit(1);
+    }
+  }
+
+  vm->rememberedSet[vm->rememberedCount++] = object;
+}
+
+// After either kind of collection every live object is old, so the
+// remembered set starts over empty
+static void clearRememberedSet(VM* vm) {
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    vm->rememberedSet[i]->isRemembered = false;
+  }
+  vm->rememberedCount = 0;
+  vm->bytesSinceGC = 0;
+}
+#endif
+
+static double gcClock() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// See GC_PAUSE_BUCKETS in include/vm.h
+static int pauseBucket(double pause) {
+  double micros = pause * 1e6;
+  if (micros < 4) return micros < 0 ? 0 : (int)micros;
+
+  // Past the last bucket anyway, and keeps the conversion below in range
+  if (micros >= 0x1p60) return GC_PAUSE_BUCKETS - 1;
+  uint64_t whole = (uint64_t)micros;
+  int octave = 0;
+  while ((whole >> octave) >= 8) octave++;
+  int bucket = 4 + octave * 4 + (int)((whole >> octave) - 4);
+  return bucket < GC_PAUSE_BUCKETS ? bucket : GC_PAUSE_BUCKETS - 1;
+}
+
+// The shortest pause, in seconds, too long for the bucket
+static double bucketLimit(int bucket) {
+  if (bucket < 4) return (bucket + 1) / 1e6;
+  int octave = (bucket - 4) / 4;
+  return (double)((uint64_t)(bucket % 4 + 5) << octave) / 1e6;
+}
+
+static void recordPause(VM* vm, double pause, bool minor) {
+  GCStats* stats = &vm->gcStats;
+  stats->collections++;
+  if (minor) stats->minorCollections++;
+  stats->totalPause += pause;
+  if (pause > stats->maxPause) stats->maxPause = pause;
+  stats->pauseBuckets[pauseBucket(pause)]++;
+}
+
+void collectGarbage(VM* vm) {
+#ifdef DEBUG_LOG_GC
+  printf("-- gc begin\n");
+  size_t before = vm->bytesAllocated;
+#endif
+  double start = gcClock();
+
+  markRoots(vm);
+  traceReferences(vm);
+  // vm->strings is weak, drop interned strings nothing else refers to before
+  // sweep() frees them and leaves dangling keys behind
+  tableRemoveWhite(vm, &vm->strings);
+#ifdef GC_GENERATIONAL
+  // Before sweeping, a remembered old object may be one of the dead
+  clearRememberedSet(vm);
+  // Old first, sweepYoung() hands its survivors to the old list unmarked
+  sweep(vm, &vm->oldObjects);
+  sweepYoung(vm);
+#else
+  sweep(vm, &vm->objects);
+#endif
+
+  vm->nextGC = (size_t)(vm->bytesAllocated * vm->gcGrowFactor);
+  if (vm->nextGC < GC_INITIAL_HEAP) vm->nextGC = GC_INITIAL_HEAP;
+
+  recordPause(vm, gcClock() - start, false);
+
+#ifdef DEBUG_LOG_GC
+  printf("-- gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu) next at %zu\n",
+         before - vm->bytesAllocated, before, vm->bytesAllocated, vm->nextGC);
+#endif
+}
+
+#ifdef GC_GENERATIONAL
+void collectYoung(VM* vm) {
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc begin\n");
+  size_t before = vm->bytesAllocated;
+#endif
+  double start = gcClock();
+
+  vm->minorGC = true;
+  markRoots(vm);
+  // Old objects that were handed a young reference are extra roots. Blacken
+  // them directly, markObject() would skip them for being old
+  for (int i = 0; i < vm->rememberedCount; i++) {
+    blackenObject(vm, vm->rememberedSet[i]);
+  }
+  traceReferences(vm);
+  tableRemoveWhite(vm, &vm->strings);
+  sweepYoung(vm);
+  clearRememberedSet(vm);
+  vm->minorGC = false;
+
+  recordPause(vm, gcClock() - start, true);
+
+#ifdef DEBUG_LOG_GC
+  printf("-- minor gc end\n");
+  printf("   collected %zu bytes (from %zu to %zu)\n",
+         before - vm->bytesAllocated, before, vm->bytesAllocated);
+#endif
+}
+#endif
+
+void printGCStats(VM* vm) {
+  GCStats* stats = &vm->gcStats;
+
+  double p99 = 0;
+  if (stats->collections > 0) {
+    // Nearest rank, ceil(0.99 * n), reported as the top of its bucket but
+    // never above the longest pause actually seen
+    long long rank = (99LL * stats->collections + 99) / 100;
+    long long seen = 0;
+    int bucket = 0;
+    while (seen + stats->pauseBuckets[bucket] < rank) {
+      seen += stats->pauseBuckets[bucket++];
+    }
+    p99 = bucketLimit(bucket);
+    if (p99 > stats->maxPause) p99 = stats->maxPause;
+  }
+
+  fprintf(stderr, "[gc] %d collections (%d minor, %d full)\n",
+          stats->collections, stats->minorCollections,
+          stats->collections - stats->minorCollections);
+  fprintf(stderr, "[gc] pause total %.3f ms, max %.3f ms, p99 %.3f ms\n",
+          stats->totalPause * 1000, stats->maxPause * 1000, p99 * 1000);
+  fprintf(stderr, "[gc] heap %zu bytes, next full collection at %zu bytes\n",
+          vm->bytesAllocated, vm->nextGC);
+}
+
+static void countObjects(Obj* object, int* counts) {
+  for (; object != NULL; object = object->next) counts[object->type]++;
+}
+
+static void printTableStats(const char* name, Table* table) {
+  int live = 0;
+  for (int i = 0; i < table->capacity; i++) {
+    if (table->entries[i].key != NULL) live++;
+  }
+  // Tombstones take up slots like keys, the load counts both
+  double load =
+      table->capacity == 0 ? 0 : (double)table->count / table->capacity;
+  printf("%-8s %d entries, %d tombstones, %d slots, load %.2f\n", name, live,
+         table->count - live, table->capacity, load);
+}
+
+void printHeapStats(VM* vm) {
+  // clang-format off
+  static const char* typeNames[] = {
+    [OBJ_STRING] = "string",   [OBJ_FUNCTION] = "function",
+    [OBJ_NATIVE] = "native",   [OBJ_CLOSURE] = "closure",
+    [OBJ_UPVALUE] = "upvalue", [OBJ_ROPE] = "rope",
+  };
+  // clang-format on
+  int counts[OBJ_ROPE + 1] = {0};
+  countObjects(vm->objects, counts);
+#ifdef GC_GENERATIONAL
+  countObjects(vm->oldObjects, counts);
+#endif
+
+  printf("heap     %zu bytes, next collection at %zu bytes\n",
+         vm->bytesAllocated, vm->nextGC);
+  int total = 0;
+  for (int type = 0; type <= OBJ_ROPE; type++) total += counts[type];
+  printf("objects  %d:", total);
+  for (int type = 0; type <= OBJ_ROPE; type++) {
+    printf("%s %d %s", type == 0 ? "" : ",", counts[type], typeNames[type]);
+  }
+  printf("\n");
+  printTableStats("globals", &vm->globalNames);
+  printTableStats("strings", &vm->strings);
+}
+
+static void freeList(VM* vm, Obj* object) {
+  while (object != NULL) {
+    Obj* next = object->next;
+    freeObject(vm, object);
+    object = next;
+  }
+}
+
+void freeObjects(VM* vm) {
+  freeList(vm, vm->objects);
+  vm->objects = NULL;
+#ifdef GC_GENERATIONAL
+  freeList(vm, vm->oldObjects);
+  vm->oldObjects = NULL;
+  free(vm->rememberedSet);
+  vm->rememberedSet = NULL;
+  vm->rememberedCount = 0;
+  vm->rememberedCapacity = 0;
+#endif
+
+  vm->gcStats = (GCStats){0};
+
+  freePools(vm);
+
+  free(vm->grayStack);
+  vm->grayStack = NULL;
+  vm->grayCount = 0;
+  vm->grayCapacity = 0;
 }
\ No newline at end of file
@@ -1,5 +1,6 @@
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 #include "memory.h"
@@ -8,62 +9,201 @@
 #include "value.h"
 #include "vm.h"
 
-#define ALLOCATE_OBJ(type, objectType)                                         \
-  (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType)                                     \
+  (type*)allocateObject(vm, sizeof(type), objectType)
 
-static Obj* allocateObject(size_t size, ObjType type);
-static ObjString* allocateString(char* chars, int length, uint32_t hash);
+static Obj* allocateObject(VM* vm, size_t size, ObjType type);
+static ObjString* allocateString(VM* vm, const char* chars, int length,
+                                 uint32_t hash);
 
-static Obj* allocateObject(size_t size, ObjType type) {
-  Obj* object = (Obj*)reallocate(NULL, 0, size);
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
+  Obj* object = (Obj*)poolAllocate(vm, size);
   object->type = type;
+  object->isMarked = false;
+#ifdef GC_GENERATIONAL
+  object->isOld = false;
+  object->isRemembered = false;
+#endif
 
   // Assign the next to the current head
-  object->next = vm.objects;
+  object->next = vm->objects;
   // Move the head forwards to the latest obj
-  vm.objects = object;
-  return object;
-}
+  vm->objects = object;
 
-ObjClosure* newClosure(ObjFunction* function) {
-  ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+#ifdef DEBUG_LOG_GC
+  printf("%p allocate %zu for %d\n", (void*)object, size, type);
+#endif
 
-  for(int i = 0; i < function->upvalueCount; i++) {
-    upvalues[i] = NULL;
-  }
+  return object;
+}
 
-  ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
+ObjClosure* newClosure(VM* vm, ObjFunction* function) {
+  ObjClosure* closure = (ObjClosure*)allocateObject(vm,
+      sizeof(ObjClosure) + sizeof(ObjUpvalue*) * function->upvalueCount,
+      OBJ_CLOSURE);
   closure->function = function;
-  closure->upvalues = upvalues;
   closure->upvalueCount = function->upvalueCount;
+
+  // NULL until OP_CLOSURE captures them, the GC skips empty slots
+  for (int i = 0; i < function->upvalueCount; i++) {
+    closure->upvalues[i] = NULL;
+  }
   return closure;
 }
 
-ObjFunction* newFunction() {
-  ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+ObjFunction* newFunction(VM* vm) {
+  ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
   function->arity = 0;
   function->upvalueCount = 0;
+  function->maxStack = 0;
+  function->hasCaptures = false;
+  function->isShared = false;
+  function->isCached = false;
   function->name = NULL;
+  function->shared = NULL;
+#ifdef PROFILE
+  function->profile = NULL;
+#endif
+#ifdef JIT
+  function->hotness = 0;
+  function->jit = NULL;
+#endif
   initChunk(&function->chunk);
   return function;
 }
 
-ObjNative* newNative(NativeFn function) {
-  ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+ObjNative* newNative(VM* vm, NativeFn function) {
+  ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
   native->function = function;
   return native;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-  ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-
+// Header and characters in one allocation, the characters are left to the
+// caller
+ObjString* newString(VM* vm, int length) {
+  ObjString* string = (ObjString*)allocateObject(vm,
+      sizeof(ObjString) + length + 1, OBJ_STRING);
   string->length = length;
-  string->chars = chars;
+  string->chars[length] = '\0';
+  return string;
+}
+
+static void addString(VM* vm, ObjString* string, uint32_t hash) {
   string->hash = hash;
-  tableSet(&vm.strings, string, NIL_VAL);
+  // tableSet() can grow the table and kick off a collection, the string isn't
+  // reachable from anywhere yet so it rides on the stack until it is interned
+  push(vm, OBJ_VAL(string));
+  tableSet(vm, &vm->strings, string, NIL_VAL);
+  pop(vm);
+}
+
+static ObjString* allocateString(VM* vm, const char* chars, int length,
+                                 uint32_t hash) {
+  ObjString* string = newString(vm, length);
+  // FlawFinder: ignore, string->chars has room for length+1 bytes
+  memcpy(string->chars, chars, length);
+  addString(vm, string, hash);
   return string;
 }
 
+#ifdef STRING_HASH_WYHASH
+/*
+wyhash (final version 4), reading 8 bytes at a time where FNV-1a below takes
+one. Strings up to 16 bytes cost two multiplies whatever their length, longer
+ones 16 or 48 bytes per round. The 64 bit result is folded into the 32 bits
+Entry keeps.
+*/
+static const uint64_t wySecret[4] = {
+    0x2d358dccaa6c78a5u, 0x8bb84b93962eacc9u,
+    0x4b33a62ed433d4a3u, 0x4d5a2da51de1aa47u};
+
+// Both halves of the 128 bit product
+static inline void wyMultiply(uint64_t* a, uint64_t* b) {
+#ifdef __SIZEOF_INT128__
+  __uint128_t product = (__uint128_t)*a * *b;
+  *a = (uint64_t)product;
+  *b = (uint64_t)(product >> 64);
+#else
+  uint64_t aHigh = *a >> 32, aLow = (uint32_t)*a;
+  uint64_t bHigh = *b >> 32, bLow = (uint32_t)*b;
+  uint64_t high = aHigh * bHigh, middle0 = aHigh * bLow;
+  uint64_t middle1 = aLow * bHigh, low = aLow * bLow;
+  uint64_t t = low + (middle0 << 32);
+  uint64_t carry = t < low;
+  uint64_t lower = t + (middle1 << 32);
+  carry += lower < t;
+  *a = lower;
+  *b = high + (middle0 >> 32) + (middle1 >> 32) + carry;
+#endif
+}
+
+static inline uint64_t wyMix(uint64_t a, uint64_t b) {
+  wyMultiply(&a, &b);
+  return a ^ b;
+}
+
+// Unaligned little endian loads, memcpy() compiles to a single mov
+static inline uint64_t read64(const uint8_t* p) {
+  uint64_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static inline uint64_t read32(const uint8_t* p) {
+  uint32_t value;
+  memcpy(&value, p, sizeof(value));
+  return value;
+}
+
+static uint32_t hashString(const char* key, int length) {
+  const uint8_t* p = (const uint8_t*)key;
+  size_t remaining = (size_t)length;
+  uint64_t seed = wyMix(wySecret[0], wySecret[1]);
+  uint64_t a, b;
+
+  if (remaining <= 16) {
+    if (remaining >= 4) {
+      // Two overlapping windows cover every length from 4 to 16
+      size_t quarter = (remaining >> 3) << 2;
+      a = (read32(p) << 32) | read32(p + quarter);
+      b = (read32(p + remaining - 4) << 32) |
+          read32(p + remaining - 4 - quarter);
+    } else if (remaining > 0) {
+      a = ((uint64_t)p[0] << 16) | ((uint64_t)p[remaining >> 1] << 8) |
+          p[remaining - 1];
+      b = 0;
+    } else {
+      a = b = 0;
+    }
+  } else {
+    if (remaining > 48) {
+      uint64_t seed1 = seed, seed2 = seed;
+      do {
+        seed = wyMix(read64(p) ^ wySecret[1], read64(p + 8) ^ seed);
+        seed1 = wyMix(read64(p + 16) ^ wySecret[2], read64(p + 24) ^ seed1);
+        seed2 = wyMix(read64(p + 32) ^ wySecret[3], read64(p + 40) ^ seed2);
+        p += 48;
+        remaining -= 48;
+      } while (remaining > 48);
+      seed ^= seed1 ^ seed2;
+    }
+    while (remaining > 16) {
+      seed = wyMix(read64(p) ^ wySecret[1], read64(p + 8) ^ seed);
+      p += 16;
+      remaining -= 16;
+    }
+    // The last 16 bytes, overlapping what the loop already took
+    a = read64(p + remaining - 16);
+    b = read64(p + remaining - 8);
+  }
+
+  a ^= wySecret[1];
+  b ^= seed;
+  wyMultiply(&a, &b);
+  uint64_t hash = wyMix(a ^ wySecret[0] ^ (uint64_t)length, b ^ wySecret[1]);
+  return (uint32_t)(hash ^ (hash >> 32));
+}
+#else
 static uint32_t hashString(const char* key, int length) {
   uint32_t hash = 2166136261u;
   for (int i = 0; i < length; i++) {
@@ -72,21 +212,17 @@ static uint32_t hashString(const char* key, int length) {
   }
   return hash;
 }
+#endif
 
 /* Takes a copy of the string */
-ObjString* copyString(const char* chars, int length) {
+ObjString* copyString(VM* vm, const char* chars, int length) {
   uint32_t hash = hashString(chars, length);
 
-  ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
 
   if (interned != NULL) return interned;
 
-  char* heapChars = ALLOCATE(char, length + 1);
-  // FlawFinder: ignore, heapChars is allocated with length+1, memcpy is safe
-  memcpy(heapChars, chars, length);
-  heapChars[length] = '\0';
-
-  return allocateString(heapChars, length, hash);
+  return allocateString(vm, chars, length, hash);
 }
 
 static void printFunction(ObjFunction* function) {
@@ -97,25 +233,147 @@ static void printFunction(ObjFunction* function) {
   printf("<fn %s>", function->name->chars);
 }
 
-ObjUpvalue* newUpvalue(Value* slot) {
-  ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot) {
+  ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
   upvalue->closed = NIL_VAL;
   upvalue->location = slot;
-  upvalue->next = NULL;
   return upvalue;
 }
 
-/* Takes actual string */
-ObjString* takeString(char* chars, int length) {
-  uint32_t hash = hashString(chars, length);
-  ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+ObjString* internString(VM* vm, ObjString* string) {
+  uint32_t hash = hashString(string->chars, string->length);
+  ObjString* interned = tableFindString(&vm->strings, string->chars,
+                                        string->length, hash);
+  if (interned == NULL) {
+    addString(vm, string, hash);
+    return string;
+  }
+
+  // Nothing has been allocated since newString(), so it is still the head of
+  // the object list
+  vm->objects = string->obj.next;
+  poolFree(vm, string, sizeof(ObjString) + string->length + 1);
+  return interned;
+}
 
-  if (interned != NULL) {
-    FREE_ARRAY(char, chars, length + 1);
-    return interned;
+ObjRope* newRope(VM* vm, Obj* left, Obj* right, int length) {
+  ObjRope* rope = ALLOCATE_OBJ(vm, ObjRope, OBJ_ROPE);
+  rope->length = length;
+  rope->left = left;
+  rope->right = right;
+  rope->flat = NULL;
+  return rope;
+}
+
+typedef void (*PieceFn)(const char* chars, int length, void* context);
+
+/*
+Calls visit() on the characters of every piece of the rope, left to right.
+A string appended to in a loop makes a rope as deep as the number of appends,
+so the walk keeps its own stack (plain malloc(), this runs while the GC logs
+and must not start a collection) instead of recursing.
+*/
+static void visitPieces(ObjRope* rope, PieceFn visit, void* context) {
+  int capacity = 64;
+  int count = 0;
+  Obj** pending = malloc(sizeof(Obj*) * capacity);
+  if (pending == NULL) {
+    fprintf(stderr, "Failed to allocate memory: rope walk\n");
+    exit(1);
+  }
+  pending[count++] = (Obj*)rope;
+
+  while (count > 0) {
+    Obj* piece = pending[--count];
+    if (piece->type == OBJ_STRING) {
+      visit(((ObjString*)piece)->chars, ((ObjString*)piece)->length, context);
+      continue;
+    }
+
+    ObjRope* node = (ObjRope*)piece;
+    if (node->flat != NULL) {
+      visit(node->flat->chars, node->flat->length, context);
+      continue;
+    }
+
+    if (capacity < count + 2) {
+      capacity *= 2;
+      pending = realloc(pending, sizeof(Obj*) * capacity);
+      if (pending == NULL) {
+        fprintf(stderr, "Failed to allocate memory: rope walk\n");
+        exit(1);
+      }
+    }
+    // Right first so the left half comes off the stack first
+    pending[count++] = node->right;
+    pending[count++] = node->left;
+  }
+  free(pending);
+}
+
+static void appendPiece(const char* chars, int length, void* context) {
+  char** end = (char**)context;
+  memcpy(*end, chars, length);
+  *end += length;
+}
+
+ObjString* flattenRope(VM* vm, ObjRope* rope) {
+  if (rope->flat != NULL) return rope->flat;
+
+  // Straight into the new string, visitPieces() doesn't allocate on the heap
+  // the GC counts
+  ObjString* flat = newString(vm, rope->length);
+  char* end = flat->chars;
+  visitPieces(rope, appendPiece, &end);
+
+  rope->flat = internString(vm, flat);
+  WRITE_BARRIER(vm, rope, OBJ_VAL(rope->flat));
+  // The halves can go now, nothing reads them after this
+  rope->left = NULL;
+  rope->right = NULL;
+  return rope->flat;
+}
+
+static void writeFunction(Output* output, ObjFunction* function) {
+  if (function->name == NULL) {
+    writeOutput(output, "<script>", 8);
+    return;
+  }
+  writeOutput(output, "<fn ", 4);
+  writeOutput(output, function->name->chars, (size_t)function->name->length);
+  writeOutput(output, ">", 1);
+}
+
+static void writePiece(const char* chars, int length, void* context) {
+  writeOutput((Output*)context, chars, (size_t)length);
+}
+
+void writeObject(Output* output, Value value) {
+  switch (OBJ_TYPE(value)) {
+  case OBJ_STRING:
+    writeOutput(output, AS_CSTRING(value), (size_t)AS_STRING(value)->length);
+    break;
+  case OBJ_FUNCTION:
+    writeFunction(output, AS_FUNCTION(value));
+    break;
+  case OBJ_NATIVE:
+    writeOutput(output, "<native fn>", 11);
+    break;
+  case OBJ_CLOSURE:
+    writeFunction(output, AS_CLOSURE(value)->function);
+    break;
+  case OBJ_UPVALUE:
+    writeOutput(output, "upvalue", 7);
+    break;
+  case OBJ_ROPE:
+    visitPieces(AS_ROPE(value), writePiece, output);
+    break;
   }
+}
 
-  return allocateString(chars, length, hash);
+static void printPiece(const char* chars, int length, void* context) {
+  (void)context;
+  fwrite(chars, 1, length, stdout);
 }
 
 void printObject(Value value) {
@@ -139,5 +397,8 @@ void printObject(Value value) {
     printf("upvalue");
     break;
   }
+  case OBJ_ROPE:
+    visitPieces(AS_ROPE(value), printPiece, NULL);
+    break;
   }
 }
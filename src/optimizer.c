@@ -0,0 +1,298 @@
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "chunk.h"
+#include "memory.h"
+#include "object.h"
+#include "optimizer.h"
+
+/*
+The compiler emits code in a single pass and can't look ahead, so some very
+common sequences cost a dispatch per instruction:
+
+  i = i + 1;      GET_LOCAL, CONSTANT, ADD, SET_LOCAL, POP
+  while (i < n)   GET_LOCAL, GET_LOCAL, LESS, JUMP_IF_FALSE, POP
+  if (cond)       JUMP_IF_FALSE, POP ... POP at the jump target
+
+This pass decodes the finished chunk, fuses those sequences into the
+superinstructions at the end of OpCode and writes the code back in place
+(it only ever gets shorter). Nothing is fused across a jump target, since
+some other path could enter in the middle of the sequence. Jumps are decoded
+to absolute targets first and re-encoded once every instruction has its new
+offset.
+*/
+
+typedef struct {
+  int offset; // in the original code
+  int length;
+  uint8_t opcode;
+  // Absolute jump target (original offsets), -1 for everything else
+  int target;
+} Instruction;
+
+typedef struct {
+  int operand;   // new offset of the two offset bytes
+  int end;       // new offset just past the instruction
+  int oldTarget; // original target, mapped through newOffsets
+  bool backward;
+} JumpFixup;
+
+typedef struct {
+  Chunk* chunk;
+  Instruction* instructions;
+  int instructionCount;
+  bool* isTarget; // indexed by original offset
+  // Rewritten code, copied back over the chunk at the end
+  uint8_t* code;
+  int* lines;
+  int count;
+  int* newOffsets; // original offset -> new offset
+  JumpFixup* fixups;
+  int fixupCount;
+} Peephole;
+
+static uint16_t readShort(Chunk* chunk, int offset) {
+  return (uint16_t)((chunk->code[offset] << 8) | chunk->code[offset + 1]);
+}
+
+// Fills in p->instructions and p->isTarget, false if the code doesn't decode
+static bool decode(VM* vm, Peephole* p) {
+  Chunk* chunk = p->chunk;
+  bool* isStart = ALLOCATE(vm, bool, chunk->count + 1);
+  for (int i = 0; i <= chunk->count; i++) {
+    isStart[i] = false;
+    p->isTarget[i] = false;
+  }
+
+  bool valid = true;
+  for (int offset = 0; offset < chunk->count && valid;) {
+    Instruction* instruction = &p->instructions[p->instructionCount++];
+    instruction->offset = offset;
+    instruction->opcode = chunk->code[offset];
+    instruction->length = instructionLength(chunk, offset);
+    instruction->target = -1;
+    isStart[offset] = true;
+
+    if (offset + instruction->length > chunk->count) {
+      valid = false;
+      break;
+    }
+
+    int end = offset + instruction->length;
+    switch (instruction->opcode) {
+    case OP_JUMP:
+    case OP_JUMP_IF_FALSE:
+      instruction->target = end + readShort(chunk, offset + 1);
+      break;
+    case OP_LOOP:
+      instruction->target = end - readShort(chunk, offset + 1);
+      break;
+    default:
+      break;
+    }
+    if (instruction->target < -1 || instruction->target > chunk->count) {
+      valid = false;
+    }
+    offset = end;
+  }
+  isStart[chunk->count] = true;
+
+  for (int i = 0; i < p->instructionCount && valid; i++) {
+    int target = p->instructions[i].target;
+    if (target == -1) continue;
+    if (!isStart[target]) {
+      valid = false;
+      break;
+    }
+    p->isTarget[target] = true;
+    // A fused conditional jump skips the POP it lands on, so the instruction
+    // after that POP becomes a target too
+    if (p->instructions[i].opcode == OP_JUMP_IF_FALSE &&
+        target < chunk->count && chunk->code[target] == OP_POP) {
+      p->isTarget[target + 1] = true;
+    }
+  }
+
+  FREE_ARRAY(vm, bool, isStart, chunk->count + 1);
+  return valid;
+}
+
+static uint8_t opcodeAt(Peephole* p, int index) {
+  if (index >= p->instructionCount) return OP_RETURN;
+  return p->instructions[index].opcode;
+}
+
+static uint8_t operandAt(Peephole* p, int index, int byte) {
+  return p->chunk->code[p->instructions[index].offset + 1 + byte];
+}
+
+static int lineAt(Peephole* p, int index) {
+  return getLine(p->chunk, p->instructions[index].offset);
+}
+
+// True if instructions [index, index + length) exist and only the first one
+// can be jumped to
+static bool isStraightLine(Peephole* p, int index, int length) {
+  if (index + length > p->instructionCount) return false;
+  for (int i = index + 1; i < index + length; i++) {
+    if (p->isTarget[p->instructions[i].offset]) return false;
+  }
+  return true;
+}
+
+// JUMP_IF_FALSE whose target is a POP, which is how every statement emits it
+static bool isPoppingJump(Peephole* p, int index) {
+  if (opcodeAt(p, index) != OP_JUMP_IF_FALSE) return false;
+  int target = p->instructions[index].target;
+  return target < p->chunk->count && p->chunk->code[target] == OP_POP;
+}
+
+// Every byte of a fused instruction carries the line of the instruction that
+// can raise the runtime error, runtimeError() looks at the last byte read
+static void emit(Peephole* p, uint8_t byte, int line) {
+  p->code[p->count] = byte;
+  p->lines[p->count] = line;
+  p->count++;
+}
+
+// Two placeholder bytes, filled in once every new offset is known
+static void emitJumpTo(Peephole* p, int oldTarget, bool backward, int line) {
+  JumpFixup* fixup = &p->fixups[p->fixupCount++];
+  fixup->operand = p->count;
+  fixup->end = p->count + 2;
+  fixup->oldTarget = oldTarget;
+  fixup->backward = backward;
+  emit(p, 0xff, line);
+  emit(p, 0xff, line);
+}
+
+// Tries every pattern at index, returns how many instructions were consumed
+// (0 if nothing matched)
+static int fuse(Peephole* p, int index) {
+  uint8_t first = opcodeAt(p, index);
+
+  // GET_LOCAL a, GET_LOCAL b | CONSTANT k, LESS, JUMP_IF_FALSE, POP
+  if (first == OP_GET_LOCAL &&
+      (opcodeAt(p, index + 1) == OP_GET_LOCAL ||
+       opcodeAt(p, index + 1) == OP_CONSTANT) &&
+      opcodeAt(p, index + 2) == OP_LESS && isPoppingJump(p, index + 3) &&
+      opcodeAt(p, index + 4) == OP_POP && isStraightLine(p, index, 5)) {
+    int line = lineAt(p, index + 2);
+    emit(p,
+         opcodeAt(p, index + 1) == OP_GET_LOCAL
+             ? OP_JUMP_IF_NOT_LESS_LOCALS
+             : OP_JUMP_IF_NOT_LESS_LOCAL_CONST,
+         line);
+    emit(p, operandAt(p, index, 0), line);
+    emit(p, operandAt(p, index + 1, 0), line);
+    emitJumpTo(p, p->instructions[index + 3].target + 1, false, line);
+    return 5;
+  }
+
+  // JUMP_IF_FALSE, POP with a POP waiting at the target as well
+  if (isPoppingJump(p, index) && opcodeAt(p, index + 1) == OP_POP &&
+      isStraightLine(p, index, 2)) {
+    int line = lineAt(p, index);
+    emit(p, OP_POP_JUMP_IF_FALSE, line);
+    emitJumpTo(p, p->instructions[index].target + 1, false, line);
+    return 2;
+  }
+
+  // GET_LOCAL a, CONSTANT k, ADD
+  if (first == OP_GET_LOCAL && opcodeAt(p, index + 1) == OP_CONSTANT &&
+      opcodeAt(p, index + 2) == OP_ADD && isStraightLine(p, index, 3)) {
+    int line = lineAt(p, index + 2);
+    emit(p, OP_ADD_LOCAL_CONST, line);
+    emit(p, operandAt(p, index, 0), line);
+    emit(p, operandAt(p, index + 1, 0), line);
+    return 3;
+  }
+
+  // SET_LOCAL a, POP
+  if (first == OP_SET_LOCAL && opcodeAt(p, index + 1) == OP_POP &&
+      isStraightLine(p, index, 2)) {
+    int line = lineAt(p, index);
+    emit(p, OP_SET_LOCAL_POP, line);
+    emit(p, operandAt(p, index, 0), line);
+    return 2;
+  }
+
+  return 0;
+}
+
+// Copies an instruction as is, re-encoding its jump if it has one
+static void copyInstruction(Peephole* p, int index) {
+  Instruction* instruction = &p->instructions[index];
+  Chunk* chunk = p->chunk;
+
+  if (instruction->target != -1) {
+    int line = getLine(chunk, instruction->offset);
+    emit(p, instruction->opcode, line);
+    emitJumpTo(p, instruction->target, instruction->opcode == OP_LOOP,
+               getLine(chunk, instruction->offset + 1));
+    return;
+  }
+
+  for (int i = 0; i < instruction->length; i++) {
+    emit(p, chunk->code[instruction->offset + i],
+         getLine(chunk, instruction->offset + i));
+  }
+}
+
+void optimizeChunk(VM* vm, Chunk* chunk) {
+  if (chunk->count == 0) return;
+
+  // The scratch arrays are sized for the original code
+  int count = chunk->count;
+  Peephole p;
+  p.chunk = chunk;
+  p.instructions = ALLOCATE(vm, Instruction, count);
+  p.instructionCount = 0;
+  p.isTarget = ALLOCATE(vm, bool, count + 1);
+  p.code = ALLOCATE(vm, uint8_t, count);
+  p.lines = ALLOCATE(vm, int, count);
+  p.count = 0;
+  p.newOffsets = ALLOCATE(vm, int, count + 1);
+  p.fixups = ALLOCATE(vm, JumpFixup, count);
+  p.fixupCount = 0;
+
+  if (decode(vm, &p)) {
+    for (int i = 0; i < p.instructionCount;) {
+      int start = p.count;
+      int consumed = fuse(&p, i);
+      if (consumed == 0) {
+        copyInstruction(&p, i);
+        consumed = 1;
+      }
+      // Only the first instruction of a fused run can be a target, the rest
+      // map to the same offset to keep the table total
+      for (int j = i; j < i + consumed; j++) {
+        p.newOffsets[p.instructions[j].offset] = start;
+      }
+      i += consumed;
+    }
+    p.newOffsets[count] = p.count;
+
+    for (int i = 0; i < p.fixupCount; i++) {
+      JumpFixup* fixup = &p.fixups[i];
+      int target = p.newOffsets[fixup->oldTarget];
+      int jump = fixup->backward ? fixup->end - target : target - fixup->end;
+      p.code[fixup->operand] = (jump >> 8) & 0xff;
+      p.code[fixup->operand + 1] = jump & 0xff;
+    }
+
+    // The code only gets shorter, so rewriting it never grows the chunk,
+    // only the line runs are rebuilt
+    truncateChunk(chunk, 0);
+    for (int i = 0; i < p.count; i++) {
+      writeChunk(vm, chunk, p.code[i], p.lines[i]);
+    }
+  }
+
+  FREE_ARRAY(vm, Instruction, p.instructions, count);
+  FREE_ARRAY(vm, bool, p.isTarget, count + 1);
+  FREE_ARRAY(vm, uint8_t, p.code, count);
+  FREE_ARRAY(vm, int, p.lines, count);
+  FREE_ARRAY(vm, int, p.newOffsets, count + 1);
+  FREE_ARRAY(vm, JumpFixup, p.fixups, count);
+}
@@ -0,0 +1,198 @@
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "output.h"
+
+bool writeToDescriptor(void* context, const char* bytes, size_t length) {
+  int descriptor = (int)(intptr_t)context;
+  // The disassembler, the trace and the REPL prompt still printf() to
+  // stdout, their text has to come out first
+  if (descriptor == STDOUT_FILENO) fflush(stdout);
+
+  while (length > 0) {
+    ssize_t written = write(descriptor, bytes, length);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return false;
+    }
+    bytes += written;
+    length -= (size_t)written;
+  }
+  return true;
+}
+
+bool writeToMemory(void* context, const char* bytes, size_t length) {
+  OutputMemory* memory = (OutputMemory*)context;
+  if (memory->capacity - memory->length < length) {
+    size_t capacity = memory->capacity < 64 ? 64 : memory->capacity;
+    while (capacity - memory->length < length) capacity *= 2;
+
+    char* data = (char*)realloc(memory->data, capacity);
+    if (data == NULL) return false;
+    memory->data = data;
+    memory->capacity = capacity;
+  }
+  memcpy(memory->data + memory->length, bytes, length);
+  memory->length += length;
+  return true;
+}
+
+void initOutput(Output* output) {
+  output->buffer = NULL;
+  output->count = 0;
+  output->capacity = 0;
+  output->sink = writeToDescriptor;
+  output->context = (void*)(intptr_t)STDOUT_FILENO;
+  output->lineBuffered = isatty(STDOUT_FILENO);
+  output->failed = false;
+}
+
+void freeOutput(Output* output) {
+  flushOutput(output);
+  free(output->buffer);
+  output->buffer = NULL;
+  output->capacity = 0;
+}
+
+void setOutput(Output* output, OutputSink sink, void* context) {
+  flushOutput(output);
+  output->sink = sink;
+  output->context = context;
+  output->lineBuffered = false;
+  output->failed = false;
+}
+
+static void emit(Output* output, const char* bytes, size_t length) {
+  if (output->failed || length == 0) return;
+  if (!output->sink(output->context, bytes, length)) output->failed = true;
+}
+
+void flushOutput(Output* output) {
+  emit(output, output->buffer, output->count);
+  output->count = 0;
+}
+
+// Up to the last newline, the unfinished line moves to the front. A buffer
+// without a newline goes out whole
+static void flushLines(Output* output) {
+  size_t end = output->count;
+  while (end > 0 && output->buffer[end - 1] != '\n') end--;
+  if (end == 0) end = output->count;
+
+  emit(output, output->buffer, end);
+  output->count -= end;
+  memmove(output->buffer, output->buffer + end, output->count);
+}
+
+void writeOutputSlow(Output* output, const char* bytes, size_t length) {
+  if (output->failed) {
+    output->count = 0;
+    return;
+  }
+  if (output->buffer == NULL) {
+    output->buffer = (char*)malloc(OUTPUT_BUFFER_SIZE);
+    if (output->buffer == NULL) {
+      fprintf(stderr, "Failed to allocate the output buffer\n");
+      exit(1);
+    }
+    output->capacity = OUTPUT_BUFFER_SIZE;
+  } else {
+    flushLines(output);
+  }
+
+  if (length < output->capacity - output->count) {
+    memcpy(output->buffer + output->count, bytes, length);
+    output->count += length;
+    return;
+  }
+  // Doesn't fit even then, it goes out on its own
+  flushOutput(output);
+  emit(output, bytes, length);
+}
+
+// Big enough for anything printf("%g") makes of a double
+#define NUMBER_MAX 32
+
+static const double powersOfTen[] = {
+  1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9,
+};
+// Where the decimal exponents -4 to 5 start
+static const double decades[] = {
+  1e-4, 1e-3, 1e-2, 1e-1, 1e0, 1e1, 1e2, 1e3, 1e4, 1e5,
+};
+
+/*
+%g rounds to 6 significant digits and, for decimal exponents from -4 to 5,
+prints them positionally with the trailing zeros cut off. That covers all
+the numbers scripts usually print, they're scaled to a 6 digit integer
+instead, which is exact: the scale is a power of ten up to 1e9 and the one
+rounding of the multiply is far below the 0.5 the digits are rounded at.
+Anything else (infinities and NaN, other magnitudes, a product that lands
+too close to halfway to round the same as the exact decimal value does) goes
+to snprintf().
+*/
+static int formatNumber(double number, char* out) {
+  char* start = out;
+  if (number == 0) {
+    if (signbit(number)) *out++ = '-';
+    *out++ = '0';
+    return (int)(out - start);
+  }
+
+  // NaN fails every comparison below, it would reach the integer conversion
+  if (isnan(number) || isinf(number)) {
+    return snprintf(out, NUMBER_MAX, "%g", number);
+  }
+
+  double magnitude = fabs(number);
+  int exponent = 5;
+  while (exponent >= -4 && magnitude < decades[exponent + 4]) exponent--;
+  if (exponent < -4 || magnitude >= 1e6) {
+    return snprintf(out, NUMBER_MAX, "%g", number);
+  }
+
+  // Below 1e6, the integer part fits
+  double scaled = magnitude * powersOfTen[5 - exponent];
+  uint32_t significand = (uint32_t)scaled;
+  double fraction = scaled - significand;
+  if (fabs(fraction - 0.5) < 1e-6) {
+    return snprintf(out, NUMBER_MAX, "%g", number);
+  }
+  if (fraction > 0.5) significand++;
+  // Rounded up into the next decade, %g would pick the exponent after it
+  if (significand < 100000 || significand > 999999) {
+    return snprintf(out, NUMBER_MAX, "%g", number);
+  }
+
+  char digits[6];
+  for (int i = 5; i >= 0; i--) {
+    digits[i] = (char)('0' + significand % 10);
+    significand /= 10;
+  }
+  int last = 5;
+  while (digits[last] == '0') last--;
+
+  if (number < 0) *out++ = '-';
+  if (exponent >= 0) {
+    for (int i = 0; i <= exponent; i++) *out++ = digits[i];
+    if (last > exponent) {
+      *out++ = '.';
+      for (int i = exponent + 1; i <= last; i++) *out++ = digits[i];
+    }
+  } else {
+    *out++ = '0';
+    *out++ = '.';
+    for (int i = -1; i > exponent; i--) *out++ = '0';
+    for (int i = 0; i <= last; i++) *out++ = digits[i];
+  }
+  return (int)(out - start);
+}
+
+void writeNumber(Output* output, double number) {
+  char text[NUMBER_MAX];
+  int length = formatNumber(number, text);
+  writeOutput(output, text, (size_t)length);
+}
@@ -0,0 +1,292 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "debug.h"
+#include "profiler.h"
+#include "vm.h"
+
+#ifdef PROFILE
+
+/*
+Everything here is allocated with plain malloc(), never through reallocate(),
+so the profiler can't start a collection in the middle of an instruction and
+its memory doesn't show up in the GC numbers.
+*/
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return (double)time.tv_sec + (double)time.tv_nsec / 1e9;
+}
+
+void startProfiler(VM* vm, const char* path) {
+  Profiler* profiler = calloc(1, sizeof(Profiler));
+  if (profiler == NULL) {
+    fprintf(stderr, "Failed to allocate the profiler\n");
+    exit(1);
+  }
+  vm->profiler = profiler;
+  profiler->path = path;
+  profiler->lastInstruction = PROFILE_NO_INSTRUCTION;
+  profiler->startTime = now();
+  profiler->startTick = profileClock();
+  profiler->lastTick = profiler->startTick;
+  profiler->nextSample = profiler->startTick + PROFILE_SAMPLE_TICKS;
+}
+
+static const char* functionName(ObjFunction* function) {
+  return function->name == NULL ? "script" : function->name->chars;
+}
+
+// A shared function is never written to, its profile is looked up instead.
+// Programs are small and profiling is slow anyway
+static FunctionProfile* findShared(Profiler* profiler, ObjFunction* function) {
+  for (FunctionProfile* profile = profiler->functions; profile != NULL;
+       profile = profile->next) {
+    if (profile->shared == function) return profile;
+  }
+  return NULL;
+}
+
+static FunctionProfile* profileFor(Profiler* profiler, ObjFunction* function) {
+  if (function->isShared) {
+    FunctionProfile* profile = findShared(profiler, function);
+    if (profile != NULL) return profile;
+  } else if (function->profile != NULL) {
+    return function->profile;
+  }
+
+  FunctionProfile* profile = calloc(1, sizeof(FunctionProfile));
+  const char* name = functionName(function);
+  profile->name = malloc(strlen(name) + 1);
+  strcpy(profile->name, name);
+  profile->next = profiler->functions;
+  profiler->functions = profile;
+  if (function->isShared) {
+    profile->shared = function;
+  } else {
+    function->profile = profile;
+  }
+  return profile;
+}
+
+void profileEnter(VM* vm, ObjFunction* function) {
+  FunctionProfile* profile = profileFor(vm->profiler, function);
+  profile->calls++;
+  if (profile->depth++ == 0) profile->enteredAt = profileClock();
+}
+
+void profileExit(VM* vm, ObjFunction* function) {
+  FunctionProfile* profile = function->isShared
+                                 ? findShared(vm->profiler, function)
+                                 : function->profile;
+  // Frames pushed before the profiler started were never entered
+  if (profile == NULL || profile->depth == 0) return;
+  if (--profile->depth == 0) {
+    profile->ticks += profileClock() - profile->enteredAt;
+  }
+}
+
+// Plain FNV-1a, a stack is only hashed once per sample
+static uint64_t hashStack(const char* stack, size_t length) {
+  uint64_t hash = 14695981039346656037u;
+  for (size_t i = 0; i < length; i++) {
+    hash ^= (uint8_t)stack[i];
+    hash *= 1099511628211u;
+  }
+  return hash;
+}
+
+static StackSample* findSample(StackSample* samples, int capacity,
+                               const char* stack, uint64_t hash) {
+  uint32_t index = (uint32_t)hash & (capacity - 1);
+  for (;;) {
+    StackSample* sample = &samples[index];
+    if (sample->stack == NULL ||
+        (sample->hash == hash && strcmp(sample->stack, stack) == 0)) {
+      return sample;
+    }
+    index = (index + 1) & (capacity - 1);
+  }
+}
+
+static void growSamples(Profiler* profiler) {
+  int capacity = profiler->sampleCapacity < 64 ? 64
+                                              : profiler->sampleCapacity * 2;
+  StackSample* samples = calloc(capacity, sizeof(StackSample));
+  for (int i = 0; i < profiler->sampleCapacity; i++) {
+    StackSample* sample = &profiler->samples[i];
+    if (sample->stack == NULL) continue;
+    *findSample(samples, capacity, sample->stack, sample->hash) = *sample;
+  }
+  free(profiler->samples);
+  profiler->samples = samples;
+  profiler->sampleCapacity = capacity;
+}
+
+void sampleStack(VM* vm, uint64_t now) {
+  Profiler* profiler = vm->profiler;
+  profiler->nextSample = now + PROFILE_SAMPLE_TICKS;
+  if (vm->frameCount == 0) return;
+
+  // Outermost frame first, the order flamegraph.pl expects
+  size_t length = 0;
+  for (int i = 0; i < vm->frameCount; i++) {
+    length += strlen(functionName(vm->frames[i].closure->function)) + 1;
+  }
+  char* stack = malloc(length);
+  char* end = stack;
+  for (int i = 0; i < vm->frameCount; i++) {
+    const char* name = functionName(vm->frames[i].closure->function);
+    size_t nameLength = strlen(name);
+    memcpy(end, name, nameLength);
+    end += nameLength;
+    *end++ = ';';
+  }
+  end[-1] = '\0';
+
+  if (profiler->sampleCount + 1 > profiler->sampleCapacity * 3 / 4) {
+    growSamples(profiler);
+  }
+
+  uint64_t hash = hashStack(stack, length - 1);
+  StackSample* sample = findSample(profiler->samples, profiler->sampleCapacity,
+                                   stack, hash);
+  if (sample->stack == NULL) {
+    sample->stack = stack;
+    sample->hash = hash;
+    profiler->sampleCount++;
+  } else {
+    free(stack);
+  }
+  sample->count++;
+}
+
+// ============================================================================
+// REPORT
+// ============================================================================
+
+typedef struct {
+  uint8_t instruction;
+  uint64_t ticks;
+} InstructionTicks;
+
+// Busiest opcode first
+static int compareInstructions(const void* a, const void* b) {
+  uint64_t left = ((const InstructionTicks*)a)->ticks;
+  uint64_t right = ((const InstructionTicks*)b)->ticks;
+  return left < right ? 1 : left > right ? -1 : 0;
+}
+
+static int compareFunctions(const void* a, const void* b) {
+  uint64_t left = (*(FunctionProfile* const*)a)->ticks;
+  uint64_t right = (*(FunctionProfile* const*)b)->ticks;
+  return left < right ? 1 : left > right ? -1 : 0;
+}
+
+static void writeSamples(Profiler* profiler) {
+  FILE* file = fopen(profiler->path, "w");
+  if (file == NULL) {
+    fprintf(stderr, "Could not write profile \"%s\".\n", profiler->path);
+    return;
+  }
+  for (int i = 0; i < profiler->sampleCapacity; i++) {
+    StackSample* sample = &profiler->samples[i];
+    if (sample->stack == NULL) continue;
+    fprintf(file, "%s %llu\n", sample->stack,
+            (unsigned long long)sample->count);
+  }
+  fclose(file);
+}
+
+static void printInstructions(Profiler* profiler, double ticksPerSecond,
+                              uint64_t totalTicks) {
+  InstructionTicks order[UINT8_COUNT];
+  int count = 0;
+  uint64_t dispatched = 0;
+  for (int i = 0; i < UINT8_COUNT; i++) {
+    if (profiler->instructionCounts[i] == 0) continue;
+    order[count].instruction = (uint8_t)i;
+    order[count++].ticks = profiler->instructionTicks[i];
+    dispatched += profiler->instructionCounts[i];
+  }
+  qsort(order, count, sizeof(InstructionTicks), compareInstructions);
+
+  fprintf(stderr, "[profile] %llu instructions\n",
+          (unsigned long long)dispatched);
+  fprintf(stderr, "[profile] %-32s %12s %6s %10s %6s %8s\n", "opcode", "count",
+          "%", "ms", "%", "ns/op");
+  for (int i = 0; i < count; i++) {
+    uint8_t instruction = order[i].instruction;
+    uint64_t executed = profiler->instructionCounts[instruction];
+    uint64_t ticks = profiler->instructionTicks[instruction];
+    const char* name = opcodeName(instruction);
+    double seconds = (double)ticks / ticksPerSecond;
+    fprintf(stderr, "[profile] %-32s %12llu %6.2f %10.3f %6.2f %8.2f\n",
+            name != NULL ? name : "?", (unsigned long long)executed,
+            100.0 * (double)executed / (double)dispatched, seconds * 1e3,
+            100.0 * (double)ticks / (double)totalTicks,
+            seconds * 1e9 / (double)executed);
+  }
+}
+
+static void printFunctions(Profiler* profiler, double ticksPerSecond,
+                           uint64_t totalTicks) {
+  int count = 0;
+  for (FunctionProfile* profile = profiler->functions; profile != NULL;
+       profile = profile->next) {
+    count++;
+  }
+  FunctionProfile** order = malloc(sizeof(FunctionProfile*) * (count + 1));
+  count = 0;
+  for (FunctionProfile* profile = profiler->functions; profile != NULL;
+       profile = profile->next) {
+    order[count++] = profile;
+  }
+  qsort(order, count, sizeof(FunctionProfile*), compareFunctions);
+
+  fprintf(stderr, "[profile] %-32s %12s %10s %6s\n", "function (inclusive)",
+          "calls", "ms", "%");
+  for (int i = 0; i < count; i++) {
+    fprintf(stderr, "[profile] %-32s %12llu %10.3f %6.2f\n", order[i]->name,
+            (unsigned long long)order[i]->calls,
+            (double)order[i]->ticks / ticksPerSecond * 1e3,
+            100.0 * (double)order[i]->ticks / (double)totalTicks);
+  }
+  free(order);
+}
+
+void stopProfiler(VM* vm) {
+  if (!PROFILING(vm)) return;
+  Profiler* profiler = vm->profiler;
+
+  // Ticks are only comparable to each other, the wall clock over the same
+  // span turns them into seconds
+  uint64_t totalTicks = profileClock() - profiler->startTick;
+  double elapsed = now() - profiler->startTime;
+  if (totalTicks == 0) totalTicks = 1;
+  double ticksPerSecond = elapsed > 0 ? (double)totalTicks / elapsed : 1e9;
+
+  writeSamples(profiler);
+  fprintf(stderr, "[profile] %.3f ms, %d distinct stacks written to %s\n",
+          elapsed * 1e3, profiler->sampleCount, profiler->path);
+  printInstructions(profiler, ticksPerSecond, totalTicks);
+  printFunctions(profiler, ticksPerSecond, totalTicks);
+
+  for (int i = 0; i < profiler->sampleCapacity; i++) {
+    free(profiler->samples[i].stack);
+  }
+  free(profiler->samples);
+  while (profiler->functions != NULL) {
+    FunctionProfile* next = profiler->functions->next;
+    free(profiler->functions->name);
+    free(profiler->functions);
+    profiler->functions = next;
+  }
+  free(profiler);
+  vm->profiler = NULL;
+}
+
+#endif
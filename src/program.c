@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "program.h"
+#include "table.h"
+#include "vm.h"
+
+struct Program {
+  // Owns every object of the program. It compiles the source and never runs
+  // anything, so nothing in its heap changes after freeze()
+  VM owner;
+  ObjFunction* function;
+};
+
+// The top level function and everything nested in it, in plain malloc()
+// memory so gathering them can't start a collection
+typedef struct {
+  ObjFunction** functions;
+  int count;
+  int capacity;
+} FunctionList;
+
+// Nested functions are only ever constants of the function they're declared
+// in, and function constants are never merged, so each one is seen once
+static void gatherFunctions(FunctionList* list, ObjFunction* function) {
+  if (list->capacity < list->count + 1) {
+    list->capacity = GROW_CAPACITY(list->capacity);
+    list->functions = (ObjFunction**)realloc(
+        list->functions, sizeof(ObjFunction*) * list->capacity);
+    if (list->functions == NULL) {
+      fprintf(stderr, "Failed to allocate the program's function list\n");
+      exit(1);
+    }
+  }
+  list->functions[list->count++] = function;
+
+  ValueArray* constants = &function->chunk.constants;
+  for (int i = 0; i < constants->count; i++) {
+    if (IS_FUNCTION(constants->values[i])) {
+      gatherFunctions(list, AS_FUNCTION(constants->values[i]));
+    }
+  }
+}
+
+static void markShared(Obj* object) {
+  for (; object != NULL; object = object->next) {
+    object->isMarked = true;
+#ifdef GC_GENERATIONAL
+    // Old objects are never traced by minor collections and storing one
+    // anywhere never needs the write barrier
+    object->isOld = true;
+#endif
+  }
+}
+
+static void freeze(Program* program) {
+  VM* vm = &program->owner;
+  FunctionList list = {NULL, 0, 0};
+  gatherFunctions(&list, program->function);
+
+  // The shared closures are the last objects the program gets. The creating
+  // can collect, the function on the stack keeps the whole program alive
+  push(vm, OBJ_VAL(program->function));
+  for (int i = 0; i < list.count; i++) {
+    ObjFunction* function = list.functions[i];
+    if (function->upvalueCount == 0 && function->shared == NULL) {
+      function->shared = newClosure(vm, function);
+      WRITE_BARRIER(vm, function, OBJ_VAL(function->shared));
+    }
+  }
+  // Whatever the compile left behind is freed now rather than kept forever
+  collectGarbage(vm);
+  pop(vm);
+
+  for (int i = 0; i < list.count; i++) {
+    list.functions[i]->isShared = true;
+#ifdef JIT
+    compileJit(list.functions[i]);
+#endif
+  }
+  free(list.functions);
+
+  markShared(vm->objects);
+#ifdef GC_GENERATIONAL
+  markShared(vm->oldObjects);
+#endif
+}
+
+Program* compileProgram(const char* source) {
+  Program* program = (Program*)malloc(sizeof(Program));
+  if (program == NULL) {
+    fprintf(stderr, "Failed to allocate a program\n");
+    exit(1);
+  }
+  // The compiler only ever pushes a few temporary roots
+  initVMWithLimits(&program->owner, 1, UINT8_COUNT);
+  program->function = compile(&program->owner, source);
+  if (program->function == NULL) {
+    freeVM(&program->owner);
+    free(program);
+    return NULL;
+  }
+
+  freeze(program);
+  return program;
+}
+
+// Every string of the program becomes the one vm interns for its characters,
+// the bytecode compares strings by identity
+static void internStrings(VM* vm, Program* program) {
+  Table* strings = &program->owner.strings;
+  for (int i = 0; i < strings->capacity; i++) {
+    ObjString* string = strings->entries[i].key;
+    if (string == NULL) continue;
+
+    ObjString* interned = tableFindString(&vm->strings, string->chars,
+                                          string->length, string->hash);
+    if (interned == string) continue;
+    if (interned != NULL) tableDelete(&vm->strings, interned);
+    tableSet(vm, &vm->strings, string, NIL_VAL);
+  }
+}
+
+// The name in every slot of a global table, a reverse index of names
+static ObjString** slotNames(Table* names, int count) {
+  ObjString** slots = (ObjString**)calloc(count + 1, sizeof(ObjString*));
+  if (slots == NULL) {
+    fprintf(stderr, "Failed to allocate %d global names\n", count);
+    exit(1);
+  }
+  for (int i = 0; i < names->capacity; i++) {
+    Entry* entry = &names->entries[i];
+    if (entry->key != NULL) slots[(int)AS_NUMBER(entry->value)] = entry->key;
+  }
+  return slots;
+}
+
+static bool sameName(ObjString* a, ObjString* b) {
+  return a->length == b->length && memcmp(a->chars, b->chars, a->length) == 0;
+}
+
+/*
+Global slots are baked into the bytecode, so vm has to end up with every
+global of the program in the slot it was compiled against. The slots vm
+already has (its natives, or the program's own from an earlier run) have to
+hold the same names, the rest are reserved in order.
+*/
+static bool bindGlobals(VM* vm, Program* program) {
+  int count = program->owner.globalValues.count;
+  int bound = vm->globalValues.count;
+  ObjString** names = slotNames(&program->owner.globalNames, count);
+  ObjString** existing = slotNames(&vm->globalNames, bound);
+
+  bool matches = true;
+  for (int slot = 0; slot < count && matches; slot++) {
+    ObjString* name = names[slot];
+    if (slot >= bound) {
+      resolveGlobal(vm, name);
+    } else if (existing[slot] == NULL || !sameName(existing[slot], name)) {
+      fprintf(stderr, "Global slot %d is already '%s', the program needs "
+                      "'%s' there.\n",
+              slot, existing[slot] == NULL ? "" : existing[slot]->chars,
+              name->chars);
+      matches = false;
+    } else if (existing[slot] != name) {
+      // Same characters, but vm's own copy. Lookups go by identity
+      tableDelete(&vm->globalNames, existing[slot]);
+      tableSet(vm, &vm->globalNames, name, NUMBER_VAL((double)slot));
+    }
+  }
+
+  free(names);
+  free(existing);
+  return matches;
+}
+
+InterpretResult runProgram(VM* vm, Program* program) {
+  internStrings(vm, program);
+  if (!bindGlobals(vm, program)) return INTERPRET_RUNTIME_ERROR;
+  return interpretFunction(vm, program->function);
+}
+
+void freeProgram(Program* program) {
+  freeVM(&program->owner);
+  free(program);
+}
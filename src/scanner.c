@@ -1,3 +1,4 @@
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -5,52 +6,110 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct {
-  const char* start;   // marks beginning of lexeme
-  const char* current; // marks current char
-  int line;            // marks current line
-} Scanner;
+void initScanner(Scanner* scanner, const char* source) {
+  scanner->start = source;
+  scanner->current = source;
+  // Known up front so comments and strings can be searched with memchr()
+  scanner->end = source + strlen(source);
+  scanner->line = 1;
+}
 
-Scanner scanner;
+/*
+Character classes, one table lookup per byte instead of a chain of range
+checks
+*/
+#define CHAR_ALPHA 1 // a-z A-Z _
+#define CHAR_DIGIT 2
+#define CHAR_SPACE 4 // ' ' \t \r \n
+
+// clang-format off
+static const uint8_t charClass[256] = {
+  ['\t'] = CHAR_SPACE, ['\n'] = CHAR_SPACE, ['\r'] = CHAR_SPACE,
+  [' '] = CHAR_SPACE,
+  ['0'] = CHAR_DIGIT, ['1'] = CHAR_DIGIT, ['2'] = CHAR_DIGIT,
+  ['3'] = CHAR_DIGIT, ['4'] = CHAR_DIGIT, ['5'] = CHAR_DIGIT,
+  ['6'] = CHAR_DIGIT, ['7'] = CHAR_DIGIT, ['8'] = CHAR_DIGIT,
+  ['9'] = CHAR_DIGIT,
+  ['A'] = CHAR_ALPHA, ['B'] = CHAR_ALPHA, ['C'] = CHAR_ALPHA,
+  ['D'] = CHAR_ALPHA, ['E'] = CHAR_ALPHA, ['F'] = CHAR_ALPHA,
+  ['G'] = CHAR_ALPHA, ['H'] = CHAR_ALPHA, ['I'] = CHAR_ALPHA,
+  ['J'] = CHAR_ALPHA, ['K'] = CHAR_ALPHA, ['L'] = CHAR_ALPHA,
+  ['M'] = CHAR_ALPHA, ['N'] = CHAR_ALPHA, ['O'] = CHAR_ALPHA,
+  ['P'] = CHAR_ALPHA, ['Q'] = CHAR_ALPHA, ['R'] = CHAR_ALPHA,
+  ['S'] = CHAR_ALPHA, ['T'] = CHAR_ALPHA, ['U'] = CHAR_ALPHA,
+  ['V'] = CHAR_ALPHA, ['W'] = CHAR_ALPHA, ['X'] = CHAR_ALPHA,
+  ['Y'] = CHAR_ALPHA, ['Z'] = CHAR_ALPHA, ['_'] = CHAR_ALPHA,
+  ['a'] = CHAR_ALPHA, ['b'] = CHAR_ALPHA, ['c'] = CHAR_ALPHA,
+  ['d'] = CHAR_ALPHA, ['e'] = CHAR_ALPHA, ['f'] = CHAR_ALPHA,
+  ['g'] = CHAR_ALPHA, ['h'] = CHAR_ALPHA, ['i'] = CHAR_ALPHA,
+  ['j'] = CHAR_ALPHA, ['k'] = CHAR_ALPHA, ['l'] = CHAR_ALPHA,
+  ['m'] = CHAR_ALPHA, ['n'] = CHAR_ALPHA, ['o'] = CHAR_ALPHA,
+  ['p'] = CHAR_ALPHA, ['q'] = CHAR_ALPHA, ['r'] = CHAR_ALPHA,
+  ['s'] = CHAR_ALPHA, ['t'] = CHAR_ALPHA, ['u'] = CHAR_ALPHA,
+  ['v'] = CHAR_ALPHA, ['w'] = CHAR_ALPHA, ['x'] = CHAR_ALPHA,
+  ['y'] = CHAR_ALPHA, ['z'] = CHAR_ALPHA,
+};
+// clang-format on
+
+static inline bool isClass(char c, uint8_t classes) {
+  return (charClass[(uint8_t)c] & classes) != 0;
+}
+static bool isDigit(char c) { return isClass(c, CHAR_DIGIT); }
+static bool isAlpha(char c) { return isClass(c, CHAR_ALPHA); }
 
-void initScanner(const char* source) {
-  scanner.start = source;
-  scanner.current = source;
-  scanner.line = 1;
+/*
+Whitespace and identifier runs are rarely more than a few bytes long, too
+short for wide loads to win anything (measured with `make bench-scanner`), so
+they are walked through the table. Comments and strings are the long runs and
+go through memchr() instead.
+*/
+
+// Skips ' ', \t, \r and \n from p on, counting the lines it passes
+static const char* skipSpaces(Scanner* scanner, const char* p) {
+  while (isClass(*p, CHAR_SPACE)) {
+    if (*p == '\n') scanner->line++;
+    p++;
+  }
+  return p;
 }
 
-static bool isDigit(char c) { return c >= '0' && c <= '9'; }
-static bool isAlpha(char c) {
-  return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+// First byte from p on that can't continue an identifier
+static const char* skipIdentifier(const char* p) {
+  while (isClass(*p, CHAR_ALPHA | CHAR_DIGIT)) p++;
+  return p;
 }
 
-static bool isAtEnd() { return *scanner.current == '\0'; }
-static char peek() { return *scanner.current; }
-static char peekNext() { return !isAtEnd() ? scanner.current[1] : '\0'; }
+static bool isAtEnd(Scanner* scanner) {
+  return scanner->current >= scanner->end;
+}
+static char peek(Scanner* scanner) { return *scanner->current; }
+static char peekNext(Scanner* scanner) {
+  return !isAtEnd(scanner) ? scanner->current[1] : '\0';
+}
 
-static char advance() {
-  scanner.current++;
-  return scanner.current[-1];
+static char advance(Scanner* scanner) {
+  scanner->current++;
+  return scanner->current[-1];
 }
-static bool match(char expected) {
-  if (isAtEnd()) return false;
-  if (*scanner.current != expected) return false;
+static bool match(Scanner* scanner, char expected) {
+  if (isAtEnd(scanner)) return false;
+  if (*scanner->current != expected) return false;
 
-  scanner.current++;
+  scanner->current++;
   return true;
 }
 
-static Token makeToken(TokenType type) {
+static Token makeToken(Scanner* scanner, TokenType type) {
   // Assign stack memory
   Token token;
   token.type = type;
-  token.start = scanner.start;
-  token.length = (int)(scanner.current - scanner.start);
-  token.line = scanner.line;
+  token.start = scanner->start;
+  token.length = (int)(scanner->current - scanner->start);
+  token.line = scanner->line;
   return token;
 }
 
-static Token errorToken(const char* message) {
+static Token errorToken(Scanner* scanner, const char* message) {
   Token token;
   token.type = TOKEN_ERROR;
   /*
@@ -59,191 +118,171 @@ static Token errorToken(const char* message) {
   */
   token.start = message;
   token.length = (int)strlen(message);
-  token.line = scanner.line;
+  token.line = scanner->line;
   return token;
 }
 
-static void skipWhitespace() {
+static void skipWhitespace(Scanner* scanner) {
   for (;;) {
-    char c = peek();
-
-    switch (c) {
-    case ' ':
-    case '\r':
-    case '\t':
-      advance();
-      break;
-    case '\n':
-      scanner.line++;
-      advance();
-      break;
-    case '/':
-      // Comments
-      if (peekNext() == '/') {
-        while (peek() != '\n' && !isAtEnd()) {
-          advance();
-        }
-      } else {
-        return;
-      }
-      break;
-    default:
+    // Most tokens are directly followed by the next one
+    if (isClass(peek(scanner), CHAR_SPACE)) {
+      scanner->current = skipSpaces(scanner, scanner->current);
+    }
+
+    if (peek(scanner) == '/' && peekNext(scanner) == '/') {
+      // Comments run up to the newline, which the next round skips
+      const char* newline =
+          memchr(scanner->current, '\n', scanner->end - scanner->current);
+      scanner->current = newline != NULL ? newline : scanner->end;
+    } else {
       return;
     }
   }
 }
 
-static TokenType checkKeyword(int start, int length, const char* rest,
-                              TokenType type) {
-
-  if (scanner.current - scanner.start == start + length &&
-      memcmp(scanner.start + start, rest, length) == 0) {
-    return type;
+/*
+Keywords are told apart by a perfect hash of their first two characters and
+their length, (c0 + c1 * 18 + length * 7) & 31 maps every keyword to its own
+slot (the constants were found by a brute force search). An identifier then
+costs one hash, one length check and at most one memcmp.
+*/
+typedef struct {
+  const char* name;
+  int length; // 0 for empty slots, which never match
+  TokenType type;
+} Keyword;
+
+#define KEYWORD_HASH(start, length)                                            \
+  (((uint8_t)(start)[0] + (uint8_t)(start)[1] * 18 + (length) * 7) & 31)
+
+// clang-format off
+static const Keyword keywords[32] = {
+  [0] = {"this", 4, TOKEN_THIS},
+  [1] = {"or", 2, TOKEN_OR},
+  [3] = {"if", 2, TOKEN_IF},
+  [5] = {"nil", 3, TOKEN_NIL},
+  [9] = {"for", 3, TOKEN_FOR},
+  [10] = {"while", 5, TOKEN_WHILE},
+  [16] = {"super", 5, TOKEN_SUPER},
+  [18] = {"and", 3, TOKEN_AND},
+  [20] = {"true", 4, TOKEN_TRUE},
+  [21] = {"fun", 3, TOKEN_FUN},
+  [22] = {"return", 6, TOKEN_RETURN},
+  [23] = {"print", 5, TOKEN_PRINT},
+  [25] = {"else", 4, TOKEN_ELSE},
+  [27] = {"false", 5, TOKEN_FALSE},
+  [29] = {"var", 3, TOKEN_VAR},
+  [30] = {"class", 5, TOKEN_CLASS},
+};
+// clang-format on
+
+static TokenType identifierType(Scanner* scanner) {
+  int length = (int)(scanner->current - scanner->start);
+  // Keywords are 2 to 6 characters long
+  if (length < 2 || length > 6) return TOKEN_IDENTIFIER;
+
+  const Keyword* keyword = &keywords[KEYWORD_HASH(scanner->start, length)];
+  if (keyword->length == length &&
+      memcmp(scanner->start, keyword->name, length) == 0) {
+    return keyword->type;
   }
-
   return TOKEN_IDENTIFIER;
 }
 
-static TokenType identifierType() {
-  switch (scanner.start[0]) {
-
-  case 'a':
-    return checkKeyword(1, 2, "nd", TOKEN_AND);
-  case 'c':
-    return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-  case 'e':
-    return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-  case 'f':
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
-      case 'a':
-        return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-      case 'o':
-        return checkKeyword(2, 1, "r", TOKEN_FOR);
-      case 'u':
-        return checkKeyword(2, 1, "n", TOKEN_FUN);
-      }
-    }
-    break;
-  case 'i':
-    return checkKeyword(1, 1, "f", TOKEN_IF);
-  case 'n':
-    return checkKeyword(1, 2, "il", TOKEN_NIL);
-  case 'o':
-    return checkKeyword(1, 1, "r", TOKEN_OR);
-  case 'p':
-    return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-  case 'r':
-    return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-
-  case 's':
-    return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-  case 't':
-    if (scanner.current - scanner.start > 1) {
-      switch (scanner.start[1]) {
-      case 'h':
-        return checkKeyword(2, 2, "is", TOKEN_THIS);
-      case 'r':
-        return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-      }
-    }
-    break;
-  case 'v':
-    return checkKeyword(1, 2, "ar", TOKEN_VAR);
-  case 'w':
-    return checkKeyword(1, 4, "hile", TOKEN_WHILE);
-  }
-
-  return TOKEN_IDENTIFIER;
-}
+static Token string(Scanner* scanner) {
+  const char* quote =
+      memchr(scanner->current, '"', scanner->end - scanner->current);
+  const char* stop = quote != NULL ? quote : scanner->end;
 
-static Token string() {
-  while (peek() != '"' && !isAtEnd()) {
-    if (peek() == '\n') scanner.line++;
-    advance();
+  // Strings can span lines
+  for (const char* newline = scanner->current;
+       (newline = memchr(newline, '\n', stop - newline)) != NULL; newline++) {
+    scanner->line++;
   }
+  scanner->current = stop;
 
-  if (isAtEnd()) return errorToken("Unterminated string.");
+  if (isAtEnd(scanner)) return errorToken(scanner, "Unterminated string.");
 
   // Eat the closing quote
-  advance();
-  return makeToken(TOKEN_STRING);
+  advance(scanner);
+  return makeToken(scanner, TOKEN_STRING);
 }
 
-static Token number() {
-  while (isDigit(peek())) {
-    advance();
+static Token number(Scanner* scanner) {
+  while (isDigit(peek(scanner))) {
+    advance(scanner);
   }
 
   // Look for fractions
-  if (peek() == '.' && isDigit(peekNext())) {
+  if (peek(scanner) == '.' && isDigit(peekNext(scanner))) {
     // consume the "."
-    advance();
+    advance(scanner);
 
-    while (isDigit(peek())) {
-      advance();
+    while (isDigit(peek(scanner))) {
+      advance(scanner);
     }
   }
 
-  return makeToken(TOKEN_NUMBER);
+  return makeToken(scanner, TOKEN_NUMBER);
 }
 
-static Token identifier() {
-  while (isAlpha(peek()) || isDigit(peek())) {
-    advance();
-  }
-
-  return makeToken(identifierType());
+static Token identifier(Scanner* scanner) {
+  scanner->current = skipIdentifier(scanner->current);
+  return makeToken(scanner, identifierType(scanner));
 }
 
 /*
 TODO: String interpolation "${expr}"
 */
-Token scanToken() {
-  skipWhitespace();
-  scanner.start = scanner.current;
+Token scanToken(Scanner* scanner) {
+  skipWhitespace(scanner);
+  scanner->start = scanner->current;
 
-  if (isAtEnd()) return makeToken(TOKEN_EOF);
+  if (isAtEnd(scanner)) return makeToken(scanner, TOKEN_EOF);
 
-  char c = advance();
+  char c = advance(scanner);
 
-  if (isAlpha(c)) return identifier();
-  if (isDigit(c)) return number();
+  if (isAlpha(c)) return identifier(scanner);
+  if (isDigit(c)) return number(scanner);
 
   switch (c) {
   case '(':
-    return makeToken(TOKEN_LEFT_PAREN);
+    return makeToken(scanner, TOKEN_LEFT_PAREN);
   case ')':
-    return makeToken(TOKEN_RIGHT_PAREN);
+    return makeToken(scanner, TOKEN_RIGHT_PAREN);
   case '{':
-    return makeToken(TOKEN_LEFT_BRACE);
+    return makeToken(scanner, TOKEN_LEFT_BRACE);
   case '}':
-    return makeToken(TOKEN_RIGHT_BRACE);
+    return makeToken(scanner, TOKEN_RIGHT_BRACE);
   case ';':
-    return makeToken(TOKEN_SEMICOLON);
+    return makeToken(scanner, TOKEN_SEMICOLON);
   case ',':
-    return makeToken(TOKEN_COMMA);
+    return makeToken(scanner, TOKEN_COMMA);
   case '.':
-    return makeToken(TOKEN_DOT);
+    return makeToken(scanner, TOKEN_DOT);
   case '-':
-    return makeToken(TOKEN_MINUS);
+    return makeToken(scanner, TOKEN_MINUS);
   case '+':
-    return makeToken(TOKEN_PLUS);
+    return makeToken(scanner, TOKEN_PLUS);
   case '/':
-    return makeToken(TOKEN_SLASH);
+    return makeToken(scanner, TOKEN_SLASH);
   case '*':
-    return makeToken(TOKEN_STAR);
+    return makeToken(scanner, TOKEN_STAR);
   case '!':
-    return makeToken(match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+    return makeToken(scanner,
+                     match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
   case '=':
-    return makeToken(match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+    return makeToken(scanner,
+                     match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
   case '<':
-    return makeToken(match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+    return makeToken(scanner,
+                     match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
   case '>':
-    return makeToken(match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+    return makeToken(scanner,
+                     match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
   case '"':
-    return string();
+    return string(scanner);
   }
 
-  return errorToken("Unexpected character.");
+  return errorToken(scanner, "Unexpected character.");
 }
\ No newline at end of file
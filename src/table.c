@@ -6,23 +6,314 @@
 #include "object.h"
 #include "table.h"
 #include "value.h"
+#include "vm.h"
 
+// Grow once this fraction of the slots (tombstones included) is in use,
+// override with -DTABLE_MAX_LOAD=<fraction>
+#ifndef TABLE_MAX_LOAD
 #define TABLE_MAX_LOAD 0.75
+#endif
+
+#ifdef SWISS_TABLE
+
+/*
+Swiss table. Next to the entries sits one control byte per slot:
+  CTRL_EMPTY    never used, ends a probe sequence
+  CTRL_DELETED  tombstone, probing carries on past it
+  0x00 - 0x7f   full, holds the low 7 bits of the key's hash (H2)
+Probing looks at GROUP_WIDTH control bytes at once. One SIMD compare against
+H2 finds every candidate in the group, so most misses never look at an entry
+at all. The remaining hash bits (H1) pick the first group, later groups follow
+a triangular sequence which visits every group of a power-of-two table.
+The control array has GROUP_WIDTH extra bytes mirroring the first group, so a
+group starting near the end can be loaded without wrapping.
+Empty and deleted entries keep a NULL key, so code that walks
+table->entries directly (the GC, tableAddAll()) works the same on both
+implementations.
+*/
+#define GROUP_WIDTH 16
+#define CTRL_EMPTY ((uint8_t)0x80)
+#define CTRL_DELETED ((uint8_t)0xfe)
+#define H1(hash) ((hash) >> 7)
+#define H2(hash) ((uint8_t)((hash)&0x7f))
+
+// A GroupMask has one set bit per matching slot, GROUP_MASK_SHIFT converts
+// a bit position into a slot offset within the group
+#if defined(__SSE2__)
+#include <emmintrin.h>
+
+typedef uint32_t GroupMask;
+#define GROUP_MASK_SHIFT 0
+
+static inline GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+  __m128i control = _mm_loadu_si128((const __m128i*)group);
+  __m128i match = _mm_cmpeq_epi8(control, _mm_set1_epi8((char)byte));
+  return (GroupMask)_mm_movemask_epi8(match);
+}
+
+// Empty and deleted are the only control bytes with the top bit set
+static inline GroupMask matchEmptyOrDeleted(const uint8_t* group) {
+  __m128i control = _mm_loadu_si128((const __m128i*)group);
+  return (GroupMask)_mm_movemask_epi8(control);
+}
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+
+// NEON has no movemask, narrowing the compare result leaves 4 bits per slot
+typedef uint64_t GroupMask;
+#define GROUP_MASK_SHIFT 2
+
+static inline GroupMask neonMask(uint8x16_t match) {
+  uint8x8_t narrowed = vshrn_n_u16(vreinterpretq_u16_u8(match), 4);
+  return vget_lane_u64(vreinterpret_u64_u8(narrowed), 0) &
+         0x8888888888888888ull;
+}
+
+static inline GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+  return neonMask(vceqq_u8(vld1q_u8(group), vdupq_n_u8(byte)));
+}
+
+static inline GroupMask matchEmptyOrDeleted(const uint8_t* group) {
+  int8x16_t control = vreinterpretq_s8_u8(vld1q_u8(group));
+  return neonMask(vcltq_s8(control, vdupq_n_s8(0)));
+}
+#else
+typedef uint32_t GroupMask;
+#define GROUP_MASK_SHIFT 0
+
+static inline GroupMask matchByte(const uint8_t* group, uint8_t byte) {
+  GroupMask mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++) {
+    if (group[i] == byte) mask |= (GroupMask)1 << i;
+  }
+  return mask;
+}
+
+static inline GroupMask matchEmptyOrDeleted(const uint8_t* group) {
+  GroupMask mask = 0;
+  for (int i = 0; i < GROUP_WIDTH; i++) {
+    if (group[i] & 0x80) mask |= (GroupMask)1 << i;
+  }
+  return mask;
+}
+#endif
+
+// Offset of the first matching slot, mask must not be 0
+static inline uint32_t lowestSlot(GroupMask mask) {
+#ifdef __GNUC__
+  return (uint32_t)__builtin_ctzll((unsigned long long)mask) >>
+         GROUP_MASK_SHIFT;
+#else
+  uint32_t bit = 0;
+  while (!(mask & 1)) {
+    mask >>= 1;
+    bit++;
+  }
+  return bit >> GROUP_MASK_SHIFT;
+#endif
+}
 
 void initTable(Table* table) {
   table->count = 0;
+  table->tombstones = 0;
   table->capacity = 0;
   table->entries = NULL;
+  table->control = NULL;
 }
 
-void freeTable(Table* table) {
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+void freeTable(VM* vm, Table* table) {
+  FREE_ARRAY(vm, Entry, table->entries, table->capacity);
+  if (table->capacity > 0) {
+    FREE_ARRAY(vm, uint8_t, table->control, table->capacity + GROUP_WIDTH);
+  }
+  initTable(table);
+}
+
+static void setControl(Table* table, uint32_t index, uint8_t control) {
+  table->control[index] = control;
+  // Keep the mirrored copy of the first group in sync
+  if (index < GROUP_WIDTH) table->control[table->capacity + index] = control;
+}
+
+// Index of the entry holding key, or -1
+static int findSlot(Table* table, ObjString* key) {
+  uint32_t mask = (uint32_t)table->capacity - 1;
+  uint8_t h2 = H2(key->hash);
+  uint32_t position = H1(key->hash) & mask;
+
+  for (uint32_t stride = GROUP_WIDTH;; stride += GROUP_WIDTH) {
+    const uint8_t* group = table->control + position;
+
+    for (GroupMask match = matchByte(group, h2); match != 0;
+         match &= match - 1) {
+      uint32_t index = (position + lowestSlot(match)) & mask;
+      if (table->entries[index].key == key) return (int)index;
+    }
+
+    // An empty slot means the key was never inserted past this point
+    if (matchByte(group, CTRL_EMPTY) != 0) return -1;
+    position = (position + stride) & mask;
+  }
+}
+
+// First empty or deleted slot on the probe sequence for hash
+static uint32_t findInsertSlot(Table* table, uint32_t hash) {
+  uint32_t mask = (uint32_t)table->capacity - 1;
+  uint32_t position = H1(hash) & mask;
+
+  for (uint32_t stride = GROUP_WIDTH;; stride += GROUP_WIDTH) {
+    GroupMask match = matchEmptyOrDeleted(table->control + position);
+    if (match != 0) return (position + lowestSlot(match)) & mask;
+    position = (position + stride) & mask;
+  }
+}
+
+bool tableGet(Table* table, ObjString* key, Value* value) {
+  if (table->count == 0) return false;
+
+  int index = findSlot(table, key);
+  if (index < 0) return false;
+
+  *value = table->entries[index].value;
+  return true;
+}
+
+static void adjustCapacity(VM* vm, Table* table, int capacity) {
+  // Both arrays are allocated before the old ones are touched, a collection
+  // triggered here still sees a consistent table
+  Entry* entries = ALLOCATE(vm, Entry, capacity);
+  uint8_t* control = ALLOCATE(vm, uint8_t, capacity + GROUP_WIDTH);
+
+  for (int i = 0; i < capacity; i++) {
+    entries[i].key = NULL;
+    entries[i].hash = 0;
+    entries[i].value = NIL_VAL;
+  }
+  memset(control, CTRL_EMPTY, capacity + GROUP_WIDTH);
+
+  Entry* oldEntries = table->entries;
+  uint8_t* oldControl = table->control;
+  int oldCapacity = table->capacity;
+
+  table->entries = entries;
+  table->control = control;
+  table->capacity = capacity;
+  table->count = 0; // tombstones are dropped
+  table->tombstones = 0;
+
+  for (int i = 0; i < oldCapacity; i++) {
+    Entry* entry = &oldEntries[i];
+    if (entry->key == NULL) continue;
+
+    uint32_t index = findInsertSlot(table, entry->hash);
+    setControl(table, index, H2(entry->hash));
+    table->entries[index] = *entry;
+    table->count++;
+  }
+
+  FREE_ARRAY(vm, Entry, oldEntries, oldCapacity);
+  if (oldCapacity > 0) {
+    FREE_ARRAY(vm, uint8_t, oldControl, oldCapacity + GROUP_WIDTH);
+  }
+}
+
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value) {
+  if (table->count > 0) {
+    int index = findSlot(table, key);
+    if (index >= 0) {
+      table->entries[index].value = value;
+      return false;
+    }
+  }
+
+  // Tombstones count towards the load, they lengthen probes just like keys
+  if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
+    // Groups are 16 wide, so that is the smallest table
+    int capacity = table->capacity < GROUP_WIDTH
+                       ? GROUP_WIDTH
+                       : GROW_CAPACITY(table->capacity);
+    // Mostly tombstones, rehashing in place is enough
+    if (table->capacity >= GROUP_WIDTH &&
+        (table->count - table->tombstones) * 2 <
+            table->capacity * TABLE_MAX_LOAD) {
+      capacity = table->capacity;
+    }
+    adjustCapacity(vm, table, capacity);
+  }
+
+  uint32_t index = findInsertSlot(table, key->hash);
+  if (table->control[index] == CTRL_DELETED) {
+    table->tombstones--;
+  } else {
+    table->count++;
+  }
+
+  setControl(table, index, H2(key->hash));
+  Entry* entry = &table->entries[index];
+  entry->key = key;
+  entry->hash = key->hash;
+  entry->value = value;
+  return true;
+}
+
+bool tableDelete(Table* table, ObjString* key) {
+  if (table->count == 0) return false;
+
+  int index = findSlot(table, key);
+  if (index < 0) return false;
+
+  // Same tombstone as the linear table so the entries read the same
+  Entry* entry = &table->entries[index];
+  entry->key = NULL;
+  entry->value = BOOL_VAL(true);
+  setControl(table, (uint32_t)index, CTRL_DELETED);
+  table->tombstones++;
+  return true;
+}
+
+ObjString* tableFindString(Table* table, const char* chars, int length,
+                           uint32_t hash) {
+  if (table->count == 0) return NULL;
+
+  uint32_t mask = (uint32_t)table->capacity - 1;
+  uint8_t h2 = H2(hash);
+  uint32_t position = H1(hash) & mask;
+
+  for (uint32_t stride = GROUP_WIDTH;; stride += GROUP_WIDTH) {
+    const uint8_t* group = table->control + position;
+
+    for (GroupMask match = matchByte(group, h2); match != 0;
+         match &= match - 1) {
+      Entry* entry = &table->entries[(position + lowestSlot(match)) & mask];
+      if (entry->hash == hash && entry->key->length == length &&
+          memcmp(entry->key->chars, chars, length) == 0) {
+        return entry->key;
+      }
+    }
+
+    if (matchByte(group, CTRL_EMPTY) != 0) return NULL;
+    position = (position + stride) & mask;
+  }
+}
+
+#else
+
+void initTable(Table* table) {
+  table->count = 0;
+  table->capacity = 0;
+  table->entries = NULL;
+}
+
+void freeTable(VM* vm, Table* table) {
+  FREE_ARRAY(vm, Entry, table->entries, table->capacity);
   initTable(table);
 }
 
 static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
-  // Use modulo to map the hash to an index in the array
-  uint32_t index = key->hash % capacity;
+  // The capacity is always a power of two, masking the hash maps it to an
+  // index in the array without the division a modulo would cost
+  uint32_t mask = (uint32_t)capacity - 1;
+  uint32_t index = key->hash & mask;
   Entry* tombstone = NULL;
 
   for (;;) {
@@ -46,8 +337,8 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
 
     // If we haven't found the key, but its also NULL - its a collision
     // So we start probing forwards
-    // modulo by the capacity to ensure we wrap around
-    index = (index + 1) % capacity;
+    // mask with the capacity to ensure we wrap around
+    index = (index + 1) & mask;
   }
 }
 
@@ -61,14 +352,15 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
   return true;
 }
 
-static void adjustCapacity(Table* table, int capacity) {
+static void adjustCapacity(VM* vm, Table* table, int capacity) {
   // Allocate a new array and wipe all its memory
-  Entry* entries = ALLOCATE(Entry, capacity);
+  Entry* entries = ALLOCATE(vm, Entry, capacity);
   table->count = 0; // reset the tombstones
 
   // Zero-out all the new memory
   for (int i = 0; i < capacity; i++) {
     entries[i].key = NULL;
+    entries[i].hash = 0;
     entries[i].value = NIL_VAL;
   }
 
@@ -81,22 +373,25 @@ static void adjustCapacity(Table* table, int capacity) {
     // If that hash slot is NULL it will return it as NULL so we just fill it in
     Entry* dest = findEntry(entries, capacity, entry->key);
     dest->key = entry->key;
+    dest->hash = entry->hash;
     dest->value = entry->value;
     table->count++;
   }
 
   // Free the old pointer in the table
-  FREE_ARRAY(Entry, table->entries, table->capacity);
+  FREE_ARRAY(vm, Entry, table->entries, table->capacity);
   // Point the table to the new memory
   table->entries = entries;
   table->capacity = capacity;
 }
 
-bool tableSet(Table* table, ObjString* key, Value value) {
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value) {
   // We grow the array before then, when the array becomes at least 75% full.
+  // GROW_CAPACITY() starts at 8 and doubles, which keeps the capacity a power
+  // of two as findEntry() expects
   if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
-    int capacity = GROW_CAPACITY(capacity);
-    adjustCapacity(table, capacity);
+    int capacity = GROW_CAPACITY(table->capacity);
+    adjustCapacity(vm, table, capacity);
   }
 
   Entry* entry = findEntry(table->entries, table->capacity, key);
@@ -106,6 +401,7 @@ bool tableSet(Table* table, ObjString* key, Value value) {
   if (isNewKey && isTombStone) table->count++;
 
   entry->key = key;
+  entry->hash = key->hash;
   entry->value = value;
 
   return isNewKey;
@@ -124,19 +420,12 @@ bool tableDelete(Table* table, ObjString* key) {
   return true;
 }
 
-void tableAddAll(Table* from, Table* to) {
-  for (int i = 0; i < from->capacity; i++) {
-    Entry* entry = &from->entries[i];
-
-    if (entry->key != NULL) { tableSet(to, entry->key, entry->value); }
-  }
-}
-
 ObjString* tableFindString(Table* table, const char* chars, int length,
                            uint32_t hash) {
   if (table->count == 0) return NULL;
 
-  uint32_t index = hash % table->capacity;
+  uint32_t mask = (uint32_t)table->capacity - 1;
+  uint32_t index = hash & mask;
   for (;;) {
     Entry* entry = &table->entries[index];
 
@@ -144,12 +433,52 @@ ObjString* tableFindString(Table* table, const char* chars, int length,
       // Stop if we find an empty non-tombstone entry
       if (IS_NIL(entry->value)) return NULL;
 
-    } else if (entry->key->length == length && entry->key->hash &&
+    } else if (entry->hash == hash && entry->key->length == length &&
                memcmp(entry->key->chars, chars, length) == 0) {
-      // We found it
+      // The cached hash rejects almost every miss without touching the key
       return entry->key;
     }
 
-    index = (index + 1) % table->capacity;
+    index = (index + 1) & mask;
+  }
+}
+
+#endif
+
+void tableAddAll(VM* vm, Table* from, Table* to) {
+  for (int i = 0; i < from->capacity; i++) {
+    Entry* entry = &from->entries[i];
+
+    if (entry->key != NULL) { tableSet(vm, to, entry->key, entry->value); }
+  }
+}
+
+// Used by the GC for tables that own their keys and values
+void markTable(VM* vm, Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    markObject(vm, (Obj*)entry->key);
+    markValue(vm, entry->value);
+  }
+}
+
+static bool isWhite(VM* vm, Obj* object) {
+#ifdef GC_GENERATIONAL
+  // Minor collections don't mark the old generation, it all survives
+  if (vm->minorGC && object->isOld) return false;
+#else
+  (void)vm;
+#endif
+  return !object->isMarked;
+}
+
+// Used by the GC for weak tables (the string intern table), every key that
+// didn't get marked is about to be freed so its entry becomes a tombstone
+void tableRemoveWhite(VM* vm, Table* table) {
+  for (int i = 0; i < table->capacity; i++) {
+    Entry* entry = &table->entries[i];
+    if (entry->key != NULL && isWhite(vm, (Obj*)entry->key)) {
+      tableDelete(table, entry->key);
+    }
   }
-}
\ No newline at end of file
+}
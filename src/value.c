@@ -13,7 +13,7 @@ void initValueArray(ValueArray* array) {
   array->values = NULL;
 }
 
-void writeValueArray(ValueArray* array, Value value) {
+void writeValueArray(VM* vm, ValueArray* array, Value value) {
   if (array->capacity < array->count + 1) {
     int oldCapacity = array->capacity;
     int newCapacity = GROW_CAPACITY(oldCapacity); // Double the capacity
@@ -28,18 +28,30 @@ void writeValueArray(ValueArray* array, Value value) {
     }
 
     array->capacity = newCapacity;
-    array->values = GROW_ARRAY(Value, array->values, oldCapacity, newCapacity);
+    array->values =
+        GROW_ARRAY(vm, Value, array->values, oldCapacity, newCapacity);
   }
   array->values[array->count] = value;
   array->count++;
 }
 
-void freeValueArray(ValueArray* array) {
-  FREE_ARRAY(Value, array->values, array->capacity);
+void freeValueArray(VM* vm, ValueArray* array) {
+  FREE_ARRAY(vm, Value, array->values, array->capacity);
   initValueArray(array);
 }
 
 void printValue(Value value) {
+#ifdef NAN_BOXING
+  if (IS_BOOL(value)) {
+    printf(AS_BOOL(value) ? "true" : "false");
+  } else if (IS_NIL(value)) {
+    printf("nil");
+  } else if (IS_NUMBER(value)) {
+    printf("%g", AS_NUMBER(value));
+  } else if (IS_OBJ(value)) {
+    printObject(value);
+  }
+#else
   // %g flag is for shortest possible representation of a float
   switch (value.type) {
   case VAL_BOOL:
@@ -54,11 +66,36 @@ void printValue(Value value) {
   case VAL_OBJ:
     printObject(value);
     break;
+  case VAL_UNDEFINED:
+    break; // Never reaches user code
+  }
+#endif
+}
+
+void writeValue(Output* output, Value value) {
+  if (IS_BOOL(value)) {
+    if (AS_BOOL(value)) {
+      writeOutput(output, "true", 4);
+    } else {
+      writeOutput(output, "false", 5);
+    }
+  } else if (IS_NIL(value)) {
+    writeOutput(output, "nil", 3);
+  } else if (IS_NUMBER(value)) {
+    writeNumber(output, AS_NUMBER(value));
+  } else if (IS_OBJ(value)) {
+    writeObject(output, value);
   }
 }
 
 // clang-format off
 bool valuesEqual(Value a, Value b) {
+#ifdef NAN_BOXING
+  // Compare numbers as doubles so that NaN != NaN and 0 == -0 still hold,
+  // everything else is equal only if the bits are identical
+  if (IS_NUMBER(a) && IS_NUMBER(b)) return AS_NUMBER(a) == AS_NUMBER(b);
+  return a == b;
+#else
   if (a.type != b.type) return false;
 
   switch(a.type) {
@@ -66,7 +103,9 @@ bool valuesEqual(Value a, Value b) {
     case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
     case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
+    case VAL_UNDEFINED: return true;
     default: return false; // unreachable
   }
+#endif
 }
-// clang-format on
\ No newline at end of file
+// clang-format on
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdarg.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -9,60 +10,103 @@
 #include "common.h"
 #include "compiler.h"
 #include "debug.h"
+#include "jit.h"
 #include "memory.h"
 #include "object.h"
+#include "profiler.h"
 #include "table.h"
 #include "value.h"
 #include "vm.h"
 
-VM vm;
-
 static Value clockNative(int argCount, Value* args) {
   return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
 }
 
-static void resetStack() {
+static void closeUpvalues(VM* vm, Value* last);
+
+static void resetStack(VM* vm) {
+  // Closures that outlive the unwound frames (stored in a global, say) keep
+  // the values they had instead of pointing at reused slots
+  closeUpvalues(vm, vm->stack);
   /*
   Because in C, the value an array gives you is just a pointer into
   its first element, by setting the stackTop to the stack itself
   it will set the stackTop to the pointer of the first element in the
   stack array
   */
-  vm.stackTop = vm.stack;
-  vm.frameCount = 0;
-  vm.openUpvalues = NULL;
+  vm->stackTop = vm->stack;
+  // Unwinding after a runtime error ends every call still in progress
+  for (int i = vm->frameCount - 1; i >= 0; i--) {
+    PROFILE_EXIT(vm, vm->frames[i].closure->function);
+  }
+  vm->frameCount = 0;
 }
 
-static void runtimeError(const char* format, ...) {
+static void runtimeError(VM* vm, const char* format, ...) {
+  // Everything the script printed comes before the error
+  flushOutput(&vm->output);
   va_list args;
   va_start(args, format);
   vfprintf(stderr, format, args);
   va_end(args);
   fputs("\n", stderr);
 
-  for (int i = vm.frameCount - 1; i >= 0; i--) {
-    CallFrame* frame = &vm.frames[i];
+  for (int i = vm->frameCount - 1; i >= 0; i--) {
+    CallFrame* frame = &vm->frames[i];
     ObjFunction* function = frame->closure->function;
     size_t instruction = frame->ip - function->chunk.code - 1;
-    fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+    fprintf(stderr, "[line %d] in ", getLine(&function->chunk, (int)instruction));
     if (function->name == NULL) {
       fprintf(stderr, "script\n");
     } else {
       fprintf(stderr, "%s()\n", function->name->chars);
     }
   }
-  resetStack();
+  resetStack(vm);
+}
+
+int resolveGlobal(VM* vm, ObjString* name) {
+  Value slot;
+  if (tableGet(&vm->globalNames, name, &slot)) return (int)AS_NUMBER(slot);
+  // writeValueArray() would exit() rather than grow past this
+  if (vm->globalValues.count == UINT16_MAX) return -1;
+
+  // The compiler hands us a freshly copied name, keep it reachable while the
+  // slot array and the name table grow
+  push(vm, OBJ_VAL(name));
+  int index = vm->globalValues.count;
+  writeValueArray(vm, &vm->globalValues, UNDEFINED_VAL);
+  tableSet(vm, &vm->globalNames, name, NUMBER_VAL((double)index));
+  pop(vm);
+  return index;
 }
 
-static void defineNative(const char* name, NativeFn function) {
-  push(OBJ_VAL(copyString(name, (int)strlen(name))));
-  push(OBJ_VAL(newNative(function)));
-  tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-  pop();
-  pop();
+ObjString* globalName(VM* vm, int slot) {
+  for (int i = 0; i < vm->globalNames.capacity; i++) {
+    Entry* entry = &vm->globalNames.entries[i];
+    if (entry->key != NULL && AS_NUMBER(entry->value) == slot) {
+      return entry->key;
+    }
+  }
+  return NULL;
 }
 
-void push(Value value) {
+static void defineNative(VM* vm, const char* name, NativeFn function) {
+  push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+  push(vm, OBJ_VAL(newNative(vm, function)));
+  int slot = resolveGlobal(vm, AS_STRING(vm->stack[0]));
+  vm->globalValues.values[slot] = vm->stack[1];
+  pop(vm);
+  pop(vm);
+}
+
+/*
+  The stack is reserved once in initVM() and never moves, so push and pop are
+  plain pointer bumps. There is no bounds check here, instead call() makes
+  sure the whole frame of the callee fits before it starts running (see
+  ObjFunction.maxStack).
+*/
+void push(VM* vm, Value value) {
   /*
   Before:
     stack:    [a][b][c][ ][ ][ ]
@@ -79,91 +123,65 @@ void push(Value value) {
   The value is written at the current stackTop position,
   then stackTop is incremented to point to the next empty slot.
 */
+  *vm->stackTop = value;
+  vm->stackTop++;
+}
 
-  if (((vm.stackTop - vm.stack) + 1) > STACK_MAX) {
-    fprintf(stderr, "Fatal error: Stack overflow\n");
-    exit(EXIT_FAILURE);
-  }
-
-  if (vm.stackCapacity < (vm.stackTop - vm.stack) + 1) {
-    int oldCapacity = vm.stackCapacity;
-    int newCapacity = GROW_CAPACITY(oldCapacity);
-    int stackIdx = vm.stackTop - vm.stack; // Count of currently utilized slots
-
-    Value* oldStack = vm.stack;
-    vm.stackCapacity = newCapacity;
-    vm.stack = GROW_ARRAY(Value, vm.stack, oldCapacity, newCapacity);
-
-    // Update stackTop to point to the new stack
-    vm.stackTop = vm.stack + stackIdx;
-
-    // Update all frame slots pointers to point to the new stack
-    for (int i = 0; i < vm.frameCount; i++) {
-      vm.frames[i].slots = vm.stack + (vm.frames[i].slots - oldStack);
-    }
-  }
-
-  *vm.stackTop = value;
-  vm.stackTop++;
+Value pop(VM* vm) {
+  vm->stackTop--;
+  return *vm->stackTop;
 }
 
-Value pop() {
-  // #ifdef DEBUG_TRACE_EXECUTION
-  //   *vm.stackTop = 0;
-  // #endif
-  if ((vm.stackTop - vm.stack) < vm.stackCapacity / 2) {
-    int oldCapacity = vm.stackCapacity;
-    int newCapacity = SHRINK_CAPACITY(oldCapacity);
-    int stackIdx = vm.stackTop - vm.stack; // Count of currently utilized slots
-
-    Value* oldStack = vm.stack;
-    vm.stackCapacity = newCapacity;
-    vm.stack = SHRINK_ARRAY(Value, vm.stack, oldCapacity, newCapacity);
-    vm.stackTop = vm.stack + stackIdx;
-
-    // Update all frame slots pointers to point to the new stack
-    for (int i = 0; i < vm.frameCount; i++) {
-      vm.frames[i].slots = vm.stack + (vm.frames[i].slots - oldStack);
-    }
-  }
+static Value peek(VM* vm, int distance) { return vm->stackTop[-1 - distance]; }
 
-  vm.stackTop--;
-  return *vm.stackTop;
-}
+// Room for another block of frames, false once maxFrames are in use.
+// Moves vm->frames, nothing may hold a CallFrame* across it
+static bool growFrames(VM* vm) {
+  if (vm->frameCapacity == vm->maxFrames) return false;
 
-static Value peek(int distance) { return vm.stackTop[-1 - distance]; }
+  int capacity = vm->frameCapacity + FRAMES_BLOCK;
+  if (capacity > vm->maxFrames) capacity = vm->maxFrames;
+  CallFrame* frames = realloc(vm->frames, sizeof(CallFrame) * capacity);
+  if (frames == NULL) return false;
+  vm->frames = frames;
+  vm->frameCapacity = capacity;
+  return true;
+}
 
-static bool call(ObjClosure* closure, int argCount) {
+static bool call(VM* vm, ObjClosure* closure, int argCount) {
   if (argCount != closure->function->arity) {
-    runtimeError("Expected %d arguments but got %d", closure->function->arity,
-                 argCount);
+    runtimeError(vm, "Expected %d arguments but got %d",
+                 closure->function->arity, argCount);
     return false;
   }
 
-  if (vm.frameCount == FRAMES_MAX) {
-    runtimeError("Stack overflow.");
+  // The callee's slot window starts at the function itself, make sure the
+  // deepest point the compiler found for it still fits in the stack
+  Value* slots = vm->stackTop - argCount - 1;
+  if ((vm->frameCount == vm->frameCapacity && !growFrames(vm)) ||
+      slots + closure->function->maxStack > vm->stackLimit) {
+    runtimeError(vm, "Stack overflow.");
     return false;
   }
 
-  CallFrame* frame = &vm.frames[vm.frameCount++];
+  CallFrame* frame = &vm->frames[vm->frameCount++];
   frame->closure = closure;
   frame->ip = closure->function->chunk.code;
-  frame->slots = vm.stackTop - argCount - 1;
+  frame->slots = slots;
+  PROFILE_ENTER(vm, closure->function);
   return true;
 }
 
-static bool callValue(Value callee, int argCount) {
+static bool callValue(VM* vm, Value callee, int argCount) {
   if (IS_OBJ(callee)) {
     switch (OBJ_TYPE(callee)) {
     case OBJ_CLOSURE:
-      return call(AS_CLOSURE(callee), argCount);
-    case OBJ_FUNCTION:
-      return call(AS_FUNCTION(callee), argCount);
+      return call(vm, AS_CLOSURE(callee), argCount);
     case OBJ_NATIVE: {
       NativeFn native = AS_NATIVE(callee);
-      Value result = native(argCount, vm.stackTop - argCount);
-      vm.stackTop -= argCount + 1;
-      push(result);
+      Value result = native(argCount, vm->stackTop - argCount);
+      vm->stackTop -= argCount + 1;
+      push(vm, result);
       return true;
     }
     default:
@@ -171,38 +189,31 @@ static bool callValue(Value callee, int argCount) {
     }
   }
 
-  runtimeError("Can only call functions and classes.");
+  runtimeError(vm, "Can only call functions and classes.");
   return false;
 }
 
-static ObjUpvalue* captureUpvalue(Value* local) {
-  ObjUpvalue* prevUpvalue = NULL;
-  ObjUpvalue* upvalue = vm.openUpvalues;
-  while (upvalue != NULL && upvalue->location > local) {
-    prevUpvalue = upvalue;
-    upvalue = upvalue->next;
-  }
-
-  if (upvalue != NULL && upvalue->location == local) { return upvalue; }
-
-  ObjUpvalue* createdUpvalue = newUpvalue(local);
-
-  if (prevUpvalue == NULL) {
-    vm.openUpvalues = createdUpvalue;
-  } else {
-    prevUpvalue->next = createdUpvalue;
-  }
+// Every closure capturing the same slot shares one upvalue
+static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
+  ObjUpvalue** open = &vm->openUpvalues[local - vm->stack];
+  if (*open == NULL) *open = newUpvalue(vm, local);
+  return *open;
+}
 
-  return createdUpvalue;
+// Moves the value of the slot into its upvalue, if anything captured it
+static void closeUpvalue(VM* vm, Value* slot) {
+  ObjUpvalue** open = &vm->openUpvalues[slot - vm->stack];
+  ObjUpvalue* upvalue = *open;
+  if (upvalue == NULL) return;
+  upvalue->closed = *slot;
+  WRITE_BARRIER(vm, upvalue, upvalue->closed);
+  upvalue->location = &upvalue->closed;
+  *open = NULL;
 }
 
-static void closeUpvalues(Value* last) {
-  while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-    ObjUpvalue* upvalue = vm.openUpvalues;
-    upvalue->closed = *upvalue->location;
-    upvalue->location = &upvalue->closed;
-    vm.openUpvalues = upvalue->next;
-  }
+// Every slot from last up to the stack top
+static void closeUpvalues(VM* vm, Value* last) {
+  for (Value* slot = last; slot < vm->stackTop; slot++) closeUpvalue(vm, slot);
 }
 
 /*
@@ -216,41 +227,125 @@ static bool isFalsey(Value value) {
   return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
-  ObjString* b = AS_STRING(pop());
-  ObjString* a = AS_STRING(pop());
+// Returns false, leaving the operands on the stack, when the result would be
+// longer than an int can count
+static bool concatenate(VM* vm) {
+  // Peek rather than pop, the operands have to stay visible to the GC until
+  // the result has been allocated
+  Obj* right = AS_OBJ(peek(vm, 0));
+  Obj* left = AS_OBJ(peek(vm, 1));
+  // Ropes make doubling a string cheap, so the sum can actually overflow
+  if (textLength(left) > INT_MAX - textLength(right)) return false;
   // Calculate the results string based on length of operands
-  int length = a->length + b->length;
-  // Allocate a char array for the result
-  char* chars = ALLOCATE(char, length + 1); // +1 for the null terminator '\0'
+  int length = textLength(left) + textLength(right);
+
+  // Long results are only linked up, see "Ropes" in include/object.h
+  if (length >= ROPE_MIN_LENGTH) {
+    ObjRope* rope = newRope(vm, left, right, length);
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(rope));
+    return true;
+  }
+
+  // Anything shorter than a rope is built from two plain strings, straight
+  // into the result
+  ObjString* b = (ObjString*)right;
+  ObjString* a = (ObjString*)left;
+  ObjString* result = newString(vm, length);
   // Copy the first half
-  memcpy(chars, a->chars, a->length);
+  memcpy(result->chars, a->chars, a->length);
   // Copy the second half
-  memcpy(chars + a->length, b->chars, b->length);
-  chars[length] = '\0';
+  memcpy(result->chars + a->length, b->chars, b->length);
 
-  ObjString* result = takeString(chars, length);
-  push(OBJ_VAL(result));
+  result = internString(vm, result);
+  pop(vm);
+  pop(vm);
+  push(vm, OBJ_VAL(result));
+  return true;
 }
 
-void initVM() {
-  resetStack();
-  vm.objects = NULL;
-  initTable(&vm.strings);
-  initTable(&vm.globals);
+void initVM(VM* vm) { initVMWithLimits(vm, FRAMES_MAX, STACK_MAX); }
+
+void initVMWithLimits(VM* vm, int maxFrames, int stackSlots) {
+  // The GC state has to be in place before the first allocation below
+  vm->objects = NULL;
+  vm->bytesAllocated = 0;
+  vm->nextGC = GC_INITIAL_HEAP;
+  vm->gcGrowFactor = GC_HEAP_GROW_FACTOR;
+  vm->grayCount = 0;
+  vm->grayCapacity = 0;
+  vm->grayStack = NULL;
+#ifdef GC_GENERATIONAL
+  vm->oldObjects = NULL;
+  vm->bytesSinceGC = 0;
+  vm->rememberedCount = 0;
+  vm->rememberedCapacity = 0;
+  vm->rememberedSet = NULL;
+  vm->minorGC = false;
+#endif
+  vm->gcStats = (GCStats){0};
+  vm->pools = (ObjectPools){0};
+  initOutput(&vm->output);
+  vm->parser = NULL;
+  vm->compileReportedErrors = false;
+  vm->mappedCaches = NULL;
+#ifdef PROFILE
+  vm->profiler = NULL;
+#endif
+  initTable(&vm->strings);
+  initTable(&vm->globalNames);
+  initValueArray(&vm->globalValues);
 
-  defineNative("clock", clockNative);
+  /*
+  Plain calloc(), not reallocate(): they aren't part of the heap the GC
+  sizes itself against, and the zeroed pages of a large stack are mapped
+  lazily, so slots no call reaches never use any memory.
+  */
+  vm->maxFrames = maxFrames > 0 ? maxFrames : 1;
+  vm->frameCapacity = 0;
+  vm->frames = NULL;
+  // Defining the natives and resolving globals push() before any call()
+  // checks the limit, so there is always at least one frame's window
+  vm->stackSlots = stackSlots > UINT8_COUNT ? stackSlots : UINT8_COUNT;
+  vm->stack = calloc(vm->stackSlots, sizeof(Value));
+  vm->openUpvalues = calloc(vm->stackSlots, sizeof(ObjUpvalue*));
+  if (vm->stack == NULL || vm->openUpvalues == NULL || !growFrames(vm)) {
+    fprintf(stderr, "Failed to allocate a stack of %d slots\n", vm->stackSlots);
+    exit(1);
+  }
+  vm->stackTop = vm->stack;
+  vm->stackLimit = vm->stack + vm->stackSlots;
+  resetStack(vm);
+
+  defineNative(vm, "clock", clockNative);
+}
+
+void freeVM(VM* vm) {
+#ifdef PROFILE
+  // The report reads function names, the objects have to still be around
+  stopProfiler(vm);
+#endif
+  freeOutput(&vm->output);
+  freeObjects(vm);
+  freeTable(vm, &vm->strings);
+  freeTable(vm, &vm->globalNames);
+  freeValueArray(vm, &vm->globalValues);
+  free(vm->stack);
+  free(vm->openUpvalues);
+  free(vm->frames);
+  vm->stack = NULL;
+  vm->stackTop = NULL;
+  vm->stackLimit = NULL;
+  vm->frames = NULL;
+  vm->frameCount = 0;
+  vm->frameCapacity = 0;
+  vm->openUpvalues = NULL;
 }
 
-void freeVM() {
-  freeObjects();
-  freeTable(&vm.strings);
-  freeTable(&vm.globals);
-  FREE_ARRAY(Value, vm.stack, vm.stackCapacity);
-  resetStack();
-  vm.stack = NULL;
-  vm.stackTop = NULL;
-  vm.stackCapacity = 0;
+// See quickening below
+static inline bool canQuicken(ObjFunction* function) {
+  return !function->isShared && !function->isCached;
 }
 
 /*
@@ -258,27 +353,107 @@ When the interpreter executes a user’s program.
 It will spend something like 90% of its time inside run().
 It is the beating heart of the VM.
 */
-static InterpretResult run() {
-  CallFrame* frame = &vm.frames[vm.frameCount - 1];
-
-#define READ_BYTE() (*frame->ip++)
-#define READ_SHORT()                                                           \
-  (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
-#define READ_CONSTANT()                                                        \
-  (frame->closure->function->chunk.constants.values[READ_BYTE()])
-#define READ_CONSTANT_LONG()                                                   \
-  (frame->function->chunk.constants.values[READ_SHORT()])
-#define READ_STRING() AS_STRING(READ_CONSTANT())
-#define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
-#define BINARY_OP(valueType, op)                                               \
+static InterpretResult run(VM* vm) {
+  /*
+  The hot state of the current frame lives in locals so the C compiler can
+  keep it in registers. `frame` escapes into callValue()/runtimeError(), so
+  reading frame->ip on every instruction would force a load and a store each
+  time. The cached copies are written back with SAVE_FRAME() before anything
+  walks vm->frames (calls and runtime errors) and reloaded with LOAD_FRAME()
+  whenever the current frame changes.
+  */
+  CallFrame* frame;
+  uint8_t* ip;
+  Value* slots;
+  Value* constants;
+  // Whether the function's opcodes may be quickened, tested by every generic
+  // arithmetic instruction
+  bool quicken;
+  // Only the compiler adds global slots, so the array can't move while we run
+  Value* globals = vm->globalValues.values;
+
+#define SAVE_FRAME() (frame->ip = ip)
+#define LOAD_FRAME()                                                           \
+  do {                                                                         \
+    frame = &vm->frames[vm->frameCount - 1];                                   \
+    ip = frame->ip;                                                            \
+    slots = frame->slots;                                                      \
+    constants = frame->closure->function->chunk.constants.values;              \
+    quicken = canQuicken(frame->closure->function);                            \
+  } while (false)
+#define RUNTIME_ERROR(...)                                                     \
+  do {                                                                         \
+    SAVE_FRAME();                                                              \
+    runtimeError(vm, __VA_ARGS__);                                             \
+    return INTERPRET_RUNTIME_ERROR;                                            \
+  } while (false)
+
+#ifdef JIT
+/*
+Wherever a frame starts or resumes running (a call, a return into it, a back
+edge) its function gets a little hotter, and once it has machine code the
+frame runs there until it reaches something only the interpreter does (see
+include/jit.h). Compiled calls and returns can leave a different frame on
+top, so the cached registers are reloaded from whichever one it is. Shared
+functions aren't counted, they got their code before anything ran them.
+*/
+#define ENTER_JIT()                                                            \
+  do {                                                                         \
+    ObjFunction* hot = frame->closure->function;                               \
+    if (hot->jit == NULL && !hot->isShared &&                                  \
+        ++hot->hotness == JIT_THRESHOLD) {                                     \
+      compileJit(hot);                                                         \
+    }                                                                          \
+    if (hot->jit != NULL) {                                                    \
+      runJit(vm, frame->closure, slots, ip);                                   \
+      LOAD_FRAME();                                                            \
+    }                                                                          \
+  } while (false)
+#else
+#define ENTER_JIT() ((void)0)
+#endif
+
+// push() and pop() inlined into the loop
+#define PUSH(value)                                                            \
+  do {                                                                         \
+    Value pushed = (value);                                                    \
+    *vm->stackTop++ = pushed;                                                  \
+  } while (false)
+#define POP() (*--vm->stackTop)
+#define READ_BYTE() (*ip++)
+#define READ_SHORT() (ip += 2, (uint16_t)((ip[-2] << 8) | ip[-1]))
+#define READ_CONSTANT() (constants[READ_BYTE()])
+#define READ_CONSTANT_LONG() (constants[READ_SHORT()])
+/*
+Quickening: the generic instruction checks its operands and, once they turn
+out to be numbers, rewrites its opcode (ip[-1]) to the _NUM variant. From
+then on NUMBER_OP only checks that they still are and otherwise rewrites it
+back and steps ip back, so the generic instruction runs on the same operands.
+Both leave the result in place of the left operand instead of popping twice
+and pushing. The bytecode of a shared function (see include/program.h) is
+never rewritten, other threads may be running it, and neither is bytecode
+mapped from a .loxc (see isCached in include/object.h).
+*/
+#define BINARY_OP(valueType, op, quickened)                                    \
+  do {                                                                         \
+    if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) {                  \
+      RUNTIME_ERROR("Operands must be numbers.");                              \
+    }                                                                          \
+    if (quicken) ip[-1] = quickened;                                           \
+    double b = AS_NUMBER(POP());                                               \
+    vm->stackTop[-1] = valueType(AS_NUMBER(vm->stackTop[-1]) op b);            \
+  } while (false)
+#define NUMBER_OP(valueType, op, generic)                                      \
   do {                                                                         \
-    if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) {                          \
-      runtimeError("Operands must be numbers.");                               \
-      return INTERPRET_RUNTIME_ERROR;                                          \
+    Value b = vm->stackTop[-1];                                                \
+    Value a = vm->stackTop[-2];                                                \
+    if (IS_NUMBER(a) && IS_NUMBER(b)) {                                        \
+      vm->stackTop[-2] = valueType(AS_NUMBER(a) op AS_NUMBER(b));              \
+      vm->stackTop--;                                                          \
+    } else {                                                                   \
+      ip[-1] = generic;                                                        \
+      ip--;                                                                    \
     }                                                                          \
-    double b = AS_NUMBER(pop());                                               \
-    double a = AS_NUMBER(pop());                                               \
-    push(valueType(a op b));                                                   \
   } while (false)
 
 #ifdef DEBUG_TRACE_EXECUTION
@@ -287,216 +462,486 @@ static InterpretResult run() {
   printf("-----|--------|------|--------------------|---------|----------------"
          "|-----------\n");
 
+#define TRACE_INSTRUCTION()                                                    \
+  disassembleInstructionWithStack(vm,                                          \
+      &frame->closure->function->chunk,                                        \
+      (int)(ip - frame->closure->function->chunk.code), vm->stack, vm->stackTop)
+#else
+#define TRACE_INSTRUCTION() ((void)0)
 #endif
 
-  for (;;) {
-#ifdef DEBUG_TRACE_EXECUTION
-    disassembleInstructionWithStack(
-        &frame->closure->function->chunk,
-        (int)(frame->ip - frame->closure->function->chunk.code), vm.stack,
-        vm.stackTop);
+/*
+  Threaded dispatch (GCC/Clang "labels as values")
+
+  Instead of jumping back to the top of one shared switch, every instruction
+  handler ends with its own indirect jump through a table of label addresses
+  indexed by opcode. There is no bounds check on the opcode, and because each
+  handler has its own jump the branch predictor can learn which instruction
+  usually follows which (OP_GET_LOCAL -> OP_CONSTANT -> OP_ADD ...).
+
+  The switch is kept as the portable fallback, CASE()/DISPATCH() expand to
+  either form so the handlers themselves are shared.
+*/
+#ifdef COMPUTED_GOTO
+  static void* dispatchTable[] = {
+      [OP_CONSTANT] = &&DO_OP_CONSTANT,
+      [OP_NIL] = &&DO_OP_NIL,
+      [OP_TRUE] = &&DO_OP_TRUE,
+      [OP_FALSE] = &&DO_OP_FALSE,
+      [OP_POP] = &&DO_OP_POP,
+      [OP_GET_LOCAL] = &&DO_OP_GET_LOCAL,
+      [OP_GET_GLOBAL] = &&DO_OP_GET_GLOBAL,
+      [OP_DEFINE_GLOBAL] = &&DO_OP_DEFINE_GLOBAL,
+      [OP_SET_LOCAL] = &&DO_OP_SET_LOCAL,
+      [OP_SET_GLOBAL] = &&DO_OP_SET_GLOBAL,
+      [OP_GET_UPVALUE] = &&DO_OP_GET_UPVALUE,
+      [OP_SET_UPVALUE] = &&DO_OP_SET_UPVALUE,
+      [OP_EQUAL] = &&DO_OP_EQUAL,
+      [OP_GREATER] = &&DO_OP_GREATER,
+      [OP_LESS] = &&DO_OP_LESS,
+      [OP_ADD] = &&DO_OP_ADD,
+      [OP_SUBTRACT] = &&DO_OP_SUBTRACT,
+      [OP_MULTIPLY] = &&DO_OP_MULTIPLY,
+      [OP_DIVIDE] = &&DO_OP_DIVIDE,
+      [OP_NOT] = &&DO_OP_NOT,
+      [OP_NEGATE] = &&DO_OP_NEGATE,
+      [OP_PRINT] = &&DO_OP_PRINT,
+      [OP_JUMP] = &&DO_OP_JUMP,
+      [OP_JUMP_IF_FALSE] = &&DO_OP_JUMP_IF_FALSE,
+      [OP_LOOP] = &&DO_OP_LOOP,
+      [OP_CALL] = &&DO_OP_CALL,
+      [OP_CLOSURE] = &&DO_OP_CLOSURE,
+      [OP_CLOSE_UPVALUE] = &&DO_OP_CLOSE_UPVALUE,
+      [OP_RETURN] = &&DO_OP_RETURN,
+      [OP_CONSTANT_LONG] = &&DO_OP_CONSTANT_LONG,
+      [OP_GET_GLOBAL_LONG] = &&DO_OP_GET_GLOBAL_LONG,
+      [OP_DEFINE_GLOBAL_LONG] = &&DO_OP_DEFINE_GLOBAL_LONG,
+      [OP_SET_GLOBAL_LONG] = &&DO_OP_SET_GLOBAL_LONG,
+      [OP_CLOSURE_LONG] = &&DO_OP_CLOSURE_LONG,
+      [OP_CALL_0] = &&DO_OP_CALL_0,
+      [OP_CALL_1] = &&DO_OP_CALL_1,
+      [OP_CALL_2] = &&DO_OP_CALL_2,
+      [OP_CALL_3] = &&DO_OP_CALL_3,
+      [OP_TAIL_CALL] = &&DO_OP_TAIL_CALL,
+      [OP_ADD_LOCAL_CONST] = &&DO_OP_ADD_LOCAL_CONST,
+      [OP_SET_LOCAL_POP] = &&DO_OP_SET_LOCAL_POP,
+      [OP_POP_JUMP_IF_FALSE] = &&DO_OP_POP_JUMP_IF_FALSE,
+      [OP_JUMP_IF_NOT_LESS_LOCALS] = &&DO_OP_JUMP_IF_NOT_LESS_LOCALS,
+      [OP_JUMP_IF_NOT_LESS_LOCAL_CONST] = &&DO_OP_JUMP_IF_NOT_LESS_LOCAL_CONST,
+      [OP_ADD_NUM] = &&DO_OP_ADD_NUM,
+      [OP_ADD_STR] = &&DO_OP_ADD_STR,
+      [OP_SUBTRACT_NUM] = &&DO_OP_SUBTRACT_NUM,
+      [OP_MULTIPLY_NUM] = &&DO_OP_MULTIPLY_NUM,
+      [OP_DIVIDE_NUM] = &&DO_OP_DIVIDE_NUM,
+      [OP_GREATER_NUM] = &&DO_OP_GREATER_NUM,
+      [OP_LESS_NUM] = &&DO_OP_LESS_NUM,
+  };
+
+#define INTERPRET_LOOP DISPATCH();
+#define CASE(opcode) DO_##opcode
+#define DISPATCH()                                                             \
+  do {                                                                         \
+    TRACE_INSTRUCTION();                                                       \
+    PROFILE_INSTRUCTION(vm, *ip);                                              \
+    goto* dispatchTable[instruction = READ_BYTE()];                            \
+  } while (false)
+#else
+#define INTERPRET_LOOP                                                         \
+  for (;;)                                                                     \
+    switch (TRACE_INSTRUCTION(), PROFILE_INSTRUCTION(vm, *ip),                 \
+            instruction = READ_BYTE())
+#define CASE(opcode) case opcode
+#define DISPATCH() break
 #endif
-    uint8_t instruction;
-    // clang-format off
-    switch (instruction = READ_BYTE()) {
-      case OP_CONSTANT: {
-        Value constant = READ_CONSTANT();
-        push(constant);
-        break;
-      }
-      case OP_NIL: push(NIL_VAL); break;
-      case OP_TRUE: push(BOOL_VAL(true)); break;
-      case OP_FALSE: push(BOOL_VAL(false)); break;
-      case OP_POP: pop(); break;
-      case OP_GET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        Value value;
-        if(!tableGet(&vm.globals, name, &value)) {
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
 
-        push(value);
-        break;
+  uint8_t instruction;
+  // Operand of the global and closure instructions, whose _LONG forms read it
+  // as a short and then jump into the byte sized handler
+  uint16_t index;
+  int argCount;
+  LOAD_FRAME();
+  PROFILE_RESUME(vm);
+  // clang-format off
+  INTERPRET_LOOP {
+    CASE(OP_CONSTANT): {
+      Value constant = READ_CONSTANT();
+      PUSH(constant);
+      DISPATCH();
+    }
+    CASE(OP_CONSTANT_LONG): {
+      Value constant = READ_CONSTANT_LONG();
+      PUSH(constant);
+      DISPATCH();
+    }
+    CASE(OP_NIL): PUSH(NIL_VAL); DISPATCH();
+    CASE(OP_TRUE): PUSH(BOOL_VAL(true)); DISPATCH();
+    CASE(OP_FALSE): PUSH(BOOL_VAL(false)); DISPATCH();
+    CASE(OP_POP): (void)POP(); DISPATCH();
+    CASE(OP_GET_GLOBAL_LONG): index = READ_SHORT(); goto getGlobal;
+    CASE(OP_GET_GLOBAL): {
+      index = READ_BYTE();
+    getGlobal:;
+      Value value = globals[index];
+      if(IS_UNDEFINED(value)) {
+        RUNTIME_ERROR("Undefined variable '%s'.", globalName(vm, index)->chars);
       }
-      case OP_GET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        push(frame->slots[slot]);
-        break;
+
+      PUSH(value);
+      DISPATCH();
+    }
+    CASE(OP_GET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      PUSH(slots[slot]);
+      DISPATCH();
+    }
+    CASE(OP_SET_GLOBAL_LONG): index = READ_SHORT(); goto setGlobal;
+    CASE(OP_SET_GLOBAL): {
+      index = READ_BYTE();
+    setGlobal:
+      // Assignment never creates a global, the slot must have been defined
+      if(IS_UNDEFINED(globals[index])) {
+        RUNTIME_ERROR("Undefined variable '%s'.", globalName(vm, index)->chars);
       }
-      case OP_SET_GLOBAL: {
-        ObjString* name = READ_STRING();
-        if(tableSet(&vm.globals, name, peek(0))) {
-          tableDelete(&vm.globals, name);
-          runtimeError("Undefined variable '%s'.", name->chars);
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      globals[index] = peek(vm, 0);
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL): {
+      uint8_t slot = READ_BYTE();
+      slots[slot] = peek(vm, 0);
+      DISPATCH();
+    }
+    CASE(OP_SET_LOCAL_POP): {
+      uint8_t slot = READ_BYTE();
+      slots[slot] = POP();
+      DISPATCH();
+    }
+    CASE(OP_DEFINE_GLOBAL_LONG): index = READ_SHORT(); goto defineGlobal;
+    CASE(OP_DEFINE_GLOBAL): {
+      index = READ_BYTE();
+    defineGlobal:
+      globals[index] = POP();
+      DISPATCH();
+    }
+    CASE(OP_GET_UPVALUE): {
+      uint8_t slot = READ_BYTE();
+      PUSH(*frame->closure->upvalues[slot]->location);
+      DISPATCH();
+    }
+    CASE(OP_SET_UPVALUE): {
+      uint8_t slot = READ_BYTE();
+      ObjUpvalue* upvalue = frame->closure->upvalues[slot];
+      *upvalue->location = peek(vm, 0);
+      WRITE_BARRIER(vm, upvalue, peek(vm, 0));
+      DISPATCH();
+    }
+    CASE(OP_EQUAL): {
+      // Strings are equal when they are the same interned object, a rope has
+      // to be interned before it can be compared
+      if (IS_ROPE(peek(vm, 0))) {
+        vm->stackTop[-1] = OBJ_VAL(flattenRope(vm, AS_ROPE(peek(vm, 0))));
       }
-      case OP_SET_LOCAL: {
-        uint8_t slot = READ_BYTE();
-        frame->slots[slot] = peek(0);
-        break;
+      if (IS_ROPE(peek(vm, 1))) {
+        vm->stackTop[-2] = OBJ_VAL(flattenRope(vm, AS_ROPE(peek(vm, 1))));
       }
-      case OP_DEFINE_GLOBAL: {
-        ObjString* name = READ_STRING();
-        tableSet(&vm.globals, name, peek(0));
-        pop();
-        break;
+      Value b = POP();
+      Value a = POP();
+
+      PUSH(BOOL_VAL(valuesEqual(a, b)));
+      DISPATCH();
+    }
+    CASE(OP_GREATER): BINARY_OP(BOOL_VAL, >, OP_GREATER_NUM); DISPATCH();
+    CASE(OP_LESS): BINARY_OP(BOOL_VAL, <, OP_LESS_NUM); DISPATCH();
+    CASE(OP_GREATER_NUM): NUMBER_OP(BOOL_VAL, >, OP_GREATER); DISPATCH();
+    CASE(OP_LESS_NUM): NUMBER_OP(BOOL_VAL, <, OP_LESS); DISPATCH();
+    CASE(OP_ADD_NUM): NUMBER_OP(NUMBER_VAL, +, OP_ADD); DISPATCH();
+    CASE(OP_ADD_STR): {
+      if (isText(peek(vm, 0)) && isText(peek(vm, 1))) {
+        if (!concatenate(vm)) RUNTIME_ERROR("String too long.");
+      } else {
+        ip[-1] = OP_ADD;
+        ip--;
       }
-      case OP_GET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        push(*frame->closure->upvalues[slot]->location);
-        break;
+      DISPATCH();
+    }
+    CASE(OP_ADD): {
+      // Only quicken when entered as OP_ADD, not from OP_ADD_LOCAL_CONST
+      if (!quicken) {
+        // Never quickened, see BINARY_OP
+      } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+        ip[-1] = OP_ADD_NUM;
+      } else if (isText(peek(vm, 0)) && isText(peek(vm, 1))) {
+        ip[-1] = OP_ADD_STR;
       }
-      case OP_SET_UPVALUE: {
-        uint8_t slot = READ_BYTE();
-        *frame->closure->upvalues[slot]->location = peek(0);
-        break;
+    addOperands:
+      if(isText(peek(vm, 0)) && isText(peek(vm, 1))) {
+        if (!concatenate(vm)) RUNTIME_ERROR("String too long.");
       }
-      case OP_EQUAL: {
-        Value b = pop();
-        Value a = pop();
+      else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+        double b = AS_NUMBER(POP());
+        double a = AS_NUMBER(POP());
 
-        push(BOOL_VAL(valuesEqual(a, b)));
-        break;
+        PUSH(NUMBER_VAL(a + b));
       }
-      case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-      case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
-      case OP_ADD: {
-        if(IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-          concatenate();
-        }
-        else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-          double b = AS_NUMBER(pop());
-          double a = AS_NUMBER(pop());
-
-          push(NUMBER_VAL(a + b));
-        }
-        else {
-          runtimeError("Operands must be two numbers or two strings.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
-        break;
+      else {
+        RUNTIME_ERROR("Operands must be two numbers or two strings.");
+      }
+      DISPATCH();
+    }
+    CASE(OP_ADD_LOCAL_CONST): {
+      Value a = slots[READ_BYTE()];
+      Value b = READ_CONSTANT();
+      if (IS_NUMBER(a) && IS_NUMBER(b)) {
+        PUSH(NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b)));
+        DISPATCH();
+      }
+      // Strings and type errors take the generic path
+      PUSH(a);
+      PUSH(b);
+      goto addOperands;
+    }
+    CASE(OP_SUBTRACT): BINARY_OP(NUMBER_VAL, -, OP_SUBTRACT_NUM); DISPATCH();
+    CASE(OP_MULTIPLY): BINARY_OP(NUMBER_VAL, *, OP_MULTIPLY_NUM); DISPATCH();
+    CASE(OP_DIVIDE): BINARY_OP(NUMBER_VAL, /, OP_DIVIDE_NUM); DISPATCH();
+    CASE(OP_SUBTRACT_NUM): NUMBER_OP(NUMBER_VAL, -, OP_SUBTRACT); DISPATCH();
+    CASE(OP_MULTIPLY_NUM): NUMBER_OP(NUMBER_VAL, *, OP_MULTIPLY); DISPATCH();
+    CASE(OP_DIVIDE_NUM): NUMBER_OP(NUMBER_VAL, /, OP_DIVIDE); DISPATCH();
+    CASE(OP_NOT): PUSH(BOOL_VAL(isFalsey(POP()))); DISPATCH();
+    CASE(OP_NEGATE): {
+      if (!IS_NUMBER(peek(vm, 0))) {
+        RUNTIME_ERROR("Operand must be a number.");
       }
-      case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-      case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
-      case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
-      case OP_NOT: push(BOOL_VAL(isFalsey(pop()))); break;
-      case OP_NEGATE: {
-        if (!IS_NUMBER(peek(0))) {
-          runtimeError("Operand must be a number.");
-          return INTERPRET_RUNTIME_ERROR;
-        }
 
-        push(NUMBER_VAL(-AS_NUMBER(pop())));
-        break;
+      PUSH(NUMBER_VAL(-AS_NUMBER(POP())));
+      DISPATCH();
+    }
+    CASE(OP_PRINT): {
+      writeValue(&vm->output, POP());
+      endLine(&vm->output);
+      DISPATCH();
+    }
+    CASE(OP_JUMP): {
+      uint16_t offset = READ_SHORT();
+      ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_LOOP): {
+      uint16_t offset = READ_SHORT();
+      ip -= offset;
+      ENTER_JIT();
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_FALSE): {
+      uint16_t offset = READ_SHORT();
+      // If top of stack is false - skip the block
+      if(isFalsey(peek(vm, 0))) ip += offset;
+      // Otherwise if the top of the stack evaluates to "true"
+      // We pop the "true" and start pumping through the block statement
+      DISPATCH();
+    }
+    CASE(OP_POP_JUMP_IF_FALSE): {
+      uint16_t offset = READ_SHORT();
+      // The condition is popped on both paths, see src/optimizer.c
+      if (isFalsey(POP())) ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS_LOCALS): {
+      Value a = slots[READ_BYTE()];
+      Value b = slots[READ_BYTE()];
+      uint16_t offset = READ_SHORT();
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        RUNTIME_ERROR("Operands must be numbers.");
       }
-      case OP_PRINT: {
-        printf("[OP_PRINT] ");
-        printValue(pop());
-        printf("\n");
-        break;
+      if (!(AS_NUMBER(a) < AS_NUMBER(b))) ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_JUMP_IF_NOT_LESS_LOCAL_CONST): {
+      Value a = slots[READ_BYTE()];
+      Value b = READ_CONSTANT();
+      uint16_t offset = READ_SHORT();
+      if (!IS_NUMBER(a) || !IS_NUMBER(b)) {
+        RUNTIME_ERROR("Operands must be numbers.");
       }
-      case OP_JUMP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip += offset;
-        break;
+      if (!(AS_NUMBER(a) < AS_NUMBER(b))) ip += offset;
+      DISPATCH();
+    }
+    CASE(OP_CALL_0): argCount = 0; goto invoke;
+    CASE(OP_CALL_1): argCount = 1; goto invoke;
+    CASE(OP_CALL_2): argCount = 2; goto invoke;
+    CASE(OP_CALL_3): argCount = 3; goto invoke;
+    CASE(OP_CALL): {
+      argCount = READ_BYTE();
+    invoke:;
+      /*
+      A closure whose arity matches and whose frame fits is pushed right here,
+      without going through callValue() and call(). Everything else, natives
+      and every error included, takes the general path.
+      */
+      Value callee = peek(vm, argCount);
+      if (IS_CLOSURE(callee)) {
+        ObjClosure* closure = AS_CLOSURE(callee);
+        ObjFunction* function = closure->function;
+        Value* calleeSlots = vm->stackTop - argCount - 1;
+        if (argCount == function->arity &&
+            vm->frameCount < vm->frameCapacity &&
+            calleeSlots + function->maxStack <= vm->stackLimit) {
+          SAVE_FRAME();
+          frame = &vm->frames[vm->frameCount++];
+          frame->closure = closure;
+          frame->ip = ip = function->chunk.code;
+          frame->slots = slots = calleeSlots;
+          constants = function->chunk.constants.values;
+          quicken = canQuicken(function);
+          PROFILE_ENTER(vm, function);
+          ENTER_JIT();
+          DISPATCH();
+        }
       }
-      case OP_LOOP: {
-        uint16_t offset = READ_SHORT();
-        frame->ip -= offset;
-        break;
+      SAVE_FRAME();
+      if(!callValue(vm, callee, argCount)) {
+        return INTERPRET_RUNTIME_ERROR;
       }
-      case OP_JUMP_IF_FALSE: {
-        uint16_t offset = READ_SHORT();
-        // If top of stack is false - skip the block
-        if(isFalsey(peek(0))) frame->ip += offset;
-        // Otherwise if the top of the stack evaluates to "true"
-        // We pop the "true" and start pumping through the block statement
-        break;
+      LOAD_FRAME();
+      ENTER_JIT();
+      DISPATCH();
+    }
+    CASE(OP_TAIL_CALL): {
+      argCount = READ_BYTE();
+      /*
+      The callee and its arguments are moved down over the returning frame's
+      window and the frame is reused, so a loop written as tail recursion
+      runs in constant space. Anything the fast path above wouldn't take
+      becomes an ordinary call, and the OP_RETURN after it returns the result.
+      */
+      Value callee = peek(vm, argCount);
+      if (IS_CLOSURE(callee)) {
+        ObjClosure* closure = AS_CLOSURE(callee);
+        ObjFunction* function = closure->function;
+        if (argCount == function->arity &&
+            slots + function->maxStack <= vm->stackLimit) {
+          // Its locals are about to be overwritten
+          if (frame->closure->function->hasCaptures) closeUpvalues(vm, slots);
+          PROFILE_EXIT(vm, frame->closure->function);
+          memmove(slots, vm->stackTop - argCount - 1,
+                  sizeof(Value) * (argCount + 1));
+          vm->stackTop = slots + argCount + 1;
+          frame->closure = closure;
+          ip = function->chunk.code;
+          constants = function->chunk.constants.values;
+          quicken = canQuicken(function);
+          PROFILE_ENTER(vm, function);
+          ENTER_JIT();
+          DISPATCH();
+        }
       }
-      case OP_CALL: {
-        int argCount = READ_BYTE();
-        if(!callValue(peek(argCount), argCount)) {
-          return INTERPRET_RUNTIME_ERROR;
+      goto invoke;
+    }
+    CASE(OP_CLOSURE_LONG): index = READ_SHORT(); goto makeClosure;
+    CASE(OP_CLOSURE): {
+      index = READ_BYTE();
+    makeClosure:;
+      ObjFunction* function = AS_FUNCTION(constants[index]);
+      if (function->upvalueCount == 0) {
+        if (function->shared == NULL) {
+          function->shared = newClosure(vm, function);
+          WRITE_BARRIER(vm, function, OBJ_VAL(function->shared));
         }
-        frame = &vm.frames[vm.frameCount-1];
-        break;
+        PUSH(OBJ_VAL(function->shared));
+        DISPATCH();
       }
-      case OP_CLOSURE: {
-        ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
-        ObjClosure* closure = newClosure(function);
-        push(OBJ_VAL(closure));
-        for(int i = 0; i < closure->upvalueCount; i ++) {
-          uint8_t isLocal = READ_BYTE();
-          uint8_t index = READ_BYTE();
-          if(isLocal) {
-            closure->upvalues[i] = captureUpvalue(frame->slots + index);
-          } else {
-            closure->upvalues[i] = frame->closure->upvalues[index];
-          }
+      ObjClosure* closure = newClosure(vm, function);
+      PUSH(OBJ_VAL(closure));
+      for(int i = 0; i < closure->upvalueCount; i ++) {
+        uint8_t isLocal = READ_BYTE();
+        uint8_t index = READ_BYTE();
+        if(isLocal) {
+          closure->upvalues[i] = captureUpvalue(vm, slots + index);
+        } else {
+          closure->upvalues[i] = frame->closure->upvalues[index];
         }
-        break;
+        // Capturing allocates, the closure may have been promoted meanwhile
+        WRITE_BARRIER(vm, closure, OBJ_VAL(closure->upvalues[i]));
       }
-      case OP_CLOSE_UPVALUE: {
-        closeUpvalues(vm.stackTop - 1);
-        pop();
-        break;
+      DISPATCH();
+    }
+    CASE(OP_CLOSE_UPVALUE): {
+      // The compiler only emits it for a captured local on top of the stack
+      closeUpvalue(vm, vm->stackTop - 1);
+      (void)POP();
+      DISPATCH();
+    }
+    CASE(OP_RETURN): {
+      // Pop the return value from the top of the stack
+      Value result = POP();
+
+      // Most functions never capture anything, their return skips the scan
+      if (frame->closure->function->hasCaptures) closeUpvalues(vm, slots);
+      PROFILE_EXIT(vm, frame->closure->function);
+      // Discard the completed call frame
+      vm->frameCount--;
+      
+      // If we're back to the top-level (frameCount == 0), we're exiting the script
+      if(vm->frameCount == 0) {
+        (void)POP(); // Pop the implicit script function from slot 0
+        return INTERPRET_OK; // Finish the program
       }
-      case OP_RETURN: {
-        // Pop the return value from the top of the stack
-        Value result = pop();
-
-        closeUpvalues(frame->slots);
-        // Discard the completed call frame
-        vm.frameCount--;
-        
-        // If we're back to the top-level (frameCount == 0), we're exiting the script
-        if(vm.frameCount == 0) {
-          pop(); // Pop the implicit script function from slot 0
-          return INTERPRET_OK; // Finish the program
-        }
 
-        // Otherwise, we're returning from a function call
-        // Discard all the slots used by the callee (including the function itself and arguments)
-        // by resetting stackTop to where the current frame started (frame->slots points to slot 0 of the callee)
-        vm.stackTop = frame->slots;
-        // Push the return value onto the stack (replacing where the function was)
-        push(result);
-        // Update the frame pointer to the previous (caller's) frame
-        frame = &vm.frames[vm.frameCount - 1];
-        break;
-      }
+      // Otherwise, we're returning from a function call
+      // Discard all the slots used by the callee (including the function itself and arguments)
+      // by resetting stackTop to where the current frame started (frame->slots points to slot 0 of the callee)
+      vm->stackTop = slots;
+      // Push the return value onto the stack (replacing where the function was)
+      PUSH(result);
+      // Update the frame pointer (and its cached registers) to the previous (caller's) frame
+      LOAD_FRAME();
+      ENTER_JIT();
+      DISPATCH();
     }
-    // clang-format on
   }
+  // clang-format on
 
+#undef SAVE_FRAME
+#undef LOAD_FRAME
+#undef RUNTIME_ERROR
+#undef PUSH
+#undef POP
 #undef READ_BYTE
 #undef READ_SHORT
 #undef READ_CONSTANT
+#undef READ_CONSTANT_LONG
 #undef BINARY_OP
-#undef READ_STRING
+#undef NUMBER_OP
+#undef ENTER_JIT
+#undef TRACE_INSTRUCTION
+#undef INTERPRET_LOOP
+#undef CASE
+#undef DISPATCH
 }
 
-InterpretResult interpret(const char* source) {
-  ObjFunction* function = compile(source);
+InterpretResult interpret(VM* vm, const char* source) {
+  ObjFunction* function = compile(vm, source);
   if (function == NULL) return INTERPRET_COMPILER_ERROR;
+  return interpretFunction(vm, function);
+}
 
+InterpretResult interpretFunction(VM* vm, ObjFunction* function) {
   // We keep the function on the stack while we create the closure so the GC
   // doesn't collect it
-  push(OBJ_VAL(function));
-  ObjClosure* closure = newClosure(function);
-  pop();
-  push(OBJ_VAL(closure));
-  call(closure, 0);
-  return run();
+  push(vm, OBJ_VAL(function));
+  ObjClosure* closure = newClosure(vm, function);
+  pop(vm);
+  push(vm, OBJ_VAL(closure));
+  // Even the script's own frame may not fit a small --stack
+  InterpretResult result =
+      call(vm, closure, 0) ? run(vm) : INTERPRET_RUNTIME_ERROR;
+  // An embedder reading the output, or the next REPL prompt, sees all of it
+  flushOutput(&vm->output);
+  return result;
 };
 
 // Stack can be seen in debugger, printing is not really needed
 // printf("          ");
 // // start at the beginning of the stack, keep going while not at the stack
-// top for (Value *slot = vm.stack; slot < vm.stackTop; slot++)
+// top for (Value *slot = vm->stack; slot < vm->stackTop; slot++)
 // {
 //   printf("[ ");
 //   printValue(*slot);
@@ -524,17 +969,17 @@ InterpretResult interpret(const char* source) {
       chunk->code        chunk->code+1       chunk->code+2
 
      Suppose:
-       vm.ip = chunk->code + 2;
+       vm->ip = chunk->code + 2;
 
      To get the offset:
-       offset = vm.ip - chunk->code; // == 2
+       offset = vm->ip - chunk->code; // == 2
 
        +-------------------+-------------------+-------------------+
        |   code[0]         |   code[1]         |   code[2]         |
        +-------------------+-------------------+-------------------+
                                                ^
                                                |
-                                             vm.ip
+                                             vm->ip
 
      So, disassembleInstruction(chunk, offset) will disassemble the
    instruction at code[2].